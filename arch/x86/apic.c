@@ -23,14 +23,23 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <apic.h>
+#include <cmdline.h>
 #include <console.h>
 #include <cpu.h>
+#include <cpuid.h>
+#include <errno.h>
 #include <ktf.h>
 #include <lib.h>
 #include <percpu.h>
 #include <processor.h>
+#include <setup.h>
+#include <string.h>
 #include <time.h>
 #include <traps.h>
+#include <tsc.h>
+
+#include <drivers/hpet.h>
+#include <smp/smp.h>
 
 static apic_mode_t apic_mode = APIC_MODE_UNKNOWN;
 
@@ -105,6 +114,49 @@ void apic_icr_write(const apic_icr_t *icr) {
         apic_msr_write(X2APIC_REG(APIC_ICR0), icr->reg);
 }
 
+/* Fixed delivery of vector to a single CPU in physical destination mode */
+void apic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    apic_icr_t icr;
+
+    memset(&icr, 0, sizeof(icr));
+    apic_icr_set_dest(&icr, apic_id);
+    icr.deliv_mode = APIC_DELIV_MODE_FIXED;
+    icr.vector = vector;
+
+    apic_wait_ready();
+    apic_icr_write(&icr);
+}
+
+void apic_send_self_ipi(uint8_t vector) {
+    apic_icr_t icr;
+
+    memset(&icr, 0, sizeof(icr));
+    icr.deliv_mode = APIC_DELIV_MODE_FIXED;
+    icr.dest_shorthand = APIC_DEST_SHORTHAND_SELF;
+    icr.vector = vector;
+
+    apic_wait_ready();
+    apic_icr_write(&icr);
+}
+
+static apic_bench_handler_t apic_bench_handler;
+
+/* The handler runs on whichever CPU got the benchmark IPI and has to signal the EOI
+ * itself, so that the cost of the EOI write can be part of the measurement or not.
+ */
+void apic_set_bench_handler(apic_bench_handler_t handler) {
+    ACCESS_ONCE(apic_bench_handler) = handler;
+}
+
+void apic_bench_ipi_interrupt_handler(void) {
+    apic_bench_handler_t handler = ACCESS_ONCE(apic_bench_handler);
+
+    if (handler)
+        handler();
+    else
+        apic_EOI();
+}
+
 apic_mode_t apic_get_mode(void) {
     return apic_mode;
 }
@@ -168,26 +220,70 @@ void init_apic(unsigned int cpu_id, apic_mode_t mode) {
     apic_write(APIC_SPIV, spiv.reg);
 }
 
+/* APIC timer calibration result of the BSP, shared with APs of the same model */
+static struct {
+    uint32_t signature;
+    uint32_t ticks_per_ms;
+} bsp_apic_timer_cal;
+
+static uint64_t read_tsc_ref(void) {
+    return rdtsc();
+}
+
+/* Count APIC timer ticks over CAL_TIME_MS worth of reference counter ticks */
+#define CAL_TIME_MS 10
+static uint32_t apic_timer_measure(uint64_t (*read_ref)(void), uint64_t ref_mask,
+                                   uint64_t ref_freq) {
+    uint64_t ref_ticks = ref_freq * CAL_TIME_MS / 1000;
+    uint64_t ref_start, ref_delta;
+    uint32_t apic_start, apic_end;
+    apic_lvt_timer_t timer;
+    unsigned long flags;
+
+    if (!ref_ticks)
+        return 0;
+
+    flags = interrupts_disable_save();
+
+    /* Masked one shot mode with the counter set to the max value (0xFFFFFFFF) */
+    timer.reg = 0;
+    timer.mask = APIC_LVT_MASKED;
+    timer.timer_mode = APIC_LVT_TIMER_ONE_SHOT;
+    apic_write(APIC_LVT_TIMER, timer.reg);
+    apic_write(APIC_TMR_DCR, APIC_TIMER_DIVIDE_BY_16);
+    apic_write(APIC_TMR_ICR, _U32(-1));
+
+    ref_start = read_ref();
+    apic_start = apic_read(APIC_TMR_CCR);
+    do {
+        ref_delta = (read_ref() - ref_start) & ref_mask;
+    } while (ref_delta < ref_ticks);
+    apic_end = apic_read(APIC_TMR_CCR);
+
+    apic_write(APIC_TMR_ICR, 0);
+    interrupts_restore(flags);
+
+    return (uint64_t) (apic_start - apic_end) * ref_freq / (ref_delta * 1000);
+}
+
+/* Legacy calibration against the global timer ticks: 10 iterations of 20ms each */
 #define CAL_SLEEP_TIME 20
 #define CAL_ITERATIONS 10
-void init_apic_timer(void) {
-    ASSERT(apic_get_mode() >= APIC_MODE_XAPIC);
+static uint32_t apic_timer_measure_ticks(void) {
     uint32_t min_ticks = _U32(-1);
-    int i;
-
     apic_lvt_timer_t timer;
-    printk("Initializing local APIC timer\n");
 
     /* Enable interrupts for calibration */
     unsigned long flags = interrupts_enable_save();
 
-    /* Spend 200ms calibrating the timer, 10 iterations of 20ms each */
-    for (i = 0; i < CAL_ITERATIONS; ++i) {
+    for (int i = 0; i < CAL_ITERATIONS; ++i) {
         /* Set the counter to the max value (0xFFFFFFFF) */
         apic_write(APIC_TMR_DCR, APIC_TIMER_DIVIDE_BY_16);
         apic_write(APIC_TMR_ICR, _U32(-1));
 
         /* One shot mode to see how many ticks over 20ms */
+        timer.reg = 0;
+        timer.mask = APIC_LVT_MASKED;
         timer.timer_mode = APIC_LVT_TIMER_ONE_SHOT;
         apic_write(APIC_LVT_TIMER, timer.reg);
 
@@ -201,14 +297,182 @@ void init_apic_timer(void) {
 
     interrupts_restore(flags);
 
-    /* Interrupt every min_ticks ticks */
+    return min_ticks;
+}
+
+static uint32_t apic_timer_calibrate(const char **method) {
+    uint32_t signature = cpuid_eax(CPUID_FEATURES_LEAF);
+    uint32_t ticks_per_ms = 0;
+
+    if (!is_cpu_bsp(get_cpu(smp_processor_id())) && bsp_apic_timer_cal.ticks_per_ms &&
+        bsp_apic_timer_cal.signature == signature) {
+        *method = "BSP";
+        return bsp_apic_timer_cal.ticks_per_ms;
+    }
+
+    if (hpet_available()) {
+        *method = "HPET";
+        ticks_per_ms = apic_timer_measure(hpet_read_counter, hpet_get_counter_mask(),
+                                          hpet_get_frequency());
+    }
+    else if (tsc_calibrated()) {
+        *method = "TSC";
+        ticks_per_ms = apic_timer_measure(read_tsc_ref, _U64(-1), get_tsc_frequency());
+    }
+    else if (boot_flags.timer_global) {
+        *method = "timer ticks";
+        ticks_per_ms = apic_timer_measure_ticks();
+    }
+
+    if (is_cpu_bsp(get_cpu(smp_processor_id()))) {
+        bsp_apic_timer_cal.signature = signature;
+        bsp_apic_timer_cal.ticks_per_ms = ticks_per_ms;
+    }
+
+    return ticks_per_ms;
+}
+
+void apic_timer_deadline_rearm(void) {
+    uint64_t period = PERCPU_GET(apic_timer_period);
+    uint64_t deadline = PERCPU_GET(apic_timer_deadline) + period;
+    uint64_t now = rdtsc();
+
+    /* Do not try to catch up with missed ticks */
+    if (deadline <= now)
+        deadline = now + period;
+
+    PERCPU_SET(apic_timer_deadline, deadline);
+    wrmsr(MSR_TSC_DEADLINE, deadline);
+}
+
+/* Program a one-shot timer event at expires (ktime_ns() based) in tickless mode */
+int apic_timer_set_next_event(ktime_t expires) {
+    uint64_t period = PERCPU_GET(apic_timer_period);
+    unsigned long flags;
+    ktime_t now;
+
+    if (!PERCPU_GET(apic_timer_enabled))
+        return -ENODEV;
+
+    if (!PERCPU_GET(apic_timer_tickless))
+        return -EINVAL;
+
+    if (!expires)
+        expires = 1;
+
+    flags = interrupts_disable_save();
+    PERCPU_SET(apic_timer_next, expires);
+
+    /* The event gets reprogrammed when the quiet window ends */
+    if (PERCPU_GET(apic_timer_quiet) > 0)
+        goto out;
+
+    if (PERCPU_GET(apic_timer_mode) == APIC_LVT_TIMER_TSC_DEADLINE) {
+        PERCPU_SET(apic_timer_deadline, ns_to_tsc(expires));
+        wrmsr(MSR_TSC_DEADLINE, ns_to_tsc(expires));
+    }
+    else {
+        uint64_t delta, ticks = 1;
+
+        now = ktime_ns();
+        delta = expires > now ? expires - now : 0;
+        if (delta / NSEC_PER_MSEC >= _U32(-1) / period)
+            ticks = _U32(-1);
+        else if (delta > 0)
+            ticks = max(delta * period / NSEC_PER_MSEC, _U64(1));
+        apic_write(APIC_TMR_ICR, (uint32_t) ticks);
+    }
+
+out:
+    interrupts_restore(flags);
+    return 0;
+}
+
+void apic_timer_cancel_event(void) {
+    unsigned long flags;
+
+    if (!PERCPU_GET(apic_timer_tickless))
+        return;
+
+    flags = interrupts_disable_save();
+    PERCPU_SET(apic_timer_next, 0);
+    if (PERCPU_GET(apic_timer_mode) == APIC_LVT_TIMER_TSC_DEADLINE)
+        wrmsr(MSR_TSC_DEADLINE, 0);
+    else
+        apic_write(APIC_TMR_ICR, 0);
+    interrupts_restore(flags);
+}
+
+void apic_timer_mask(bool mask) {
+    apic_lvt_timer_t timer;
+
+    timer.reg = apic_read(APIC_LVT_TIMER);
+    timer.mask = mask ? APIC_LVT_MASKED : APIC_LVT_UNMASKED;
+    apic_write(APIC_LVT_TIMER, timer.reg);
+}
+
+void init_apic_timer(void) {
+    ASSERT(apic_get_mode() >= APIC_MODE_XAPIC);
+    unsigned int cpu_id = smp_processor_id();
+    apic_lvt_timer_t timer;
+    const char *method;
+    uint32_t ticks;
+
+    printk("CPU%u: Initializing local APIC timer%s\n", cpu_id,
+           opt_apic_tickless ? " (tickless)" : "");
+
+    timer.reg = 0;
+    timer.vector = APIC_TIMER_IRQ_OFFSET;
+
+    PERCPU_SET(apic_timer_tickless, opt_apic_tickless);
+    PERCPU_SET(apic_timer_next, 0);
+
+    /* TSC-deadline mode does not need any calibration */
+    if (cpu_has_tsc_deadline() && tsc_calibrated()) {
+        timer.timer_mode = APIC_LVT_TIMER_TSC_DEADLINE;
+        apic_write(APIC_LVT_TIMER, timer.reg);
+
+        PERCPU_SET(apic_timer_mode, APIC_LVT_TIMER_TSC_DEADLINE);
+        PERCPU_SET(apic_timer_period, ns_to_tsc(NSEC_PER_MSEC));
+        PERCPU_SET(apic_timer_deadline, rdtsc());
+        PERCPU_SET(apic_timer_enabled, true);
+
+        /* Periodic tick emulation, tickless mode arms events on demand only */
+        if (!opt_apic_tickless)
+            apic_timer_deadline_rearm();
+
+        printk("CPU%u: APIC timer in TSC-deadline mode\n", cpu_id);
+        return;
+    }
+
+    ticks = apic_timer_calibrate(&method);
+    if (!ticks) {
+        warning("CPU%u: Unable to calibrate APIC timer", cpu_id);
+        return;
+    }
+    printk("CPU%u: APIC timer: %u ticks/ms (calibrated: %s)\n", cpu_id, ticks, method);
+
     apic_write(APIC_TMR_DCR, APIC_TIMER_DIVIDE_BY_16);
-    apic_write(APIC_TMR_ICR, min_ticks);
+    PERCPU_SET(apic_timer_period, ticks);
+
+    if (opt_apic_tickless) {
+        /* One shot mode, stopped until the first event gets programmed */
+        timer.timer_mode = APIC_LVT_TIMER_ONE_SHOT;
+        apic_write(APIC_LVT_TIMER, timer.reg);
+        apic_write(APIC_TMR_ICR, 0);
+
+        PERCPU_SET(apic_timer_mode, APIC_LVT_TIMER_ONE_SHOT);
+        PERCPU_SET(apic_timer_enabled, true);
+        return;
+    }
+
+    /* Interrupt every ticks ticks */
+    apic_write(APIC_TMR_ICR, ticks);
 
     /* Switch to periodic mode */
-    timer.vector = APIC_TIMER_IRQ_OFFSET;
     timer.timer_mode = APIC_LVT_TIMER_PERIODIC;
     apic_write(APIC_LVT_TIMER, timer.reg);
 
+    PERCPU_SET(apic_timer_mode, APIC_LVT_TIMER_PERIODIC);
     PERCPU_SET(apic_timer_enabled, true);
 }
@@ -0,0 +1,133 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <cacheinfo.h>
+#include <console.h>
+#include <cpu.h>
+#include <cpuid.h>
+#include <errno.h>
+#include <ktf.h>
+#include <lib.h>
+#include <string.h>
+
+/* Leaf describing the cache hierarchy of the current CPU, 0 if unavailable */
+static uint32_t cache_info_leaf(void) {
+    if (cpu_is_amd()) {
+        if (cpu_has_topoext() && cpuid_max_ext_leaf() >= CPUID_AMD_CACHE_LEAF)
+            return CPUID_AMD_CACHE_LEAF;
+        return 0;
+    }
+
+    if (cpuid_max_leaf() >= CPUID_CACHE_LEAF)
+        return CPUID_CACHE_LEAF;
+
+    return 0;
+}
+
+static bool parse_cache_desc(uint32_t leaf, uint32_t subleaf, cpu_cache_info_t *cache) {
+    uint32_t eax = 0, ebx = 0, ecx = subleaf, edx = 0;
+
+    cpuid(leaf, &eax, &ebx, &ecx, &edx);
+
+    cache->type = CPUID_CACHE_EAX_TYPE(eax);
+    if (cache->type == CPU_CACHE_NONE)
+        return false;
+
+    cache->level = CPUID_CACHE_EAX_LEVEL(eax);
+    cache->fully_assoc = !!(eax & CPUID_CACHE_EAX_FULLY_ASSOC);
+    cache->shared_cpus = CPUID_CACHE_EAX_SHARING(eax);
+    cache->line_size = CPUID_CACHE_EBX_LINE(ebx);
+    cache->partitions = CPUID_CACHE_EBX_PARTS(ebx);
+    cache->ways = CPUID_CACHE_EBX_WAYS(ebx);
+    cache->sets = CPUID_CACHE_ECX_SETS(ecx);
+    cache->inclusive = !!(edx & CPUID_CACHE_EDX_INCLUSIVE);
+    cache->size = (unsigned long) cache->ways * cache->partitions * cache->line_size *
+                  cache->sets;
+
+    return true;
+}
+
+/* Must be called on the CPU being described */
+int init_cpu_cache_info(cpu_t *cpu) {
+    cpu_caches_t *caches = &cpu->caches;
+    uint32_t leaf = cache_info_leaf();
+
+    memset(caches, 0, sizeof(*caches));
+    if (leaf == 0)
+        return -ENODEV;
+
+    for (uint32_t i = 0; i < ARRAY_SIZE(caches->caches); i++) {
+        if (!parse_cache_desc(leaf, i, &caches->caches[caches->nr]))
+            break;
+        caches->nr++;
+    }
+
+    return caches->nr > 0 ? 0 : -ENODEV;
+}
+
+const cpu_cache_info_t *get_cpu_cache_info(const cpu_t *cpu, unsigned int level,
+                                           cpu_cache_type_t type) {
+    const cpu_caches_t *caches = &cpu->caches;
+
+    for (unsigned int i = 0; i < caches->nr; i++) {
+        const cpu_cache_info_t *cache = &caches->caches[i];
+
+        if (cache->level == level && cache->type == type)
+            return cache;
+    }
+
+    return NULL;
+}
+
+/* Last level cache: the highest level data or unified cache */
+const cpu_cache_info_t *get_cpu_llc_info(const cpu_t *cpu) {
+    const cpu_caches_t *caches = &cpu->caches;
+    const cpu_cache_info_t *llc = NULL;
+
+    for (unsigned int i = 0; i < caches->nr; i++) {
+        const cpu_cache_info_t *cache = &caches->caches[i];
+
+        if (cache->type == CPU_CACHE_INSTRUCTION)
+            continue;
+        if (!llc || cache->level > llc->level)
+            llc = cache;
+    }
+
+    return llc;
+}
+
+void print_cpu_cache_info(const cpu_t *cpu) {
+    const cpu_caches_t *caches = &cpu->caches;
+
+    for (unsigned int i = 0; i < caches->nr; i++) {
+        const cpu_cache_info_t *cache = &caches->caches[i];
+
+        printk("CPU%u: L%u%s: %lu KB, %u-way, %u sets, %u B line, shared by %u%s%s\n",
+               cpu->id, cache->level, cpu_cache_type_name(cache->type),
+               cache->size / KB(1), cache->ways, cache->sets, cache->line_size,
+               cache->shared_cpus,
+               cache->fully_assoc ? ", fully associative" : "",
+               cache->inclusive ? ", inclusive" : "");
+    }
+}
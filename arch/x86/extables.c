@@ -24,12 +24,79 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <lib.h>
+#include <page.h>
+
 #include <mm/regions.h>
 
+/* The table gets sorted by fault address once, until then lookups scan it */
+static bool extables_sorted;
+
+static int extable_cmp(const void *a, const void *b) {
+    const extable_entry_t *x = a, *y = b;
+
+    return (x->fault_addr > y->fault_addr) - (x->fault_addr < y->fault_addr);
+}
+
+static void set_extables_prot(unsigned long l1_flags) {
+    for (mfn_t mfn = virt_to_mfn(__start_extables); mfn < virt_to_mfn(__end_extables);
+         mfn++)
+        kmap_4k(mfn, l1_flags);
+}
+
 void init_extables(void) {
+    size_t nr = __stop_extables - __start_extables;
+
     for (extable_entry_t *cur = __start_extables; cur < __stop_extables; ++cur) {
         if (!cur->fixup && !cur->cb)
             warning("extable entry #%lu for addr 0x%lx lacks fixup and callback!",
                     cur - __start_extables, cur->fault_addr);
+        if (cur->fault_end <= cur->fault_addr)
+            warning("extable entry #%lu for addr 0x%lx has an empty range!",
+                    cur - __start_extables, cur->fault_addr);
+    }
+
+    /* The section is mapped read-only, lift that for the duration of the sort */
+    set_extables_prot(L1_PROT);
+    sort(__start_extables, nr, sizeof(*__start_extables), extable_cmp);
+    set_extables_prot(L1_PROT_RO);
+
+    for (size_t i = 1; i < nr; i++) {
+        if (__start_extables[i].fault_addr < __start_extables[i - 1].fault_end)
+            warning("extable entries for addr 0x%lx and 0x%lx overlap!",
+                    __start_extables[i - 1].fault_addr, __start_extables[i].fault_addr);
     }
+
+    extables_sorted = true;
+}
+
+static inline bool extable_covers(const extable_entry_t *entry, unsigned long addr) {
+    return addr >= entry->fault_addr && addr < entry->fault_end;
+}
+
+const extable_entry_t *search_extables(unsigned long addr) {
+    size_t lo = 0, hi = __stop_extables - __start_extables;
+
+    if (unlikely(!extables_sorted)) {
+        for (extable_entry_t *cur = __start_extables; cur < __stop_extables; ++cur) {
+            if (extable_covers(cur, addr))
+                return cur;
+        }
+        return NULL;
+    }
+
+    /* Find the last entry starting at or below addr */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (__start_extables[mid].fault_addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo > 0 && extable_covers(&__start_extables[lo - 1], addr))
+        return &__start_extables[lo - 1];
+
+    return NULL;
 }
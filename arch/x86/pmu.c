@@ -0,0 +1,652 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <apic.h>
+#include <console.h>
+#include <cpuid.h>
+#include <errno.h>
+#include <ktf.h>
+#include <lib.h>
+#include <percpu.h>
+#include <pmu.h>
+#include <string.h>
+
+#include <smp/smp.h>
+
+struct pmu_encoding {
+    uint16_t event;
+    uint8_t umask;
+    int8_t fixed; /* Intel fixed counter counting the same event, -1 if none */
+};
+typedef struct pmu_encoding pmu_encoding_t;
+
+static pmu_info_t pmu_info;
+static const pmu_encoding_t *pmu_encodings;
+
+static pmu_event_t stat_events[PMU_MAX_EVENTS];
+static unsigned int stat_nr;
+static unsigned int stat_generation;
+static volatile unsigned int stat_session; /* 0 when no session is active */
+
+/* clang-format off */
+static const char *const pmu_event_names[PMU_EVENT_MAX] = {
+    [PMU_EVENT_CYCLES]           = "cycles",
+    [PMU_EVENT_INSTRUCTIONS]     = "instructions",
+    [PMU_EVENT_REF_CYCLES]       = "ref-cycles",
+    [PMU_EVENT_LLC_REFERENCES]   = "llc-references",
+    [PMU_EVENT_LLC_MISSES]       = "llc-misses",
+    [PMU_EVENT_BRANCHES]         = "branches",
+    [PMU_EVENT_BRANCH_MISSES]    = "branch-misses",
+    [PMU_EVENT_DTLB_MISSES]      = "dtlb-misses",
+    [PMU_EVENT_DTLB_WALK_CYCLES] = "dtlb-walk-cycles",
+};
+
+/* The first 7 events follow the CPUID.0AH:EBX architectural event order */
+static const pmu_encoding_t intel_encodings[PMU_EVENT_MAX] = {
+    [PMU_EVENT_CYCLES]           = { 0x3c, 0x00,  1 },
+    [PMU_EVENT_INSTRUCTIONS]     = { 0xc0, 0x00,  0 },
+    [PMU_EVENT_REF_CYCLES]       = { 0x3c, 0x01,  2 },
+    [PMU_EVENT_LLC_REFERENCES]   = { 0x2e, 0x4f, -1 },
+    [PMU_EVENT_LLC_MISSES]       = { 0x2e, 0x41, -1 },
+    [PMU_EVENT_BRANCHES]         = { 0xc4, 0x00, -1 },
+    [PMU_EVENT_BRANCH_MISSES]    = { 0xc5, 0x00, -1 },
+    /* DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK: model specific, but stable since Nehalem */
+    [PMU_EVENT_DTLB_MISSES]      = { 0x08, 0x01, -1 },
+    /* DTLB_LOAD_MISSES.WALK_DURATION, renamed WALK_PENDING since Skylake */
+    [PMU_EVENT_DTLB_WALK_CYCLES] = { 0x08, 0x10, -1 },
+};
+#define INTEL_ARCH_EVENTS (PMU_EVENT_BRANCH_MISSES + 1)
+
+/* Pre-Zen families (K8 through family 16h) */
+static const pmu_encoding_t amd_k7_encodings[PMU_EVENT_MAX] = {
+    [PMU_EVENT_CYCLES]           = { 0x076, 0x00, -1 },
+    [PMU_EVENT_INSTRUCTIONS]     = { 0x0c0, 0x00, -1 },
+    [PMU_EVENT_REF_CYCLES]       = { 0x000, 0x00, -1 },
+    [PMU_EVENT_LLC_REFERENCES]   = { 0x07d, 0x07, -1 },
+    [PMU_EVENT_LLC_MISSES]       = { 0x07e, 0x07, -1 },
+    [PMU_EVENT_BRANCHES]         = { 0x0c2, 0x00, -1 },
+    [PMU_EVENT_BRANCH_MISSES]    = { 0x0c3, 0x00, -1 },
+    [PMU_EVENT_DTLB_MISSES]      = { 0x046, 0x07, -1 },
+    [PMU_EVENT_DTLB_WALK_CYCLES] = { 0x000, 0x00, -1 },
+};
+
+/* Family 17h and later; L3 events live in a separate PMU, so LLC means L2 here */
+static const pmu_encoding_t amd_zen_encodings[PMU_EVENT_MAX] = {
+    [PMU_EVENT_CYCLES]           = { 0x076, 0x00, -1 },
+    [PMU_EVENT_INSTRUCTIONS]     = { 0x0c0, 0x00, -1 },
+    [PMU_EVENT_REF_CYCLES]       = { 0x000, 0x00, -1 },
+    [PMU_EVENT_LLC_REFERENCES]   = { 0x060, 0xff, -1 },
+    [PMU_EVENT_LLC_MISSES]       = { 0x064, 0x09, -1 },
+    [PMU_EVENT_BRANCHES]         = { 0x0c2, 0x00, -1 },
+    [PMU_EVENT_BRANCH_MISSES]    = { 0x0c3, 0x00, -1 },
+    [PMU_EVENT_DTLB_MISSES]      = { 0x045, 0xff, -1 },
+    [PMU_EVENT_DTLB_WALK_CYCLES] = { 0x000, 0x00, -1 },
+};
+/* clang-format on */
+
+const pmu_info_t *get_pmu_info(void) {
+    return &pmu_info;
+}
+
+const char *pmu_event_name(pmu_event_t event) {
+    if (event >= PMU_EVENT_MAX)
+        return "unknown";
+    return pmu_event_names[event];
+}
+
+int pmu_event_lookup(const char *name) {
+    for (pmu_event_t event = 0; event < PMU_EVENT_MAX; event++) {
+        if (!strcmp(pmu_event_names[event], name))
+            return event;
+    }
+
+    return -EINVAL;
+}
+
+static inline pmu_cpu_t *get_pmu_cpu(void) {
+    return &get_percpu_page(smp_processor_id())->pmu;
+}
+
+static inline uint32_t pmu_evtsel_msr(unsigned int idx) {
+    if (pmu_info.vendor == PMU_VENDOR_INTEL)
+        return MSR_IA32_PERFEVTSEL(idx);
+    if (pmu_info.nr_gp > PMU_AMD_K7_COUNTERS)
+        return MSR_F15H_PERF_CTL(idx);
+    return MSR_K7_EVNTSEL(idx);
+}
+
+static inline uint32_t pmu_counter_msr(const pmu_counter_t *c) {
+    if (c->fixed)
+        return MSR_IA32_FIXED_CTR(c->index);
+    if (pmu_info.vendor == PMU_VENDOR_INTEL)
+        return MSR_IA32_PMC(c->index);
+    if (pmu_info.nr_gp > PMU_AMD_K7_COUNTERS)
+        return MSR_F15H_PERF_CTR(c->index);
+    return MSR_K7_PERFCTR(c->index);
+}
+
+static inline bool pmu_global_ctrl(void) {
+    return pmu_info.vendor == PMU_VENDOR_INTEL && pmu_info.version >= 2;
+}
+
+static int __text_init init_pmu_intel(void) {
+    uint32_t eax, ebx = 0, ecx = 0, edx = 0;
+    unsigned int nr_arch;
+
+    if (cpuid_max_leaf() < CPUID_PERFMON_LEAF)
+        return -ENODEV;
+
+    cpuid(CPUID_PERFMON_LEAF, &eax, &ebx, &ecx, &edx);
+    pmu_info.version = eax & 0xff;
+    if (pmu_info.version == 0)
+        return -ENODEV;
+
+    pmu_info.nr_gp = min((eax >> 8) & 0xff, (uint32_t) PMU_MAX_GP_COUNTERS);
+    pmu_info.gp_width = (eax >> 16) & 0xff;
+    if (pmu_info.version > 1) {
+        pmu_info.nr_fixed = min(edx & 0x1f, (uint32_t) PMU_MAX_FIXED_COUNTERS);
+        pmu_info.fixed_width = (edx >> 5) & 0xff;
+    }
+
+    /* EBX bit set means the architectural event is NOT available */
+    nr_arch = min((eax >> 24) & 0xff, (uint32_t) INTEL_ARCH_EVENTS);
+    for (unsigned int i = 0; i < nr_arch; i++) {
+        if (!(ebx & (_U32(1) << i)))
+            pmu_info.events |= _U32(1) << i;
+    }
+    if (cpu_family() == 6) {
+        pmu_info.events |= _U32(1) << PMU_EVENT_DTLB_MISSES;
+        pmu_info.events |= _U32(1) << PMU_EVENT_DTLB_WALK_CYCLES;
+    }
+
+    pmu_encodings = intel_encodings;
+    return 0;
+}
+
+static int __text_init init_pmu_amd(void) {
+    pmu_info.version = 0;
+    pmu_info.nr_gp = cpu_has_perfctr_core() ? PMU_AMD_CORE_COUNTERS : PMU_AMD_K7_COUNTERS;
+    pmu_info.gp_width = 48;
+    pmu_encodings = cpu_family() >= 0x17 ? amd_zen_encodings : amd_k7_encodings;
+
+    for (pmu_event_t event = 0; event < PMU_EVENT_MAX; event++) {
+        if (pmu_encodings[event].event)
+            pmu_info.events |= _U32(1) << event;
+    }
+
+    return 0;
+}
+
+int __text_init init_pmu(void) {
+    uint64_t val;
+    int rc = -ENODEV;
+
+    memset(&pmu_info, 0, sizeof(pmu_info));
+
+    if (cpu_is_intel()) {
+        pmu_info.vendor = PMU_VENDOR_INTEL;
+        rc = init_pmu_intel();
+    }
+    else if (cpu_is_amd()) {
+        pmu_info.vendor = PMU_VENDOR_AMD;
+        rc = init_pmu_amd();
+    }
+
+    /* Hypervisors may advertise a PMU without backing the MSRs */
+    if (rc == 0 && (pmu_info.nr_gp == 0 || !rdmsr_safe(pmu_evtsel_msr(0), &val)))
+        rc = -ENODEV;
+
+    if (rc < 0) {
+        printk("PMU: No supported performance monitoring unit found\n");
+        memset(&pmu_info, 0, sizeof(pmu_info));
+        return rc;
+    }
+
+    printk("PMU: %s version %u, %u GP counters (%u bit), %u fixed counters (%u bit)\n",
+           pmu_info.vendor == PMU_VENDOR_INTEL ? "Intel" : "AMD", pmu_info.version,
+           pmu_info.nr_gp, pmu_info.gp_width, pmu_info.nr_fixed, pmu_info.fixed_width);
+    return 0;
+}
+
+/* Disable and forget all counters programmed on this CPU */
+void pmu_release(void) {
+    pmu_cpu_t *pmu = get_pmu_cpu();
+
+    if (!pmu_available())
+        return;
+
+    pmu_stop();
+    for (unsigned int i = 0; i < pmu->nr_counters; i++) {
+        if (!pmu->counters[i].fixed)
+            wrmsr(pmu_evtsel_msr(pmu->counters[i].index), 0);
+    }
+    if (pmu->fixed_ctrl)
+        wrmsr(MSR_IA32_FIXED_CTR_CTRL, 0);
+
+    pmu->nr_counters = 0;
+    memset(pmu->counters, 0, sizeof(pmu->counters));
+    pmu->global_ctrl = 0;
+    pmu->fixed_ctrl = 0;
+}
+
+/* GP counters left for pmu_setup(), the last one is taken while sampling */
+static inline unsigned int pmu_nr_gp(const pmu_cpu_t *pmu) {
+    return pmu->sampling ? pmu_info.nr_gp - 1 : pmu_info.nr_gp;
+}
+
+static inline void pmu_write_global_ctrl(const pmu_cpu_t *pmu) {
+    wrmsr(MSR_IA32_PERF_GLOBAL_CTRL,
+          (pmu->running ? pmu->global_ctrl : 0) | pmu->sample_ctrl);
+}
+
+/* Program this CPU's counters for the given events. Counting starts with pmu_start().
+ * Intel fixed counters are used where possible, GP counters otherwise.
+ */
+int pmu_setup(const pmu_event_t *events, unsigned int nr) {
+    pmu_cpu_t *pmu = get_pmu_cpu();
+    unsigned int gp = 0;
+
+    if (!pmu_available())
+        return -ENODEV;
+
+    pmu_release();
+
+    if (nr > PMU_MAX_EVENTS)
+        return -ENOSPC;
+
+    for (unsigned int i = 0; i < nr; i++) {
+        pmu_counter_t *c = &pmu->counters[i];
+        const pmu_encoding_t *enc;
+        int fixed;
+
+        if (events[i] >= PMU_EVENT_MAX || !pmu_has_event(events[i])) {
+            pmu_release();
+            return -ENODEV;
+        }
+
+        enc = &pmu_encodings[events[i]];
+        fixed = enc->fixed;
+        c->event = events[i];
+
+        if (fixed >= 0 && (unsigned int) fixed < pmu_info.nr_fixed &&
+            !(pmu->fixed_ctrl & (PMU_FIXED_CTRL_MASK << PMU_FIXED_CTRL_SHIFT(fixed)))) {
+            c->fixed = true;
+            c->index = fixed;
+            pmu->fixed_ctrl |= (PMU_FIXED_CTRL_OS | PMU_FIXED_CTRL_USR)
+                               << PMU_FIXED_CTRL_SHIFT(fixed);
+            pmu->global_ctrl |= _U64(1) << (PMU_GLOBAL_CTRL_FIXED_SHIFT + fixed);
+        }
+        else if (gp < pmu_nr_gp(pmu)) {
+            uint64_t evtsel = PMU_EVTSEL_EVENT(enc->event) |
+                              PMU_EVTSEL_UMASK(enc->umask) | PMU_EVTSEL_OS |
+                              PMU_EVTSEL_USR;
+
+            c->index = gp++;
+            /* With a global control MSR the enable bits can be set right away */
+            if (pmu_global_ctrl())
+                evtsel |= PMU_EVTSEL_EN;
+            wrmsr(pmu_evtsel_msr(c->index), evtsel);
+            pmu->global_ctrl |= _U64(1) << c->index;
+        }
+        else {
+            pmu_release();
+            return -ENOSPC;
+        }
+
+        pmu->nr_counters = i + 1;
+        wrmsr(pmu_counter_msr(c), 0);
+    }
+
+    if (pmu_global_ctrl() && pmu->fixed_ctrl)
+        wrmsr(MSR_IA32_FIXED_CTR_CTRL, pmu->fixed_ctrl);
+
+    return 0;
+}
+
+static void pmu_enable(pmu_cpu_t *pmu, bool enable) {
+    for (unsigned int i = 0; i < pmu->nr_counters; i++) {
+        const pmu_counter_t *c = &pmu->counters[i];
+        uint32_t msr = pmu_evtsel_msr(c->index);
+
+        if (c->fixed)
+            continue;
+
+        if (enable)
+            wrmsr(msr, rdmsr(msr) | PMU_EVTSEL_EN);
+        else
+            wrmsr(msr, rdmsr(msr) & ~PMU_EVTSEL_EN);
+    }
+
+    if (pmu->fixed_ctrl)
+        wrmsr(MSR_IA32_FIXED_CTR_CTRL, enable ? pmu->fixed_ctrl : 0);
+}
+
+void pmu_start(void) {
+    pmu_cpu_t *pmu = get_pmu_cpu();
+
+    if (pmu->nr_counters == 0 || pmu->running)
+        return;
+
+    pmu->running = true;
+    if (pmu_global_ctrl())
+        pmu_write_global_ctrl(pmu);
+    else
+        pmu_enable(pmu, true);
+}
+
+void pmu_stop(void) {
+    pmu_cpu_t *pmu = get_pmu_cpu();
+
+    if (!pmu->running)
+        return;
+
+    pmu->running = false;
+    if (pmu_global_ctrl())
+        pmu_write_global_ctrl(pmu);
+    else
+        pmu_enable(pmu, false);
+}
+
+void pmu_reset(void) {
+    pmu_cpu_t *pmu = get_pmu_cpu();
+
+    for (unsigned int i = 0; i < pmu->nr_counters; i++)
+        wrmsr(pmu_counter_msr(&pmu->counters[i]), 0);
+}
+
+static inline uint64_t pmu_width_mask(unsigned int width) {
+    return width < 64 ? (_U64(1) << width) - 1 : _U64(~0);
+}
+
+static inline uint64_t pmu_counter_mask(const pmu_counter_t *c) {
+    return pmu_width_mask(c->fixed ? pmu_info.fixed_width : pmu_info.gp_width);
+}
+
+/* Value of the idx-th event passed to pmu_setup() on this CPU */
+uint64_t pmu_read_counter(unsigned int idx) {
+    pmu_cpu_t *pmu = get_pmu_cpu();
+    const pmu_counter_t *c;
+
+    if (idx >= pmu->nr_counters)
+        return 0;
+
+    c = &pmu->counters[idx];
+    return rdpmc(c->fixed ? (RDPMC_FIXED | c->index) : c->index) & pmu_counter_mask(c);
+}
+
+/* Read all counters of this CPU in pmu_setup() order, returns their number */
+unsigned int pmu_read(uint64_t *values) {
+    unsigned int nr = get_pmu_cpu()->nr_counters;
+
+    for (unsigned int i = 0; i < nr; i++)
+        values[i] = pmu_read_counter(i);
+
+    return nr;
+}
+
+static inline pmu_counter_t pmu_sample_counter(void) {
+    pmu_counter_t c = {.fixed = false, .index = pmu_info.nr_gp - 1};
+
+    return c;
+}
+
+static inline void pmu_sample_arm(const pmu_cpu_t *pmu) {
+    pmu_counter_t c = pmu_sample_counter();
+
+    wrmsr(pmu_counter_msr(&c), -pmu->sample_period & pmu_width_mask(pmu_info.gp_width));
+}
+
+/* Raise an NMI on this CPU every period occurrences of the event */
+int pmu_sample_start(pmu_event_t event, uint64_t period) {
+    pmu_cpu_t *pmu = get_pmu_cpu();
+    pmu_counter_t c = pmu_sample_counter();
+    apic_lvt_pm_counters_t lvt;
+    const pmu_encoding_t *enc;
+
+    if (!pmu_available())
+        return -ENODEV;
+
+    if (event >= PMU_EVENT_MAX || !pmu_has_event(event))
+        return -ENODEV;
+
+    if (period == 0 || period >= PMU_MAX_SAMPLE_PERIOD)
+        return -EINVAL;
+
+    if (pmu->sampling)
+        return -EBUSY;
+
+    for (unsigned int i = 0; i < pmu->nr_counters; i++) {
+        if (!pmu->counters[i].fixed && pmu->counters[i].index == c.index)
+            return -EBUSY;
+    }
+
+    lvt.reg = 0;
+    lvt.deliv_mode = APIC_LVT_DELIV_MODE_NMI;
+    lvt.mask = APIC_LVT_UNMASKED;
+    apic_write(APIC_LVT_PMC, lvt.reg);
+
+    enc = &pmu_encodings[event];
+    pmu->sampling = true;
+    pmu->sample_period = period;
+    wrmsr(pmu_evtsel_msr(c.index), 0);
+    pmu_sample_arm(pmu);
+    wrmsr(pmu_evtsel_msr(c.index), PMU_EVTSEL_EVENT(enc->event) |
+                                       PMU_EVTSEL_UMASK(enc->umask) | PMU_EVTSEL_OS |
+                                       PMU_EVTSEL_USR | PMU_EVTSEL_INT | PMU_EVTSEL_EN);
+
+    if (pmu_global_ctrl()) {
+        pmu->sample_ctrl = _U64(1) << c.index;
+        pmu_write_global_ctrl(pmu);
+    }
+
+    return 0;
+}
+
+void pmu_sample_stop(void) {
+    pmu_cpu_t *pmu = get_pmu_cpu();
+    pmu_counter_t c = pmu_sample_counter();
+    apic_lvt_pm_counters_t lvt;
+
+    if (!pmu->sampling)
+        return;
+
+    if (pmu_global_ctrl()) {
+        pmu->sample_ctrl = 0;
+        pmu_write_global_ctrl(pmu);
+        wrmsr(MSR_IA32_PERF_GLOBAL_OVF, _U64(1) << c.index);
+    }
+    wrmsr(pmu_evtsel_msr(c.index), 0);
+
+    lvt.reg = 0;
+    lvt.deliv_mode = APIC_LVT_DELIV_MODE_NMI;
+    lvt.mask = APIC_LVT_MASKED;
+    apic_write(APIC_LVT_PMC, lvt.reg);
+
+    pmu->sampling = false;
+}
+
+/* NMI context: returns true if the sampling counter overflowed, then re-arms it */
+bool pmu_sample_overflow(void) {
+    pmu_cpu_t *pmu = get_pmu_cpu();
+    pmu_counter_t c = pmu_sample_counter();
+    apic_lvt_pm_counters_t lvt;
+    uint64_t val;
+
+    if (!pmu->sampling)
+        return false;
+
+    /* The counter was armed negative, a clear sign bit means it wrapped */
+    val = rdpmc(c.index) & pmu_width_mask(pmu_info.gp_width);
+    if (val & (_U64(1) << (pmu_info.gp_width - 1)))
+        return false;
+
+    pmu_sample_arm(pmu);
+    if (pmu_global_ctrl())
+        wrmsr(MSR_IA32_PERF_GLOBAL_OVF, _U64(1) << c.index);
+
+    /* Delivery of the PMI masks the LVT entry */
+    lvt.reg = 0;
+    lvt.deliv_mode = APIC_LVT_DELIV_MODE_NMI;
+    lvt.mask = APIC_LVT_UNMASKED;
+    apic_write(APIC_LVT_PMC, lvt.reg);
+
+    return true;
+}
+
+/* Start a counting session for the given events. CPUs join it lazily on their
+ * first pmu_stat_enter() and accumulate deltas until pmu_stat_end().
+ */
+int pmu_stat_begin(const pmu_event_t *events, unsigned int nr) {
+    int rc;
+
+    if (!pmu_available())
+        return -ENODEV;
+
+    if (nr == 0 || nr > PMU_MAX_EVENTS)
+        return -EINVAL;
+
+    /* Validate the event set on this CPU first */
+    rc = pmu_setup(events, nr);
+    if (rc < 0)
+        return rc;
+    pmu_release();
+
+    for (unsigned int i = 0; i < nr; i++)
+        stat_events[i] = events[i];
+    stat_nr = nr;
+    if (++stat_generation == 0)
+        stat_generation++;
+    smp_wmb();
+    stat_session = stat_generation;
+
+    return 0;
+}
+
+void pmu_stat_end(void) {
+    stat_session = 0;
+    smp_wmb();
+
+    if (pmu_available())
+        pmu_release();
+}
+
+/* Mark the start of work to be accounted to the current session on this CPU */
+void pmu_stat_enter(void) {
+    unsigned int session = stat_session;
+    pmu_cpu_t *pmu;
+
+    if (session == 0)
+        return;
+
+    pmu = get_pmu_cpu();
+    if (pmu->stat_session != session) {
+        smp_rmb();
+        if (pmu_setup(stat_events, stat_nr) == 0)
+            pmu_start();
+        memset(pmu->stat_delta, 0, sizeof(pmu->stat_delta));
+        pmu->stat_touched = false;
+        pmu->stat_depth = 0;
+        pmu->stat_suspended = false;
+        pmu->stat_session = session;
+    }
+
+    /* Tasks run from within a test only count once, as part of the outer region */
+    if (pmu->stat_depth++ == 0)
+        pmu_read(pmu->stat_snapshot);
+}
+
+static void pmu_stat_accumulate(pmu_cpu_t *pmu) {
+    for (unsigned int i = 0; i < pmu->nr_counters; i++) {
+        uint64_t now = pmu_read_counter(i);
+
+        pmu->stat_delta[i] +=
+            (now - pmu->stat_snapshot[i]) & pmu_counter_mask(&pmu->counters[i]);
+    }
+    pmu->stat_touched = true;
+}
+
+void pmu_stat_exit(void) {
+    unsigned int session = stat_session;
+    pmu_cpu_t *pmu;
+
+    if (session == 0)
+        return;
+
+    pmu = get_pmu_cpu();
+    if (pmu->stat_session != session || pmu->stat_depth == 0)
+        return;
+
+    if (--pmu->stat_depth > 0 || pmu->stat_suspended)
+        return;
+
+    pmu_stat_accumulate(pmu);
+}
+
+/* Lend this CPU's counters to a test doing its own counting with pmu_setup(). The
+ * session counts so far are kept, pmu_stat_resume() reprograms the session events.
+ * Events of the lent out period are not accounted to the session.
+ */
+void pmu_stat_suspend(void) {
+    unsigned int session = stat_session;
+    pmu_cpu_t *pmu;
+
+    if (session == 0)
+        return;
+
+    pmu = get_pmu_cpu();
+    if (pmu->stat_session != session || pmu->stat_depth == 0 || pmu->stat_suspended)
+        return;
+
+    pmu_stat_accumulate(pmu);
+    pmu->stat_suspended = true;
+}
+
+void pmu_stat_resume(void) {
+    pmu_cpu_t *pmu = get_pmu_cpu();
+
+    if (!pmu->stat_suspended)
+        return;
+
+    pmu->stat_suspended = false;
+    if (stat_session == 0 || pmu->stat_session != stat_session)
+        return;
+
+    if (pmu_setup(stat_events, stat_nr) == 0)
+        pmu_start();
+    pmu_read(pmu->stat_snapshot);
+}
+
+/* Deltas accumulated by a CPU in the current session, in pmu_stat_begin() order.
+ * Returns the number of values, 0 if the CPU did not take part.
+ */
+unsigned int pmu_stat_get(unsigned int cpu, uint64_t *deltas) {
+    const pmu_cpu_t *pmu = &get_percpu_page(cpu)->pmu;
+
+    if (stat_session == 0 || pmu->stat_session != stat_session || !pmu->stat_touched)
+        return 0;
+
+    for (unsigned int i = 0; i < pmu->nr_counters; i++)
+        deltas[i] = pmu->stat_delta[i];
+    return pmu->nr_counters;
+}
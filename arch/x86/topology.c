@@ -0,0 +1,152 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <cacheinfo.h>
+#include <cpu.h>
+#include <cpuid.h>
+#include <errno.h>
+#include <ktf.h>
+#include <lib.h>
+#include <string.h>
+#include <topology.h>
+
+#define CPUID_TOPO_MAX_LEVELS 8
+
+/* Number of APIC ID bits used to enumerate up to count entities */
+static inline unsigned int topo_order(unsigned int count) {
+    return count > 1 ? log2(count - 1) + 1 : 0;
+}
+
+/* Walk the CPUID.0BH or CPUID.1FH levels. Each level reports the shift needed to get
+ * the ID of the next level up, so the last one gives the package ID.
+ */
+static bool parse_topology_leaf(uint32_t leaf, uint32_t *apic_id, unsigned int *smt_shift,
+                                unsigned int *die_shift, unsigned int *pkg_shift) {
+    unsigned int prev_shift = 0, levels = 0;
+    bool has_die = false;
+
+    if (cpuid_max_leaf() < leaf)
+        return false;
+
+    for (uint32_t subleaf = 0; subleaf < CPUID_TOPO_MAX_LEVELS; subleaf++) {
+        uint32_t eax = 0, ebx = 0, ecx = subleaf, edx = 0;
+        unsigned int shift;
+
+        cpuid(leaf, &eax, &ebx, &ecx, &edx);
+        if (CPUID_TOPO_ECX_TYPE(ecx) == CPUID_TOPO_INVALID || (ebx & 0xffff) == 0)
+            break;
+
+        shift = CPUID_TOPO_EAX_SHIFT(eax);
+        switch (CPUID_TOPO_ECX_TYPE(ecx)) {
+        case CPUID_TOPO_SMT:
+            *smt_shift = shift;
+            break;
+        case CPUID_TOPO_DIE:
+            *die_shift = prev_shift;
+            has_die = true;
+            break;
+        default:
+            break;
+        }
+
+        *apic_id = edx;
+        *pkg_shift = prev_shift = shift;
+        levels++;
+    }
+
+    if (levels == 0)
+        return false;
+
+    if (!has_die)
+        *die_shift = *pkg_shift;
+
+    return true;
+}
+
+/* Pre-CPUID.0BH processors: derive the ID layout from the logical and core counts */
+static void parse_legacy_topology(uint32_t *apic_id, unsigned int *smt_shift,
+                                  unsigned int *pkg_shift) {
+    uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+    unsigned int logical = 1, cores = 1, threads = 1;
+
+    cpuid(CPUID_FEATURES_LEAF, &eax, &ebx, &ecx, &edx);
+    *apic_id = ebx >> 24;
+    if (edx & CPUID_FEAT_EDX_HTT)
+        logical = max((ebx >> 16) & 0xff, 1U);
+
+    if (cpu_is_amd() && cpuid_max_ext_leaf() >= CPUID_EXT_ADDR_LEAF) {
+        ecx = cpuid_ecx(CPUID_EXT_ADDR_LEAF);
+        cores = CPUID_EXT_ADDR_ECX_NC(ecx);
+        *pkg_shift = CPUID_EXT_ADDR_ECX_CORE_BITS(ecx) ?: topo_order(cores);
+
+        if (cpu_has_topoext())
+            threads = CPUID_AMD_TOPO_EBX_THREADS(cpuid_ebx(CPUID_AMD_TOPOLOGY_LEAF));
+        *smt_shift = topo_order(threads);
+        return;
+    }
+
+    if (cpuid_max_leaf() >= CPUID_CACHE_LEAF)
+        cores = ((cpuid_eax(CPUID_CACHE_LEAF) >> 26) & 0x3f) + 1;
+    if (logical > cores)
+        threads = logical / cores;
+
+    *pkg_shift = topo_order(logical);
+    *smt_shift = topo_order(threads);
+}
+
+/* Must be called on the CPU being described, after init_cpu_cache_info() */
+int init_cpu_topology(cpu_t *cpu) {
+    cpu_topology_t *topo = &cpu->topology;
+    unsigned int smt_shift = 0, die_shift = 0, pkg_shift = 0, llc_shift;
+    const cpu_cache_info_t *llc;
+    uint32_t apic_id = 0;
+
+    memset(topo, 0, sizeof(*topo));
+
+    if (!parse_topology_leaf(CPUID_TOPOLOGY2_LEAF, &apic_id, &smt_shift, &die_shift,
+                             &pkg_shift) &&
+        !parse_topology_leaf(CPUID_TOPOLOGY_LEAF, &apic_id, &smt_shift, &die_shift,
+                             &pkg_shift)) {
+        parse_legacy_topology(&apic_id, &smt_shift, &pkg_shift);
+        die_shift = pkg_shift;
+    }
+
+    llc = get_cpu_llc_info(cpu);
+    llc_shift = llc ? topo_order(llc->shared_cpus) : pkg_shift;
+
+    topo->apic_id = apic_id;
+    topo->thread = apic_id & ((1U << smt_shift) - 1);
+    topo->core = apic_id >> smt_shift;
+    topo->die = apic_id >> die_shift;
+    topo->package = apic_id >> pkg_shift;
+    topo->llc = apic_id >> llc_shift;
+
+    /* AMD reports the node (die) ID directly */
+    if (cpu_is_amd() && cpu_has_topoext())
+        topo->die = CPUID_AMD_TOPO_ECX_NODE(cpuid_ecx(CPUID_AMD_TOPOLOGY_LEAF));
+
+    cpu->flags.topology = true;
+
+    return 0;
+}
@@ -32,6 +32,7 @@
 #include <ktf.h>
 #include <mm/regions.h>
 #include <percpu.h>
+#include <profiler.h>
 #include <segment.h>
 #include <symbols.h>
 #include <traps.h>
@@ -45,6 +46,9 @@ extern void asm_interrupt_handler_keyboard(void);
 extern void asm_interrupt_handler_timer(void);
 extern void asm_interrupt_handler_dummy(void);
 extern void asm_interrupt_handler_apic_timer(void);
+extern void asm_interrupt_handler_hpet_event(void);
+extern void asm_interrupt_handler_hrtimer_ipi(void);
+extern void asm_interrupt_handler_apic_bench_ipi(void);
 
 extern void terminate_user_task(void);
 
@@ -72,7 +76,9 @@ static void init_tss(percpu_t *percpu) {
     percpu->tss.cr3 = _ul(cr3.reg);
 #elif defined(__x86_64__)
     percpu->tss.rsp0 = _ul(get_free_page_top(GFP_KERNEL | GFP_USER));
-    percpu->tss.ist[0] = _ul(get_free_page_top(GFP_KERNEL | GFP_USER));
+    percpu->tss.ist[IST_DF - 1] = _ul(get_free_page_top(GFP_KERNEL | GFP_USER));
+    /* NMIs may hit anywhere, including entry code running on a user stack */
+    percpu->tss.ist[IST_NMI - 1] = _ul(get_free_page_top(GFP_KERNEL | GFP_USER));
 #endif
     percpu->tss.iopb = sizeof(percpu->tss);
 
@@ -135,7 +141,7 @@ void init_traps(const cpu_t *cpu) {
     /* clang-format off */
     set_intr_gate(&percpu->idt[X86_EX_DE],  __KERN_CS, _ul(entry_DE),  GATE_DPL0, GATE_PRESENT, 0);
     set_intr_gate(&percpu->idt[X86_EX_DB],  __KERN_CS, _ul(entry_DB),  GATE_DPL0, GATE_PRESENT, 0);
-    set_intr_gate(&percpu->idt[X86_EX_NMI], __KERN_CS, _ul(entry_NMI), GATE_DPL0, GATE_PRESENT, 0);
+    set_intr_gate(&percpu->idt[X86_EX_NMI], __KERN_CS, _ul(entry_NMI), GATE_DPL0, GATE_PRESENT, IST_NMI);
     set_intr_gate(&percpu->idt[X86_EX_BP],  __KERN_CS, _ul(entry_BP),  GATE_DPL3, GATE_PRESENT, 0);
     set_intr_gate(&percpu->idt[X86_EX_OF],  __KERN_CS, _ul(entry_OF),  GATE_DPL3, GATE_PRESENT, 0);
     set_intr_gate(&percpu->idt[X86_EX_BR],  __KERN_CS, _ul(entry_BR),  GATE_DPL0, GATE_PRESENT, 0);
@@ -154,7 +160,7 @@ void init_traps(const cpu_t *cpu) {
     set_intr_gate(&percpu->idt[X86_EX_VE],  __KERN_CS, _ul(entry_VE),  GATE_DPL0, GATE_PRESENT, 0);
     set_intr_gate(&percpu->idt[X86_EX_SE],  __KERN_CS, _ul(entry_SE),  GATE_DPL0, GATE_PRESENT, 0);
 #if defined(__x86_64__)
-    set_intr_gate(&percpu->idt[X86_EX_DF],  __KERN_CS, _ul(entry_DF),  GATE_DPL0, GATE_PRESENT, 1);
+    set_intr_gate(&percpu->idt[X86_EX_DF],  __KERN_CS, _ul(entry_DF),  GATE_DPL0, GATE_PRESENT, IST_DF);
 #endif
 
     set_intr_gate(&percpu->idt[SERIAL_COM1_IRQ], __KERN_CS,
@@ -167,6 +173,12 @@ void init_traps(const cpu_t *cpu) {
                   _ul(asm_interrupt_handler_keyboard), GATE_DPL0, GATE_PRESENT, 0);
     set_intr_gate(&percpu->idt[APIC_TIMER_IRQ], __KERN_CS,
                   _ul(asm_interrupt_handler_apic_timer), GATE_DPL0, GATE_PRESENT, 0);
+    set_intr_gate(&percpu->idt[HPET_EVENT_IRQ], __KERN_CS,
+                  _ul(asm_interrupt_handler_hpet_event), GATE_DPL0, GATE_PRESENT, 0);
+    set_intr_gate(&percpu->idt[HRTIMER_IPI_IRQ], __KERN_CS,
+                  _ul(asm_interrupt_handler_hrtimer_ipi), GATE_DPL0, GATE_PRESENT, 0);
+    set_intr_gate(&percpu->idt[APIC_BENCH_IPI_IRQ], __KERN_CS,
+                  _ul(asm_interrupt_handler_apic_bench_ipi), GATE_DPL0, GATE_PRESENT, 0);
     set_intr_gate(&percpu->idt[APIC_SPI_VECTOR], __KERN_CS,
                   _ul(asm_interrupt_handler_dummy), GATE_DPL0, GATE_PRESENT, 0);
 
@@ -292,24 +304,25 @@ void print_callstack(const void *sp, const void *ip) {
 }
 
 static bool extables_fixup(struct cpu_regs *regs) {
-    for (extable_entry_t *cur = __start_extables; cur < __stop_extables; ++cur) {
-        if (regs->exc._ASM_IP != cur->fault_addr)
-            continue;
+    const extable_entry_t *entry = search_extables(regs->exc._ASM_IP);
 
-        if (cur->fixup)
-            regs->exc._ASM_IP = cur->fixup;
-        else if (cur->cb)
-            cur->cb(regs);
+    if (!entry)
+        return false;
 
-        return true;
-    }
+    if (entry->fixup)
+        regs->exc._ASM_IP = entry->fixup;
+    else if (entry->cb)
+        entry->cb(regs);
 
-    return false;
+    return true;
 }
 
 void do_exception(cpu_regs_t *regs) {
     static char ec_str[32], panic_str[128];
 
+    if (regs->exc.vector == X86_EX_NMI && profiler_nmi_handler(regs))
+        return;
+
     if (!enter_from_usermode(regs->exc.cs) && extables_fixup(regs))
         return;
 
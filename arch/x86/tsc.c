@@ -0,0 +1,429 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <cmdline.h>
+#include <console.h>
+#include <cpuid.h>
+#include <errno.h>
+#include <ktf.h>
+#include <lib.h>
+#include <percpu.h>
+#include <sched.h>
+#include <spinlock.h>
+#include <tsc.h>
+
+#include <drivers/hpet.h>
+#include <drivers/pit.h>
+
+#include <smp/smp.h>
+
+tsc_info_t tsc_info;
+tsc_sync_info_t tsc_sync_info;
+
+#define TSC_CAL_MS             10
+#define TSC_CAL_ITERATIONS     3
+#define TSC_CAL_TIMEOUT_CYCLES GHZ(1)
+#define TSC_CAL_PIT_LATCH      (PIT_OUT_FREQUENCY * TSC_CAL_MS / 1000)
+
+static const char *const tsc_freq_source_names[] = {
+    /* clang-format off */
+    [TSC_FREQ_SOURCE_NONE]     = "None",
+    [TSC_FREQ_SOURCE_CPUID_15] = "CPUID.15H",
+    [TSC_FREQ_SOURCE_CPUID_16] = "CPUID.16H",
+    [TSC_FREQ_SOURCE_HPET]     = "HPET",
+    [TSC_FREQ_SOURCE_PIT]      = "PIT",
+    /* clang-format on */
+};
+
+const char *tsc_freq_source_name(tsc_freq_source_t source) {
+    if (source >= ARRAY_SIZE(tsc_freq_source_names))
+        return tsc_freq_source_names[TSC_FREQ_SOURCE_NONE];
+    return tsc_freq_source_names[source];
+}
+
+static uint64_t __text_init tsc_freq_cpuid_15(void) {
+    uint32_t denominator = 0, numerator = 0, crystal_hz = 0, ign = 0;
+    uint64_t crystal;
+
+    if (cpuid_max_leaf() < CPUID_TSC_INFO_LEAF)
+        return 0;
+
+    cpuid(CPUID_TSC_INFO_LEAF, &denominator, &numerator, &crystal_hz, &ign);
+    if (!denominator || !numerator)
+        return 0;
+
+    crystal = crystal_hz;
+    /* Some CPUs enumerate the TSC/crystal ratio, but not the crystal clock
+     * frequency. Derive it from the processor base frequency then.
+     */
+    if (!crystal && cpuid_max_leaf() >= CPUID_FREQ_INFO_LEAF)
+        crystal = MHZ(cpuid_eax(CPUID_FREQ_INFO_LEAF) & 0xFFFF) * denominator / numerator;
+
+    if (!crystal)
+        return 0;
+
+    tsc_info.crystal_hz = crystal;
+    return crystal * numerator / denominator;
+}
+
+static uint64_t __text_init tsc_freq_cpuid_16(void) {
+    if (cpuid_max_leaf() < CPUID_FREQ_INFO_LEAF)
+        return 0;
+
+    return MHZ(cpuid_eax(CPUID_FREQ_INFO_LEAF) & 0xFFFF);
+}
+
+/* Count TSC cycles over TSC_CAL_MS worth of HPET main counter ticks.
+ * Take the lowest result of a few iterations to filter out SMIs and
+ * other disturbances, as these can only make the TSC delta bigger.
+ */
+static uint64_t __text_init tsc_freq_hpet(void) {
+    uint64_t hpet_freq, hpet_mask, hpet_ticks;
+    uint64_t freq = _U64(-1);
+
+    if (!hpet_available())
+        return 0;
+
+    hpet_freq = hpet_get_frequency();
+    hpet_mask = hpet_get_counter_mask();
+    hpet_ticks = hpet_freq * TSC_CAL_MS / 1000;
+    if (!hpet_ticks)
+        return 0;
+
+    for (int i = 0; i < TSC_CAL_ITERATIONS; i++) {
+        uint64_t tsc_start, tsc_end, hpet_start, hpet_delta;
+
+        hpet_start = hpet_read_counter();
+        tsc_start = rdtsc();
+        do {
+            hpet_delta = (hpet_read_counter() - hpet_start) & hpet_mask;
+            tsc_end = rdtsc();
+
+            if (tsc_end - tsc_start > TSC_CAL_TIMEOUT_CYCLES)
+                return 0;
+        } while (hpet_delta < hpet_ticks);
+
+        freq = min(freq, (tsc_end - tsc_start) * hpet_freq / hpet_delta);
+    }
+
+    return freq;
+}
+
+static uint64_t __text_init tsc_freq_pit(void) {
+    uint64_t freq = _U64(-1);
+    unsigned long flags;
+
+    flags = interrupts_disable_save();
+    for (int i = 0; i < TSC_CAL_ITERATIONS; i++) {
+        uint64_t tsc_start, tsc_end;
+
+        pit_ch2_oneshot(TSC_CAL_PIT_LATCH);
+        tsc_start = rdtsc();
+        do {
+            tsc_end = rdtsc();
+
+            if (tsc_end - tsc_start > TSC_CAL_TIMEOUT_CYCLES) {
+                interrupts_restore(flags);
+                return 0;
+            }
+        } while (!pit_ch2_expired());
+
+        freq = min(freq, (tsc_end - tsc_start) * PIT_OUT_FREQUENCY / TSC_CAL_PIT_LATCH);
+    }
+    interrupts_restore(flags);
+
+    return freq;
+}
+
+static const struct {
+    tsc_freq_source_t source;
+    uint64_t (*get_freq)(void);
+} tsc_freq_sources[] = {
+    {TSC_FREQ_SOURCE_CPUID_15, tsc_freq_cpuid_15},
+    {TSC_FREQ_SOURCE_CPUID_16, tsc_freq_cpuid_16},
+    {TSC_FREQ_SOURCE_HPET, tsc_freq_hpet},
+    {TSC_FREQ_SOURCE_PIT, tsc_freq_pit},
+};
+
+void __text_init init_tsc(void) {
+    uint64_t freq = 0;
+    unsigned i;
+
+    if (!cpu_has_tsc()) {
+        warning("TSC not available");
+        return;
+    }
+
+    tsc_info.invariant = cpu_has_invariant_tsc();
+    tsc_info.adjust = cpu_has_tsc_adjust();
+
+    for (i = 0; i < ARRAY_SIZE(tsc_freq_sources); i++) {
+        freq = tsc_freq_sources[i].get_freq();
+        if (freq > 0)
+            break;
+    }
+
+    if (!freq) {
+        warning("Unable to determine TSC frequency");
+        return;
+    }
+
+    tsc_info.source = tsc_freq_sources[i].source;
+    tsc_info.mult = (NSEC_PER_SEC << TSC_MULT_SHIFT) / freq;
+    smp_wmb();
+    tsc_info.frequency = freq;
+
+    printk("TSC: %lu.%03lu MHz (%s, %sinvariant)\n", freq / MHZ(1),
+           (freq % MHZ(1)) / KHZ(1), tsc_freq_source_name(tsc_info.source),
+           tsc_info.invariant ? "" : "not ");
+    if (!tsc_info.invariant)
+        warning("TSC rate may change with CPU power states; ktime is unreliable");
+}
+
+#define TSC_SYNC_ROUNDS     64
+#define TSC_SYNC_WARP_LOOPS 20000
+
+/* BSP <-> AP handshake state. Both sides advance a sequence number in lockstep. */
+static struct {
+    volatile uint32_t bsp_seq;
+    volatile uint32_t ap_seq;
+    volatile uint64_t ap_tsc;
+    volatile int64_t adjust;
+
+    spinlock_t lock;
+    uint64_t last_tsc;
+    uint64_t max_warp;
+    unsigned long warps;
+} tsc_sync = {
+    .lock = SPINLOCK_INIT,
+};
+
+static inline uint64_t tsc_abs(int64_t offset) {
+    return offset < 0 ? -(uint64_t) offset : (uint64_t) offset;
+}
+
+static inline void tsc_sync_bsp_signal(uint32_t seq) {
+    smp_wmb();
+    tsc_sync.bsp_seq = seq;
+}
+
+static inline void tsc_sync_ap_signal(uint32_t seq) {
+    smp_wmb();
+    tsc_sync.ap_seq = seq;
+}
+
+static inline void tsc_sync_wait(volatile uint32_t *seq_ptr, uint32_t seq) {
+    while (ACCESS_ONCE(*seq_ptr) != seq)
+        cpu_relax();
+    smp_rmb();
+}
+
+/* Both CPUs keep taking TSC readings in turn; a reading lower than the last one
+ * taken by the other CPU is a warp.
+ */
+static void tsc_sync_warp_loop(void) {
+    for (unsigned int i = 0; i < TSC_SYNC_WARP_LOOPS; i++) {
+        uint64_t prev, now;
+
+        spin_lock(&tsc_sync.lock);
+        prev = tsc_sync.last_tsc;
+        now = rdtsc_ordered();
+        tsc_sync.last_tsc = now;
+        spin_unlock(&tsc_sync.lock);
+
+        if (unlikely(prev > now)) {
+            spin_lock(&tsc_sync.lock);
+            tsc_sync.warps++;
+            tsc_sync.max_warp = max(tsc_sync.max_warp, prev - now);
+            spin_unlock(&tsc_sync.lock);
+        }
+    }
+}
+
+/* Estimate AP TSC minus BSP TSC from the round trip with the lowest latency */
+static int64_t tsc_sync_bsp_offset(uint32_t *seq, uint64_t *best_rtt) {
+    int64_t offset = 0;
+
+    *best_rtt = _U64(-1);
+    for (unsigned int i = 0; i < TSC_SYNC_ROUNDS; i++) {
+        uint64_t t0, t1, t2;
+
+        t0 = rdtsc_ordered();
+        tsc_sync_bsp_signal(++*seq);
+        tsc_sync_wait(&tsc_sync.ap_seq, *seq);
+        t2 = rdtsc_ordered();
+        t1 = tsc_sync.ap_tsc;
+
+        if (t2 - t0 < *best_rtt) {
+            *best_rtt = t2 - t0;
+            offset = (int64_t) (t1 - t0) - (int64_t) (*best_rtt / 2);
+        }
+    }
+
+    return offset;
+}
+
+static void tsc_sync_ap_offset(uint32_t *seq) {
+    for (unsigned int i = 0; i < TSC_SYNC_ROUNDS; i++) {
+        tsc_sync_wait(&tsc_sync.bsp_seq, ++*seq);
+        tsc_sync.ap_tsc = rdtsc_ordered();
+        tsc_sync_ap_signal(*seq);
+    }
+}
+
+/* AP side of the TSC synchronization check. Runs on the AP concurrently with
+ * tsc_sync_bsp() on the BSP.
+ */
+void tsc_sync_ap(void) {
+    uint32_t seq = 0;
+    int64_t adjust;
+
+    tsc_sync_ap_offset(&seq);
+
+    /* Optional TSC_ADJUST correction requested by the BSP */
+    tsc_sync_wait(&tsc_sync.bsp_seq, ++seq);
+    adjust = tsc_sync.adjust;
+    if (adjust)
+        wrmsr(MSR_TSC_ADJUST, rdmsr(MSR_TSC_ADJUST) - adjust);
+    tsc_sync_ap_signal(seq);
+
+    if (adjust)
+        tsc_sync_ap_offset(&seq);
+
+    tsc_sync_wait(&tsc_sync.bsp_seq, ++seq);
+    tsc_sync_warp_loop();
+    tsc_sync_ap_signal(seq);
+}
+
+/* BSP side of the TSC synchronization check against the AP cpu. Records the
+ * AP's offset in its per-CPU offset table entry. Returns -ERANGE when the AP's
+ * TSC is not synchronized with the BSP.
+ */
+int tsc_sync_bsp(cpu_t *cpu) {
+    uint64_t rtt, max_warp;
+    unsigned long warps;
+    uint32_t seq = 0;
+    int64_t offset;
+    bool in_sync;
+
+    tsc_sync.ap_seq = 0;
+    tsc_sync.adjust = 0;
+    tsc_sync.warps = 0;
+    tsc_sync.max_warp = 0;
+    tsc_sync_bsp_signal(seq);
+
+    offset = tsc_sync_bsp_offset(&seq, &rtt);
+
+    /* Offsets within the measurement uncertainty are not worth correcting */
+    if (opt_tsc_adjust && tsc_info.adjust && tsc_abs(offset) > rtt / 2)
+        tsc_sync.adjust = offset;
+    tsc_sync_bsp_signal(++seq);
+    tsc_sync_wait(&tsc_sync.ap_seq, seq);
+
+    if (tsc_sync.adjust) {
+        printk("TSC sync CPU%u: TSC_ADJUST corrected by %ld cycles\n", cpu->id,
+               -tsc_sync.adjust);
+        offset = tsc_sync_bsp_offset(&seq, &rtt);
+    }
+
+    tsc_sync.last_tsc = 0;
+    tsc_sync_bsp_signal(++seq);
+    tsc_sync_warp_loop();
+    tsc_sync_wait(&tsc_sync.ap_seq, seq);
+
+    warps = tsc_sync.warps;
+    max_warp = tsc_sync.max_warp;
+    in_sync = !warps && tsc_abs(offset) <= rtt / 2;
+
+    cpu->percpu->tsc_offset = offset;
+    tsc_sync_info.max_skew = max(tsc_sync_info.max_skew, tsc_abs(offset));
+    tsc_sync_info.max_warp = max(tsc_sync_info.max_warp, max_warp);
+    if (!in_sync)
+        tsc_sync_info.unsynced++;
+
+    printk("TSC sync CPU%u: offset %ld cycles (+/- %lu), warps: %lu (max %lu cycles)%s\n",
+           cpu->id, offset, rtt / 2, warps, max_warp, in_sync ? "" : " NOT IN SYNC");
+
+    return in_sync ? 0 : -ERANGE;
+}
+
+static unsigned long tsc_sync_ap_task(void *unused) {
+    tsc_sync_ap();
+    return 0;
+}
+
+/* On-demand TSC synchronization check of cpu against the BSP. Must be called on
+ * the BSP while the AP is processing its task queue.
+ */
+int tsc_sync_check(cpu_t *cpu) {
+    task_t *task;
+    int rc;
+
+    if (is_cpu_bsp(cpu) || !cpu_has_tsc())
+        return 0;
+
+    BUG_ON(!is_cpu_bsp(get_cpu(smp_processor_id())));
+
+    task = new_kernel_task("tsc_sync", tsc_sync_ap_task, NULL);
+    if (!task)
+        return -ENOMEM;
+
+    /* Reset the handshake before the AP starts waiting for it */
+    tsc_sync.bsp_seq = 0;
+    tsc_sync.ap_seq = 0;
+    smp_wmb();
+
+    set_task_once(task);
+    rc = schedule_task(task, cpu);
+    if (rc < 0)
+        return rc;
+    set_cpu_unblocked(cpu);
+
+    return tsc_sync_bsp(cpu);
+}
+
+/* Re-check all APs and print the overall result */
+int tsc_sync_check_all(void) {
+    unsigned int nr_cpus = get_nr_cpus();
+    int rc = 0;
+
+    tsc_sync_info.max_skew = 0;
+    tsc_sync_info.max_warp = 0;
+    tsc_sync_info.unsynced = 0;
+
+    for (unsigned int id = 0; id < nr_cpus; id++) {
+        cpu_t *cpu = get_cpu(id);
+
+        if (cpu && tsc_sync_check(cpu) < 0)
+            rc = -ERANGE;
+    }
+
+    tsc_sync_print_summary();
+    return rc;
+}
+
+void tsc_sync_print_summary(void) {
+    printk("TSC sync: max skew %lu cycles, max warp %lu cycles, %u CPUs not in sync\n",
+           tsc_sync_info.max_skew, tsc_sync_info.max_warp, tsc_sync_info.unsynced);
+}
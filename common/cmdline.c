@@ -46,6 +46,15 @@ bool_cmd("pit", opt_pit);
 bool opt_apic_timer = false;
 bool_cmd("apic_timer", opt_apic_timer);
 
+bool opt_apic_tickless = false;
+bool_cmd("apic_tickless", opt_apic_tickless);
+
+bool opt_x2apic = false;
+bool_cmd("x2apic", opt_x2apic);
+
+bool opt_tsc_adjust = false;
+bool_cmd("tsc_adjust", opt_tsc_adjust);
+
 bool opt_hpet = false;
 bool_cmd("hpet", opt_hpet);
 
@@ -106,6 +106,79 @@ void for_each_cpu(void (*func)(cpu_t *cpu)) {
         func(cpu);
 }
 
+/* Calls func for every other hardware thread of the core cpu belongs to */
+void for_each_sibling(cpu_t *cpu, void (*func)(cpu_t *sibling, void *arg), void *arg) {
+    cpu_t *sibling;
+
+    list_for_each_entry (sibling, &cpus, list) {
+        if (sibling != cpu && cpus_are_siblings(cpu, sibling))
+            func(sibling, arg);
+    }
+}
+
+/* The lowest numbered CPU with a known topology represents its domain */
+static bool is_first_in_domain(cpu_t *cpu, bool (*same_domain)(cpu_t *a, cpu_t *b)) {
+    cpu_t *other;
+
+    if (!cpu_has_topology(cpu))
+        return false;
+
+    list_for_each_entry (other, &cpus, list) {
+        if (other->id < cpu->id && same_domain(cpu, other))
+            return false;
+    }
+
+    return true;
+}
+
+/* Calls func once per physical core, with one of its hardware threads */
+void for_each_core(void (*func)(cpu_t *cpu, void *arg), void *arg) {
+    cpu_t *cpu;
+
+    list_for_each_entry (cpu, &cpus, list) {
+        if (is_first_in_domain(cpu, cpus_are_siblings))
+            func(cpu, arg);
+    }
+}
+
+unsigned int get_nr_cores(void) {
+    unsigned int nr = 0;
+    cpu_t *cpu;
+
+    list_for_each_entry (cpu, &cpus, list)
+        nr += is_first_in_domain(cpu, cpus_are_siblings);
+
+    return nr;
+}
+
+unsigned int get_nr_packages(void) {
+    unsigned int nr = 0;
+    cpu_t *cpu;
+
+    list_for_each_entry (cpu, &cpus, list)
+        nr += is_first_in_domain(cpu, cpus_share_package);
+
+    return nr;
+}
+
+void print_cpu_topology(void) {
+    cpu_t *cpu;
+
+    printk("CPU topology: %u packages, %u cores, %u CPUs\n", get_nr_packages(),
+           get_nr_cores(), nr_cpus);
+
+    list_for_each_entry (cpu, &cpus, list) {
+        const cpu_topology_t *topo = &cpu->topology;
+
+        if (!cpu_has_topology(cpu))
+            continue;
+
+        printk("CPU%u: APIC ID 0x%x, package %u, die %u, core %u, thread %u, LLC %u\n",
+               cpu->id, topo->apic_id, topo->package, topo->die, topo->core, topo->thread,
+               topo->llc);
+    }
+}
+
 void unblock_all_cpus(void) {
     cpu_t *cpu;
 
@@ -42,6 +42,8 @@ void init_percpu(void) {
 percpu_t *get_percpu_page(unsigned int cpu) {
     percpu_t *percpu;
 
+    BUILD_BUG_ON(sizeof(*percpu) > PAGE_SIZE);
+
     list_for_each_entry (percpu, &percpu_frames, list) {
         if (percpu->cpu_id == cpu)
             return percpu;
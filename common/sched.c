@@ -28,6 +28,8 @@
 #include <ktf.h>
 #include <lib.h>
 #include <list.h>
+#include <pmu.h>
+#include <profiler.h>
 #include <sched.h>
 #include <setup.h>
 #include <spinlock.h>
@@ -171,9 +173,27 @@ static const char *task_repeat_string(task_repeat_t repeat) {
     }
 }
 
+/* Tests running as tasks, e.g. in a parallel batch, must not schedule or wait for
+ * tasks of their own: the other CPUs may be busy with, or done with, their queues.
+ */
+bool in_test_task(const char *caller) {
+    cpu_t *cpu = get_cpu(smp_processor_id());
+    task_t *task = cpu ? ACCESS_ONCE(cpu->task) : NULL;
+
+    if (!task || task->gid != TASK_GROUP_TEST)
+        return false;
+
+    warning("CPU[%u]: %s() called from test task %s, register the test .exclusive",
+            cpu->id, caller, task->name);
+    return true;
+}
+
 int schedule_task(task_t *task, cpu_t *cpu) {
     ASSERT(task);
 
+    if (in_test_task(__func__))
+        return -EBUSY;
+
     if (!cpu) {
         warning("Unable to schedule task: %s. CPU does not exist.", task->name);
         return -EEXIST;
@@ -194,6 +214,8 @@ int schedule_task(task_t *task, cpu_t *cpu) {
 }
 
 static void run_task(task_t *task) {
+    task_t *prev;
+
     if (!task)
         return;
 
@@ -203,10 +225,17 @@ static void run_task(task_t *task) {
         printk("CPU[%u]: Running task %s[%u]\n", task->cpu->id, task->name, task->id);
 
     set_task_state(task, TASK_STATE_RUNNING);
+    prev = task->cpu->task;
+    task->cpu->task = task;
+    profiler_enter();
+    pmu_stat_enter();
     if (task->type == TASK_TYPE_USER)
         task->result = enter_usermode(task->func, task->arg, task->stack);
     else
         task->result = task->func(task->arg);
+    pmu_stat_exit();
+    profiler_exit();
+    task->cpu->task = prev;
     set_task_state(task, TASK_STATE_DONE);
 }
 
@@ -214,6 +243,9 @@ void wait_for_task_group(const cpu_t *cpu, task_group_t group) {
     task_t *task, *safe;
     bool busy;
 
+    if (in_test_task(__func__))
+        return;
+
     do {
         busy = false;
 
@@ -29,6 +29,7 @@
 #include <cpu.h>
 #include <cpuid.h>
 #include <drivers/keyboard.h>
+#include <hrtimer.h>
 #include <ioapic.h>
 #include <ktf.h>
 #include <lib.h>
@@ -37,12 +38,14 @@
 #include <pagetable.h>
 #include <pci.h>
 #include <percpu.h>
+#include <pmu.h>
 #include <real_mode.h>
 #include <sched.h>
 #include <segment.h>
 #include <setup.h>
 #include <string.h>
 #include <traps.h>
+#include <tsc.h>
 
 #include <mm/pmm.h>
 #include <mm/regions.h>
@@ -165,6 +168,8 @@ static void __text_init init_vga_console(void) {
 }
 
 void __text_init init_timers(cpu_t *cpu) {
+    init_hrtimer(cpu->id);
+
     if (is_cpu_bsp(cpu)) {
         if (opt_hpet)
             boot_flags.timer_global = init_hpet(cpu);
@@ -173,10 +178,16 @@ void __text_init init_timers(cpu_t *cpu) {
             init_pit(cpu);
             boot_flags.timer_global = true;
         }
+
+        init_tsc();
+        /* Prefer the TSC frequency over the CPU brand string guesswork */
+        if (tsc_calibrated())
+            cpu_frequency = get_tsc_frequency();
     }
 
     if (opt_apic_timer) {
-        if (boot_flags.timer_global) /* Needed for APIC timer calibration */
+        /* Needed for APIC timer calibration (or TSC-deadline mode) */
+        if (boot_flags.timer_global || tsc_calibrated())
             init_apic_timer();
         else {
             warning("CPU%u: Unable to initialize APIC timer - no calibration timers!",
@@ -237,6 +248,9 @@ void __noreturn __text_init kernel_start(uint32_t multiboot_magic, unsigned long
     init_percpu();
 
     cpu_t *bsp = init_cpus();
+    if (init_cpu_cache_info(bsp) == 0)
+        print_cpu_cache_info(bsp);
+    init_cpu_topology(bsp);
 
     init_traps(bsp);
 
@@ -244,7 +258,14 @@ void __noreturn __text_init kernel_start(uint32_t multiboot_magic, unsigned long
 
     init_slab();
 
-    init_apic(bsp->id, APIC_MODE_XAPIC);
+    apic_mode_t apic_mode = APIC_MODE_XAPIC;
+    if (opt_x2apic) {
+        if (cpu_has_x2apic())
+            apic_mode = APIC_MODE_X2APIC;
+        else
+            warning("X2APIC mode not supported, falling back to XAPIC");
+    }
+    init_apic(bsp->id, apic_mode);
 
     init_tasks();
 
@@ -282,6 +303,8 @@ void __noreturn __text_init kernel_start(uint32_t multiboot_magic, unsigned long
         enable_fpu();
     }
 
+    init_pmu();
+
 #ifdef KTF_PMU
     printk("Initializing PFM library\n");
 
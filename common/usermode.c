@@ -70,6 +70,9 @@ long syscall_handler(long syscall_nr, long arg1, long arg2, long arg3, long arg4
         return 0;
     }
 
+    case SYSCALL_NOP:
+        return 0;
+
     default:
         warning("Unknown syscall: %lu", syscall_nr);
         return -1;
@@ -224,6 +227,10 @@ static inline long __user_text sys_munmap(void *va, unsigned long order) {
     return syscall2(SYSCALL_MUNMAP, _ul(va), order);
 }
 
+static inline long __user_text sys_nop(void) {
+    return syscall0(SYSCALL_NOP);
+}
+
 void __user_text exit(unsigned long exit_code) {
     sys_exit(exit_code);
 }
@@ -243,3 +250,7 @@ void *__user_text mmap(void *va, unsigned long order) {
 void __user_text munmap(void *va, unsigned long order) {
     sys_munmap(va, order);
 }
+
+long __user_text nop_syscall(void) {
+    return sys_nop();
+}
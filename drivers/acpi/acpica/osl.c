@@ -490,15 +490,12 @@ void AcpiOsSleep(UINT64 Miliseconds) {
     msleep(Miliseconds);
 }
 
-/* FIXME: Return in correct 100ns units */
 UINT64 AcpiOsGetTimer(void) {
-    return get_timer_ticks();
+    return ktime_ns() / 100;
 }
 
-/* FIXME: Use actual microseconds granularity */
 void AcpiOsStall(UINT32 Microseconds) {
-    for (unsigned long i = Microseconds * 1000; i > 0; i--)
-        cpu_relax();
+    udelay(Microseconds);
 }
 
 /* PCI Configuration read/write functions */
@@ -24,8 +24,163 @@
  */
 
 #include <acpi_ktf.h>
+#include <atomic.h>
 #include <drivers/hpet.h>
+#include <errno.h>
+#include <hrtimer.h>
 #include <ioapic.h>
+#include <percpu.h>
+
+static volatile acpi_hpet_timer_t *hpet_timers;
+static volatile uint64_t *hpet_main_counter;
+static uint64_t hpet_period_fs;
+static uint64_t hpet_counter_mask;
+static uint64_t hpet_ns_mult; /* ns = (counter * mult) >> 32 */
+
+/* Software extension of 32-bit main counters to 64 bits */
+static atomic64_t hpet_counter_last;
+
+bool hpet_available(void) {
+    return !!hpet_main_counter;
+}
+
+uint64_t hpet_read_counter(void) {
+    return *hpet_main_counter & hpet_counter_mask;
+}
+
+uint64_t hpet_get_counter_mask(void) {
+    return hpet_counter_mask;
+}
+
+uint64_t hpet_get_frequency(void) {
+    /* 1 fs = 10^15s */
+    return hpet_period_fs ? 1000000000000000UL / hpet_period_fs : 0;
+}
+
+/* Monotonic 64-bit main counter, lock-free also for 32-bit HPETs. Those need
+ * a read at least once per counter wrap-around, see hpet_counter_update().
+ */
+uint64_t hpet_read_counter64(void) {
+    int64_t last, now;
+
+    if (hpet_counter_mask == _U64(-1))
+        return *hpet_main_counter;
+
+    do {
+        last = atomic_read(&hpet_counter_last);
+        now = (last & ~hpet_counter_mask) | (*hpet_main_counter & hpet_counter_mask);
+        if ((uint64_t) now < (uint64_t) last)
+            now += hpet_counter_mask + 1;
+    } while (now != last && atomic64_cmpxchg(&hpet_counter_last, last, now) != last);
+
+    return now;
+}
+
+void hpet_counter_update(void) {
+    if (hpet_available() && hpet_counter_mask != _U64(-1))
+        hpet_read_counter64();
+}
+
+ktime_t hpet_ktime_ns(void) {
+    return ((unsigned __int128) hpet_read_counter64() * hpet_ns_mult) >> 32;
+}
+
+static inline uint64_t hpet_ns_to_ticks(uint64_t ns) {
+    uint64_t freq = hpet_get_frequency();
+
+    return (ns / NSEC_PER_SEC) * freq + ((ns % NSEC_PER_SEC) * freq) / NSEC_PER_SEC;
+}
+
+bool hpet_event_available(void) {
+    return PERCPU_GET(hpet_timer) != 0;
+}
+
+/* Program a one-shot event at expires (ktime_ns() based) on this CPU's comparator.
+ * Returns -ETIME if the deadline could not be programmed in time.
+ */
+int hpet_event_program(ktime_t expires) {
+    unsigned int n = PERCPU_GET(hpet_timer);
+    volatile acpi_hpet_timer_t *timer;
+    uint64_t start, ticks, delta, mask;
+    unsigned long flags;
+    ktime_t now;
+    int rc = 0;
+
+    if (!n)
+        return -ENODEV;
+
+    timer = &hpet_timers[n];
+    mask = timer->cap_size ? hpet_counter_mask : _U32(-1);
+
+    flags = interrupts_disable_save();
+    now = ktime_ns();
+    delta = expires > now ? expires - now : 0;
+    ticks = min(max(hpet_ns_to_ticks(delta), _U64(HPET_MIN_DELTA_TICKS)), mask >> 1);
+
+    start = hpet_read_counter();
+    timer->comparator = (start + ticks) & mask;
+    timer->cfg_int_enabled = 1;
+    PERCPU_SET(hpet_event_next, expires ?: 1);
+
+    /* The comparator only matches on equality, so it must still be ahead */
+    if (((hpet_read_counter() - start) & mask) >= ticks) {
+        timer->cfg_int_enabled = 0;
+        PERCPU_SET(hpet_event_next, 0);
+        rc = -ETIME;
+    }
+
+    interrupts_restore(flags);
+    return rc;
+}
+
+void hpet_event_cancel(void) {
+    unsigned int n = PERCPU_GET(hpet_timer);
+
+    if (!n)
+        return;
+
+    hpet_timers[n].cfg_int_enabled = 0;
+    PERCPU_SET(hpet_event_next, 0);
+}
+
+void hpet_event_interrupt_handler(void) {
+    PERCPU_SET(hpet_event_next, 0);
+    hrtimer_interrupt();
+    apic_EOI();
+}
+
+/* Hand out comparators 1..N-1 with FSB delivery capability to CPUs in order */
+static void hpet_init_event_timers(unsigned int num_timers) {
+    unsigned int n = 1;
+
+    for (unsigned int id = 0; id < get_nr_cpus(); id++) {
+        volatile acpi_hpet_timer_t *timer;
+        cpu_t *cpu = get_cpu(id);
+        uint64_t msi_addr;
+
+        if (!cpu || cpu->percpu->apic_id > MSI_ADDR_DEST_ID_MAX)
+            continue;
+
+        while (n < num_timers && !hpet_timers[n].cap_fsb_int_delivery)
+            n++;
+        if (n >= num_timers)
+            break;
+
+        timer = &hpet_timers[n];
+        timer->cfg_int_enabled = 0;
+        timer->cfg_type = 0; /* One-shot */
+        timer->cfg_int_type = HPET_CONFIG_INT_TYPE_TRIGGER_MODE;
+        timer->cfg_32bit_mode = 0;
+        msi_addr = apic_msi_addr(cpu->percpu->apic_id);
+        timer->fsb =
+            (msi_addr << HPET_FSB_ADDR_SHIFT) | apic_msi_data(HPET_EVENT_IRQ_VECTOR);
+        timer->cfg_fsb_enable = 1;
+
+        cpu->percpu->hpet_timer = n;
+        dprintk("HPET: comparator %u assigned to CPU%u\n", n, cpu->id);
+        n++;
+    }
+}
 
 bool init_hpet(const cpu_t *cpu) {
 #ifndef KTF_ACPICA
@@ -74,31 +229,38 @@ bool init_hpet(const cpu_t *cpu) {
         return false;
     }
 
-    if (general->num_timers_cap == 0) {
-        return false;
-    }
-
-    /* Disable all timers */
-    for (int i = 0; i < general->num_timers_cap; ++i) {
+    /* Disable all timers. The main counter keeps its value, it is a clocksource. */
+    for (int i = 0; i <= general->num_timers_cap; ++i) {
         (config + i)->cfg_int_enabled = 0;
     }
 
-    *main_counter = 0;
-
     /* 1 fs = 10^15s */
     uint64_t freq_hz = 1000000000000000UL / general->counter_clock_period;
     uint64_t ticks = freq_hz / 1000; /* Interrupt every 1ms */
 
+    hpet_period_fs = general->counter_clock_period;
+    hpet_counter_mask = general->count_size_cap ? _U64(-1) : _U32(-1);
+    hpet_ns_mult = (hpet_period_fs << 32) / 1000000; /* fs per ns */
+    hpet_timers = config;
+
+    /* Comparator 0: global periodic tick via IOAPIC */
     config->cfg_int_enabled = 1;
     config->cfg_int_route = 0;
     config->cfg_fsb_enable = 0;
     config->cfg_type = 1;
     config->cfg_value_set = 1;
+    /* First write sets the comparator, the second one the period */
+    config->comparator = (*main_counter + ticks) & hpet_counter_mask;
     config->comparator = ticks;
 
+    hpet_init_event_timers(general->num_timers_cap + 1);
+
     general->leg_repl_cfg = 0; /* Disable legacy route */
     general->enabled = 1;
 
+    atomic_set(&hpet_counter_last, *main_counter & hpet_counter_mask);
+    hpet_main_counter = main_counter;
+
     configure_isa_irq(HPET_IRQ, HPET_IRQ_OFFSET, IOAPIC_DEST_MODE_PHYSICAL, cpu->id);
     dprintk("Initialized HPET\n");
     return true;
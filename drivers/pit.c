@@ -41,3 +41,18 @@ void init_pit(const cpu_t *cpu) {
 void pit_disable(void) {
     pic_disable_irq(PIC1_DEVICE_SEL, PIT_IRQ);
 }
+
+/* Start a countdown of count PIT ticks on channel 2. The channel is not wired
+ * to any interrupt line, so it can be used for calibration purposes regardless
+ * of channel 0 being in use. Poll pit_ch2_expired() for completion.
+ */
+void pit_ch2_oneshot(uint16_t count) {
+    uint8_t ctrl = inb(PIT_CH2_CONTROL_PORT);
+
+    /* Enable the gate, but keep the speaker silent */
+    outb(PIT_CH2_CONTROL_PORT, (ctrl & ~PIT_CH2_SPEAKER) | PIT_CH2_GATE);
+
+    outb(PIT_COMMAND_PORT, PIT_CHANNEL_2 | PIT_ACCESS_MODE_LH | PIT_OP_MODE_COUNT);
+    outb(PIT_DATA_PORT_CH2, count & 0xFF);
+    outb(PIT_DATA_PORT_CH2, (count & 0xFF00) >> 8);
+}
@@ -29,11 +29,21 @@
 #include <ktf.h>
 #include <lib.h>
 #include <page.h>
+#include <time.h>
 
 #define APIC_IRQ_BASE         PIC_IRQ_END_OFFSET
 #define APIC_TIMER_IRQ_OFFSET (APIC_IRQ_BASE + 0x00)
 #define APIC_TIMER_IRQ_VECTOR APIC_TIMER_IRQ_OFFSET
 
+/* IPI vector reserved for interrupt latency measurements */
+#define APIC_BENCH_IPI_IRQ_OFFSET (APIC_IRQ_BASE + 0x03)
+#define APIC_BENCH_IPI_IRQ_VECTOR APIC_BENCH_IPI_IRQ_OFFSET
+
+/* MSI (FSB) message address and data layout */
+#define MSI_ADDR_BASE          0xFEE00000U
+#define MSI_ADDR_DEST_ID_SHIFT 12
+#define MSI_ADDR_DEST_ID_MAX   0xFF
+
 #define MSR_X2APIC_REGS 0x800U
 
 #ifndef __ASSEMBLY__
@@ -218,7 +228,7 @@ typedef enum apic_lvt_deliv_mode apic_lvt_deliv_mode_t;
 enum apic_lvt_timer_mode {
     APIC_LVT_TIMER_ONE_SHOT = 0x00,
     APIC_LVT_TIMER_PERIODIC = 0x01,
-    APIC_LVT_TIMER_TSC_DEADLINE = 0x10,
+    APIC_LVT_TIMER_TSC_DEADLINE = 0x02,
 };
 typedef enum apic_lvt_timer_mode apic_lvt_timer_mode_t;
 
@@ -453,6 +463,8 @@ union apic_self_ipi {
 };
 typedef union apic_self_ipi apic_self_ipi_t;
 
+typedef void (*apic_bench_handler_t)(void);
+
 /* External declarations */
 
 extern uint64_t apic_read(unsigned int reg);
@@ -461,8 +473,16 @@ extern apic_mode_t apic_get_mode(void);
 extern void init_apic(unsigned int cpu_id, apic_mode_t mode);
 extern apic_icr_t apic_icr_read(void);
 extern void apic_icr_write(const apic_icr_t *icr);
+extern void apic_send_ipi(uint32_t apic_id, uint8_t vector);
+extern void apic_send_self_ipi(uint8_t vector);
+extern void apic_set_bench_handler(apic_bench_handler_t handler);
+extern void apic_bench_ipi_interrupt_handler(void);
 
 extern void init_apic_timer(void);
+extern void apic_timer_deadline_rearm(void);
+extern int apic_timer_set_next_event(ktime_t expires);
+extern void apic_timer_cancel_event(void);
+extern void apic_timer_mask(bool mask);
 
 /* Static declarations */
 
@@ -510,6 +530,15 @@ static inline void apic_EOI(void) {
     apic_write(APIC_EOI, APIC_EOI_SIGNAL);
 }
 
+/* Physical destination, fixed delivery, edge triggered */
+static inline uint32_t apic_msi_addr(uint32_t apic_id) {
+    return MSI_ADDR_BASE | (apic_id << MSI_ADDR_DEST_ID_SHIFT);
+}
+
+static inline uint32_t apic_msi_data(uint8_t vector) {
+    return vector;
+}
+
 #endif /* __ASSEMBLY__ */
 
 #endif /* KTF_APIC_H */
@@ -183,6 +183,15 @@ static inline int atomic64_dec_and_test(atomic64_t *v) {
     return c != 0;
 }
 
+static inline int64_t atomic64_cmpxchg(atomic64_t *v, int64_t old, int64_t new) {
+    int64_t prev = old;
+    asm volatile("lock cmpxchgq %[new], %[addr];"
+                 : "+a"(prev), [ addr ] "+m"(v->counter)
+                 : [ new ] "r"(new)
+                 : "memory");
+    return prev;
+}
+
 /* External declarations */
 
 #endif /* KTF_ATOMIC_H */
@@ -0,0 +1,98 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KTF_CACHEINFO_H
+#define KTF_CACHEINFO_H
+
+#include <ktf.h>
+
+/* CPUID.04H and CPUID.8000001DH share the same deterministic cache parameters layout */
+#define CPUID_CACHE_EAX_TYPE(eax)     ((eax) & 0x1f)
+#define CPUID_CACHE_EAX_LEVEL(eax)    (((eax) >> 5) & 0x7)
+#define CPUID_CACHE_EAX_FULLY_ASSOC   (_U32(1) << 9)
+#define CPUID_CACHE_EAX_SHARING(eax)  ((((eax) >> 14) & 0xfff) + 1)
+#define CPUID_CACHE_EBX_LINE(ebx)     (((ebx) & 0xfff) + 1)
+#define CPUID_CACHE_EBX_PARTS(ebx)    ((((ebx) >> 12) & 0x3ff) + 1)
+#define CPUID_CACHE_EBX_WAYS(ebx)     ((((ebx) >> 22) & 0x3ff) + 1)
+#define CPUID_CACHE_ECX_SETS(ecx)     ((ecx) + 1)
+#define CPUID_CACHE_EDX_INCLUSIVE     (_U32(1) << 1)
+
+#define CPU_CACHE_MAX_DESCS 8
+
+enum cpu_cache_type {
+    CPU_CACHE_NONE = 0,
+    CPU_CACHE_DATA = 1,
+    CPU_CACHE_INSTRUCTION = 2,
+    CPU_CACHE_UNIFIED = 3,
+};
+typedef enum cpu_cache_type cpu_cache_type_t;
+
+struct cpu_cache_info {
+    cpu_cache_type_t type;
+    unsigned int level;
+    unsigned int line_size;
+    unsigned int partitions;
+    unsigned int ways;
+    unsigned int sets;
+    unsigned long size;
+    /* Maximum number of logical processors sharing this cache */
+    unsigned int shared_cpus;
+    bool fully_assoc;
+    bool inclusive;
+};
+typedef struct cpu_cache_info cpu_cache_info_t;
+
+struct cpu_caches {
+    unsigned int nr;
+    cpu_cache_info_t caches[CPU_CACHE_MAX_DESCS];
+};
+typedef struct cpu_caches cpu_caches_t;
+
+struct cpu;
+
+/* External declarations */
+
+extern int init_cpu_cache_info(struct cpu *cpu);
+extern const cpu_cache_info_t *get_cpu_cache_info(const struct cpu *cpu,
+                                                  unsigned int level,
+                                                  cpu_cache_type_t type);
+extern const cpu_cache_info_t *get_cpu_llc_info(const struct cpu *cpu);
+extern void print_cpu_cache_info(const struct cpu *cpu);
+
+/* Static declarations */
+
+static inline const char *cpu_cache_type_name(cpu_cache_type_t type) {
+    switch (type) {
+    case CPU_CACHE_DATA:
+        return "d";
+    case CPU_CACHE_INSTRUCTION:
+        return "i";
+    case CPU_CACHE_UNIFIED:
+        return "";
+    default:
+        return "?";
+    }
+}
+
+#endif /* KTF_CACHEINFO_H */
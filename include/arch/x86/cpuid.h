@@ -26,13 +26,161 @@
 #define KTF_CPUID_H
 
 #include <ktf.h>
+#include <lib.h>
+
+#define CPUID_BASIC_INFO_LEAF 0x00000000U
+#define CPUID_FEATURES_LEAF   0x00000001U
+#define CPUID_CACHE_LEAF      0x00000004U /* Deterministic cache parameters */
+#define CPUID_EXT_FEAT_LEAF   0x00000007U /* Structured extended features */
+#define CPUID_PERFMON_LEAF    0x0000000AU /* Architectural performance monitoring */
+#define CPUID_TOPOLOGY_LEAF   0x0000000BU /* Extended topology enumeration */
+#define CPUID_TSC_INFO_LEAF   0x00000015U /* TSC/core crystal clock ratio */
+#define CPUID_FREQ_INFO_LEAF  0x00000016U /* Processor frequency information */
+#define CPUID_HYBRID_LEAF     0x0000001AU /* Native model ID (hybrid core type) */
+#define CPUID_TOPOLOGY2_LEAF  0x0000001FU /* V2 extended topology enumeration */
 
 /* CPU vendor detection */
-#define CPUID_EXT_INFO_LEAF  0x80000000U
-#define CPUID_BRAND_INFO_MIN 0x80000002U
-#define CPUID_BRAND_INFO_MAX 0x80000004U
+#define CPUID_EXT_INFO_LEAF     0x80000000U
+#define CPUID_EXT_FEATURES_LEAF 0x80000001U /* Extended processor features */
+#define CPUID_BRAND_INFO_MIN    0x80000002U
+#define CPUID_BRAND_INFO_MAX    0x80000004U
+#define CPUID_EXT_POWER_LEAF    0x80000007U /* Advanced power management */
+#define CPUID_EXT_ADDR_LEAF     0x80000008U /* Address sizes and core count */
+#define CPUID_AMD_CACHE_LEAF    0x8000001DU /* AMD cache topology information */
+#define CPUID_AMD_TOPOLOGY_LEAF 0x8000001EU /* AMD extended APIC ID, core and node IDs */
+
+/* CPUID.00H:EBX first four characters of the vendor string */
+#define CPUID_VENDOR_INTEL_EBX 0x756e6547U /* "Genu" */
+#define CPUID_VENDOR_AMD_EBX   0x68747541U /* "Auth" */
+
+/* CPUID.01H:ECX */
+#define CPUID_FEAT_ECX_PCID         (_U32(1) << 17)
+#define CPUID_FEAT_ECX_X2APIC       (_U32(1) << 21)
+#define CPUID_FEAT_ECX_TSC_DEADLINE (_U32(1) << 24)
+#define CPUID_FEAT_ECX_HYPERVISOR   (_U32(1) << 31)
+
+/* CPUID.01H:EDX */
+#define CPUID_FEAT_EDX_TSC (_U32(1) << 4)
+#define CPUID_FEAT_EDX_HTT (_U32(1) << 28)
+
+/* CPUID.(EAX=07H,ECX=0):EBX */
+#define CPUID_EXT_FEAT_EBX_TSC_ADJUST (_U32(1) << 1)
+
+/* CPUID.80000001H:ECX */
+#define CPUID_EXT_FEAT_ECX_TOPOEXT      (_U32(1) << 22)
+#define CPUID_EXT_FEAT_ECX_PERFCTR_CORE (_U32(1) << 23)
+
+/* CPUID.80000001H:EDX */
+#define CPUID_EXT_FEAT_EDX_PAGE1GB (_U32(1) << 26)
+
+/* CPUID.80000007H:EDX */
+#define CPUID_EXT_POWER_EDX_INVARIANT_TSC (_U32(1) << 8)
 
 extern uint64_t get_cpu_freq(const char *cpu_str);
 extern bool cpu_vendor_string(char *cpu_str);
 
+/* Static declarations */
+
+static inline uint32_t cpuid_max_leaf(void) {
+    return cpuid_eax(CPUID_BASIC_INFO_LEAF);
+}
+
+static inline uint32_t cpuid_max_ext_leaf(void) {
+    return cpuid_eax(CPUID_EXT_INFO_LEAF);
+}
+
+static inline bool cpu_is_intel(void) {
+    return cpuid_ebx(CPUID_BASIC_INFO_LEAF) == CPUID_VENDOR_INTEL_EBX;
+}
+
+static inline bool cpu_is_amd(void) {
+    return cpuid_ebx(CPUID_BASIC_INFO_LEAF) == CPUID_VENDOR_AMD_EBX;
+}
+
+/* Display family: base family plus extended family for family 0xF */
+static inline unsigned int cpu_family(void) {
+    uint32_t eax = cpuid_eax(CPUID_FEATURES_LEAF);
+    unsigned int family = (eax >> 8) & 0xf;
+
+    if (family == 0xf)
+        family += (eax >> 20) & 0xff;
+
+    return family;
+}
+
+/* Display model: extended model bits only apply to families 0x6 and 0xF */
+static inline unsigned int cpu_model(void) {
+    uint32_t eax = cpuid_eax(CPUID_FEATURES_LEAF);
+    unsigned int family = (eax >> 8) & 0xf;
+    unsigned int model = (eax >> 4) & 0xf;
+
+    if (family == 0x6 || family == 0xf)
+        model += ((eax >> 16) & 0xf) << 4;
+
+    return model;
+}
+
+/* Hybrid parts: 0x20 for Atom, 0x40 for Core; 0 when not enumerated */
+static inline unsigned int cpu_core_type(void) {
+    if (cpuid_max_leaf() < CPUID_HYBRID_LEAF)
+        return 0;
+
+    return cpuid_eax(CPUID_HYBRID_LEAF) >> 24;
+}
+
+static inline bool cpu_has_tsc(void) {
+    return !!(cpuid_edx(CPUID_FEATURES_LEAF) & CPUID_FEAT_EDX_TSC);
+}
+
+static inline bool cpu_has_invariant_tsc(void) {
+    if (cpuid_max_ext_leaf() < CPUID_EXT_POWER_LEAF)
+        return false;
+
+    return !!(cpuid_edx(CPUID_EXT_POWER_LEAF) & CPUID_EXT_POWER_EDX_INVARIANT_TSC);
+}
+
+static inline bool cpu_has_tsc_adjust(void) {
+    if (cpuid_max_leaf() < CPUID_EXT_FEAT_LEAF)
+        return false;
+
+    return !!(cpuid_ebx(CPUID_EXT_FEAT_LEAF) & CPUID_EXT_FEAT_EBX_TSC_ADJUST);
+}
+
+static inline bool cpu_has_pcid(void) {
+    return !!(cpuid_ecx(CPUID_FEATURES_LEAF) & CPUID_FEAT_ECX_PCID);
+}
+
+static inline bool cpu_has_x2apic(void) {
+    return !!(cpuid_ecx(CPUID_FEATURES_LEAF) & CPUID_FEAT_ECX_X2APIC);
+}
+
+static inline bool cpu_has_tsc_deadline(void) {
+    return !!(cpuid_ecx(CPUID_FEATURES_LEAF) & CPUID_FEAT_ECX_TSC_DEADLINE);
+}
+
+static inline bool cpu_has_perfctr_core(void) {
+    if (cpuid_max_ext_leaf() < CPUID_EXT_FEATURES_LEAF)
+        return false;
+
+    return !!(cpuid_ecx(CPUID_EXT_FEATURES_LEAF) & CPUID_EXT_FEAT_ECX_PERFCTR_CORE);
+}
+
+static inline bool cpu_has_topoext(void) {
+    if (cpuid_max_ext_leaf() < CPUID_EXT_FEATURES_LEAF)
+        return false;
+
+    return !!(cpuid_ecx(CPUID_EXT_FEATURES_LEAF) & CPUID_EXT_FEAT_ECX_TOPOEXT);
+}
+
+static inline bool cpu_has_page1gb(void) {
+    if (cpuid_max_ext_leaf() < CPUID_EXT_FEATURES_LEAF)
+        return false;
+
+    return !!(cpuid_edx(CPUID_EXT_FEATURES_LEAF) & CPUID_EXT_FEAT_EDX_PAGE1GB);
+}
+
+static inline bool cpu_is_hypervisor_guest(void) {
+    return !!(cpuid_ecx(CPUID_FEATURES_LEAF) & CPUID_FEAT_ECX_HYPERVISOR);
+}
+
 #endif /* KTF_CPUID_H */
\ No newline at end of file
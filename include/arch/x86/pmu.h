@@ -0,0 +1,178 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KTF_PMU_H
+#define KTF_PMU_H
+
+#include <ktf.h>
+#include <lib.h>
+
+/* Intel architectural PMU */
+#define MSR_IA32_PMC(n)             (0x000000C1 + (n))
+#define MSR_IA32_PERFEVTSEL(n)      (0x00000186 + (n))
+#define MSR_IA32_FIXED_CTR(n)       (0x00000309 + (n))
+#define MSR_IA32_FIXED_CTR_CTRL     0x0000038D
+#define MSR_IA32_PERF_GLOBAL_STATUS 0x0000038E
+#define MSR_IA32_PERF_GLOBAL_CTRL   0x0000038F
+#define MSR_IA32_PERF_GLOBAL_OVF    0x00000390
+
+/* AMD legacy (K7) and extended core (family 15h+) PMU */
+#define MSR_K7_EVNTSEL(n)    (0xC0010000 + (n))
+#define MSR_K7_PERFCTR(n)    (0xC0010004 + (n))
+#define MSR_F15H_PERF_CTL(n) (0xC0010200 + 2 * (n))
+#define MSR_F15H_PERF_CTR(n) (0xC0010201 + 2 * (n))
+
+#define PMU_AMD_K7_COUNTERS   4
+#define PMU_AMD_CORE_COUNTERS 6
+
+/* IA32_PERFEVTSELx and AMD PerfEvtSel layout */
+#define PMU_EVTSEL_EVENT(e) (((uint64_t) (e) & 0xff) | (((uint64_t) (e) & 0xf00) << 24))
+#define PMU_EVTSEL_UMASK(u) (((uint64_t) (u) & 0xff) << 8)
+#define PMU_EVTSEL_USR      (_U64(1) << 16)
+#define PMU_EVTSEL_OS       (_U64(1) << 17)
+#define PMU_EVTSEL_EDGE     (_U64(1) << 18)
+#define PMU_EVTSEL_INT      (_U64(1) << 20)
+#define PMU_EVTSEL_EN       (_U64(1) << 22)
+#define PMU_EVTSEL_INV      (_U64(1) << 23)
+#define PMU_EVTSEL_CMASK(c) (((uint64_t) (c) & 0xff) << 24)
+
+/* IA32_FIXED_CTR_CTRL: 4 bits per fixed counter */
+#define PMU_FIXED_CTRL_OS       _U64(0x1)
+#define PMU_FIXED_CTRL_USR      _U64(0x2)
+#define PMU_FIXED_CTRL_PMI      _U64(0x8)
+#define PMU_FIXED_CTRL_MASK     _U64(0xf)
+#define PMU_FIXED_CTRL_SHIFT(n) ((n) * 4)
+
+/* IA32_PERF_GLOBAL_CTRL: GP counters from bit 0, fixed counters from bit 32 */
+#define PMU_GLOBAL_CTRL_FIXED_SHIFT 32
+
+#define RDPMC_FIXED (_U32(1) << 30)
+
+/* Legacy IA32_PMCx writes are sign extended from bit 31 */
+#define PMU_MAX_SAMPLE_PERIOD (_U64(1) << 31)
+
+#define PMU_MAX_GP_COUNTERS    8
+#define PMU_MAX_FIXED_COUNTERS 3
+#define PMU_MAX_EVENTS         (PMU_MAX_GP_COUNTERS + PMU_MAX_FIXED_COUNTERS)
+
+enum pmu_vendor {
+    PMU_VENDOR_NONE,
+    PMU_VENDOR_INTEL,
+    PMU_VENDOR_AMD,
+};
+typedef enum pmu_vendor pmu_vendor_t;
+
+enum pmu_event {
+    PMU_EVENT_CYCLES,
+    PMU_EVENT_INSTRUCTIONS,
+    PMU_EVENT_REF_CYCLES,
+    PMU_EVENT_LLC_REFERENCES,
+    PMU_EVENT_LLC_MISSES,
+    PMU_EVENT_BRANCHES,
+    PMU_EVENT_BRANCH_MISSES,
+    PMU_EVENT_DTLB_MISSES,
+    PMU_EVENT_DTLB_WALK_CYCLES,
+    PMU_EVENT_MAX,
+};
+typedef enum pmu_event pmu_event_t;
+
+struct pmu_info {
+    pmu_vendor_t vendor;
+    unsigned int version;
+    unsigned int nr_gp;
+    unsigned int gp_width;
+    unsigned int nr_fixed;
+    unsigned int fixed_width;
+    uint32_t events; /* Bitmap of pmu_event_t supported by this PMU */
+};
+typedef struct pmu_info pmu_info_t;
+
+/* One programmed counter of a CPU */
+struct pmu_counter {
+    pmu_event_t event;
+    bool fixed;
+    uint8_t index;
+};
+typedef struct pmu_counter pmu_counter_t;
+
+struct pmu_cpu {
+    unsigned int nr_counters;
+    pmu_counter_t counters[PMU_MAX_EVENTS];
+    uint64_t global_ctrl; /* Intel v2+: counters enabled by pmu_start() */
+    uint64_t fixed_ctrl;
+    bool running;
+
+    /* Overflow sampling on the last GP counter, independent of the counters above */
+    bool sampling;
+    uint64_t sample_period;
+    uint64_t sample_ctrl; /* Intel v2+: global control bit of the sampling counter */
+
+    /* Accounting for the pmu_stat_begin() session this CPU last joined */
+    unsigned int stat_session;
+    bool stat_touched;
+    unsigned int stat_depth; /* pmu_stat_enter() nesting */
+    bool stat_suspended;     /* Counters lent out, see pmu_stat_suspend() */
+    uint64_t stat_snapshot[PMU_MAX_EVENTS];
+    uint64_t stat_delta[PMU_MAX_EVENTS];
+};
+typedef struct pmu_cpu pmu_cpu_t;
+
+/* External declarations */
+
+extern int init_pmu(void);
+extern const pmu_info_t *get_pmu_info(void);
+extern const char *pmu_event_name(pmu_event_t event);
+extern int pmu_event_lookup(const char *name);
+
+extern int pmu_setup(const pmu_event_t *events, unsigned int nr);
+extern void pmu_release(void);
+extern void pmu_start(void);
+extern void pmu_stop(void);
+extern void pmu_reset(void);
+extern unsigned int pmu_read(uint64_t *values);
+extern uint64_t pmu_read_counter(unsigned int idx);
+
+extern int pmu_sample_start(pmu_event_t event, uint64_t period);
+extern void pmu_sample_stop(void);
+extern bool pmu_sample_overflow(void);
+
+extern int pmu_stat_begin(const pmu_event_t *events, unsigned int nr);
+extern void pmu_stat_end(void);
+extern void pmu_stat_enter(void);
+extern void pmu_stat_exit(void);
+extern void pmu_stat_suspend(void);
+extern void pmu_stat_resume(void);
+extern unsigned int pmu_stat_get(unsigned int cpu, uint64_t *deltas);
+
+/* Static declarations */
+
+static inline bool pmu_available(void) {
+    return get_pmu_info()->vendor != PMU_VENDOR_NONE;
+}
+
+static inline bool pmu_has_event(pmu_event_t event) {
+    return !!(get_pmu_info()->events & (_U32(1) << event));
+}
+
+#endif /* KTF_PMU_H */
@@ -89,6 +89,12 @@
 #define X86_CR4_SMEP       0x00100000 /* SMEP                           */
 #define X86_CR4_SMAP       0x00200000 /* SMAP                           */
 
+/*
+ * CR3 bits with CR4.PCIDE set.
+ */
+#define X86_CR3_PCID_MASK 0x0000000000000fff /* Process-context identifier  */
+#define X86_CR3_NOFLUSH   0x8000000000000000 /* Keep the PCID's TLB entries */
+
 /*
  * Model Specific Registers (MSR)
  */
@@ -114,6 +120,9 @@
 
 #define MSR_APIC_BASE 0x0000001B
 
+#define MSR_TSC_ADJUST   0x0000003B
+#define MSR_TSC_DEADLINE 0x000006E0
+
 #define MSR_EFER   0xc0000080      /* Extended Feature Enable Register */
 #define EFER_SCE   (_U64(1) << 0)  /* SYSCALL Enable */
 #define EFER_LME   (_U64(1) << 8)  /* Long Mode Enable */
@@ -0,0 +1,71 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KTF_TOPOLOGY_H
+#define KTF_TOPOLOGY_H
+
+#include <ktf.h>
+
+/* CPUID.0BH and CPUID.1FH sub-leaf layout */
+#define CPUID_TOPO_EAX_SHIFT(eax) ((eax) & 0x1f)
+#define CPUID_TOPO_ECX_TYPE(ecx)  (((ecx) >> 8) & 0xff)
+
+enum cpuid_topo_level {
+    CPUID_TOPO_INVALID = 0,
+    CPUID_TOPO_SMT = 1,
+    CPUID_TOPO_CORE = 2,
+    CPUID_TOPO_MODULE = 3,
+    CPUID_TOPO_TILE = 4,
+    CPUID_TOPO_DIE = 5,
+};
+typedef enum cpuid_topo_level cpuid_topo_level_t;
+
+/* CPUID.80000008H:ECX */
+#define CPUID_EXT_ADDR_ECX_NC(ecx)        (((ecx) & 0xff) + 1)
+#define CPUID_EXT_ADDR_ECX_CORE_BITS(ecx) (((ecx) >> 12) & 0xf)
+
+/* CPUID.8000001EH */
+#define CPUID_AMD_TOPO_EBX_THREADS(ebx) ((((ebx) >> 8) & 0xff) + 1)
+#define CPUID_AMD_TOPO_ECX_NODE(ecx)    ((ecx) & 0xff)
+
+/* All IDs except thread are unique system-wide: CPUs with equal core IDs are SMT
+ * siblings, CPUs with equal llc IDs share the last level cache.
+ */
+struct cpu_topology {
+    uint32_t apic_id;
+    unsigned int package;
+    unsigned int die;
+    unsigned int core;
+    unsigned int thread;
+    unsigned int llc;
+};
+typedef struct cpu_topology cpu_topology_t;
+
+struct cpu;
+
+/* External declarations */
+
+extern int init_cpu_topology(struct cpu *cpu);
+
+#endif /* KTF_TOPOLOGY_H */
@@ -35,18 +35,28 @@
 
 #define MAX_INT 256
 
+/* Interrupt Stack Table slots, as encoded in 64-bit gate descriptors */
+#define IST_NONE 0
+#define IST_DF   1
+#define IST_NMI  2
+
 #ifndef __ASSEMBLY__
 #include <cpu.h>
+#include <drivers/hpet.h>
 #include <drivers/keyboard.h>
 #include <drivers/pit.h>
 #include <drivers/serial.h>
+#include <hrtimer.h>
 
-#define SERIAL_COM1_IRQ COM1_IRQ_VECTOR
-#define SERIAL_COM2_IRQ COM2_IRQ_VECTOR
-#define TIMER_IRQ       PIT_IRQ_VECTOR
-#define KB_PORT1_IRQ    KEYBOARD_PORT1_IRQ_VECTOR
-#define KB_PORT2_IRQ    KEYBOARD_PORT2_IRQ_VECTOR
-#define APIC_TIMER_IRQ  APIC_TIMER_IRQ_VECTOR
+#define SERIAL_COM1_IRQ    COM1_IRQ_VECTOR
+#define SERIAL_COM2_IRQ    COM2_IRQ_VECTOR
+#define TIMER_IRQ          PIT_IRQ_VECTOR
+#define KB_PORT1_IRQ       KEYBOARD_PORT1_IRQ_VECTOR
+#define KB_PORT2_IRQ       KEYBOARD_PORT2_IRQ_VECTOR
+#define APIC_TIMER_IRQ     APIC_TIMER_IRQ_VECTOR
+#define HPET_EVENT_IRQ     HPET_EVENT_IRQ_VECTOR
+#define HRTIMER_IPI_IRQ    HRTIMER_IPI_IRQ_VECTOR
+#define APIC_BENCH_IPI_IRQ APIC_BENCH_IPI_IRQ_VECTOR
 
 #define APIC_SPI_VECTOR 0xFF
 
@@ -0,0 +1,107 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KTF_TSC_H
+#define KTF_TSC_H
+
+#include <cpu.h>
+#include <ktf.h>
+#include <lib.h>
+#include <percpu.h>
+#include <time.h>
+
+enum tsc_freq_source {
+    TSC_FREQ_SOURCE_NONE,
+    TSC_FREQ_SOURCE_CPUID_15, /* TSC/crystal clock ratio */
+    TSC_FREQ_SOURCE_CPUID_16, /* Processor base frequency */
+    TSC_FREQ_SOURCE_HPET,     /* Calibrated against HPET main counter */
+    TSC_FREQ_SOURCE_PIT,      /* Calibrated against PIT channel 2 */
+};
+typedef enum tsc_freq_source tsc_freq_source_t;
+
+struct tsc_info {
+    uint64_t frequency;  /* Hz */
+    uint64_t crystal_hz; /* Core crystal clock frequency, if enumerated */
+    uint64_t mult;       /* ns = (cycles * mult) >> TSC_MULT_SHIFT */
+    tsc_freq_source_t source;
+    bool invariant;
+    bool adjust; /* IA32_TSC_ADJUST MSR available */
+};
+typedef struct tsc_info tsc_info_t;
+
+/* Cross-CPU TSC synchronization results, relative to the BSP */
+struct tsc_sync_info {
+    uint64_t max_skew; /* Largest absolute per-CPU offset (cycles) */
+    uint64_t max_warp; /* Largest observed backwards step (cycles) */
+    unsigned int unsynced;
+};
+typedef struct tsc_sync_info tsc_sync_info_t;
+
+#define TSC_MULT_SHIFT 32
+
+extern tsc_info_t tsc_info;
+extern tsc_sync_info_t tsc_sync_info;
+
+/* External declarations */
+
+extern void init_tsc(void);
+extern const char *tsc_freq_source_name(tsc_freq_source_t source);
+
+extern void tsc_sync_ap(void);
+extern int tsc_sync_bsp(cpu_t *cpu);
+extern int tsc_sync_check(cpu_t *cpu);
+extern int tsc_sync_check_all(void);
+extern void tsc_sync_print_summary(void);
+
+/* Static declarations */
+
+static inline bool tsc_calibrated(void) {
+    return tsc_info.frequency != 0;
+}
+
+static inline uint64_t get_tsc_frequency(void) {
+    return tsc_info.frequency;
+}
+
+static inline uint64_t tsc_to_ns(uint64_t cycles) {
+    return (uint64_t) (((unsigned __int128) cycles * tsc_info.mult) >> TSC_MULT_SHIFT);
+}
+
+static inline uint64_t ns_to_tsc(uint64_t ns) {
+    uint64_t freq = tsc_info.frequency;
+
+    return (ns / NSEC_PER_SEC) * freq + ((ns % NSEC_PER_SEC) * freq) / NSEC_PER_SEC;
+}
+
+/* TSC offset of cpu relative to the BSP, as measured by the TSC sync check */
+static inline int64_t get_tsc_offset(unsigned int cpu) {
+    return get_percpu_page(cpu)->tsc_offset;
+}
+
+/* TSC reading of this CPU converted to the BSP's TSC time base */
+static inline uint64_t rdtsc_sync(void) {
+    return rdtsc_ordered() - PERCPU_GET(tsc_offset);
+}
+
+#endif /* KTF_TSC_H */
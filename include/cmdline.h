@@ -63,6 +63,9 @@ extern bool opt_debug;
 extern bool opt_keyboard;
 extern bool opt_pit;
 extern bool opt_apic_timer;
+extern bool opt_apic_tickless;
+extern bool opt_x2apic;
+extern bool opt_tsc_adjust;
 extern bool opt_hpet;
 extern bool opt_fpu;
 extern bool opt_qemu_console;
@@ -96,6 +96,7 @@ typedef uint64_t off_t;
 #define __user_bss  __section(".bss.user")
 
 #define __cmdline __section(".cmdline")
+#define __tests   __section(".tests")
 
 #define barrier()      asm volatile("" ::: "memory")
 #define ACCESS_ONCE(x) (*(volatile typeof(x) *) &(x))
@@ -26,17 +26,19 @@
 #define KTF_CPU_H
 
 #include <atomic.h>
+#include <cacheinfo.h>
 #include <ktf.h>
 #include <lib.h>
 #include <list.h>
 #include <percpu.h>
 #include <spinlock.h>
+#include <topology.h>
 
 #define CPU_UNBLOCKED (1 << 0)
 #define CPU_FINISHED  (1 << 1)
 
 struct cpu_flags {
-    uint64_t bsp : 1, enabled : 1, rsvd : 62;
+    uint64_t bsp : 1, enabled : 1, topology : 1, rsvd : 61;
 };
 typedef struct cpu_flags cpu_flags_t;
 
@@ -45,10 +47,14 @@ struct cpu {
     percpu_t *percpu;
     spinlock_t lock;
     list_head_t task_queue;
+    struct task *task; /* Task running on the CPU, NULL outside of run_tasks() */
     atomic_t run_state;
 
     unsigned int id;
     cpu_flags_t flags;
+
+    cpu_caches_t caches;
+    cpu_topology_t topology;
 };
 typedef struct cpu cpu_t;
 
@@ -60,6 +66,12 @@ extern cpu_t *get_cpu(unsigned int id);
 extern cpu_t *get_bsp_cpu(void);
 extern unsigned int get_nr_cpus(void);
 extern void for_each_cpu(void (*func)(cpu_t *cpu));
+extern void for_each_sibling(cpu_t *cpu, void (*func)(cpu_t *sibling, void *arg),
+                             void *arg);
+extern void for_each_core(void (*func)(cpu_t *cpu, void *arg), void *arg);
+extern unsigned int get_nr_cores(void);
+extern unsigned int get_nr_packages(void);
+extern void print_cpu_topology(void);
 extern void unblock_all_cpus(void);
 extern void block_all_cpus(void);
 extern void finish_all_cpus(void);
@@ -75,6 +87,25 @@ static inline bool is_cpu_enabled(cpu_t *cpu) {
     return cpu->flags.enabled;
 }
 
+static inline bool cpu_has_topology(cpu_t *cpu) {
+    return cpu->flags.topology;
+}
+
+static inline bool cpus_are_siblings(cpu_t *a, cpu_t *b) {
+    return cpu_has_topology(a) && cpu_has_topology(b) &&
+           a->topology.core == b->topology.core;
+}
+
+static inline bool cpus_share_llc(cpu_t *a, cpu_t *b) {
+    return cpu_has_topology(a) && cpu_has_topology(b) &&
+           a->topology.llc == b->topology.llc;
+}
+
+static inline bool cpus_share_package(cpu_t *a, cpu_t *b) {
+    return cpu_has_topology(a) && cpu_has_topology(b) &&
+           a->topology.package == b->topology.package;
+}
+
 static inline void init_cpu_runstate(cpu_t *cpu) {
     atomic_set(&cpu->run_state, 0);
 }
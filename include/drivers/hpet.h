@@ -27,7 +27,9 @@
 #ifndef KTF_HPET_H
 #define KTF_HPET_H
 
+#include <apic.h>
 #include <cpu.h>
+#include <time.h>
 
 #ifndef KTF_ACPICA
 #include <acpi_ktf.h>
@@ -40,6 +42,13 @@
 #define HPET_IRQ_OFFSET PIT_IRQ_OFFSET
 #define HPET_IRQ_VECTOR HPET_IRQ_OFFSET
 
+/* Per-CPU one-shot comparators delivered via FSB (MSI) */
+#define HPET_EVENT_IRQ_OFFSET (APIC_IRQ_BASE + 0x01)
+#define HPET_EVENT_IRQ_VECTOR HPET_EVENT_IRQ_OFFSET
+
+/* Minimum comparator distance, so the counter does not pass it while programming */
+#define HPET_MIN_DELTA_TICKS 64
+
 #ifndef KTF_ACPICA
 #define HPET_SIGNATURE (('H') | ('P' << 8) | ('E' << 16) | ('T' << 24))
 
@@ -109,9 +118,24 @@ enum {
 };
 
 #define HPET_CONFIG_INT_TYPE_TRIGGER_MODE 0
+#define HPET_CONFIG_INT_TYPE_LEVEL_MODE   1
+
+#define HPET_FSB_ADDR_SHIFT 32
 
 /* External Declarations */
 
 extern bool init_hpet(const cpu_t *cpu);
+extern bool hpet_available(void);
+extern uint64_t hpet_read_counter(void);
+extern uint64_t hpet_get_counter_mask(void);
+extern uint64_t hpet_get_frequency(void);
+extern uint64_t hpet_read_counter64(void);
+extern void hpet_counter_update(void);
+extern ktime_t hpet_ktime_ns(void);
+
+extern bool hpet_event_available(void);
+extern int hpet_event_program(ktime_t expires);
+extern void hpet_event_cancel(void);
+extern void hpet_event_interrupt_handler(void);
 
 #endif /* KTF_HPET_H */
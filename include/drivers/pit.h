@@ -37,9 +37,17 @@
 #define PIT_RELOAD        1000    /* 1ms */
 #define PIT_FREQUENCY     (PIT_OUT_FREQUENCY / PIT_RELOAD)
 #define PIT_DATA_PORT_CH0 0x40
+#define PIT_DATA_PORT_CH2 0x42
 #define PIT_COMMAND_PORT  0x43
 
+/* Channel 2 gate and output are controlled via the NMI status and control port */
+#define PIT_CH2_CONTROL_PORT 0x61
+#define PIT_CH2_GATE         0x01
+#define PIT_CH2_SPEAKER      0x02
+#define PIT_CH2_OUTPUT       0x20
+
 #define PIT_CHANNEL_0        0
+#define PIT_CHANNEL_2        (2 << 6)
 #define PIT_ACCESS_MODE_LOW  (1 << 4)
 #define PIT_ACCESS_MODE_HIGH (1 << 5)
 #define PIT_ACCESS_MODE_LH   (PIT_ACCESS_MODE_LOW | PIT_ACCESS_MODE_HIGH)
@@ -60,5 +68,12 @@ typedef enum pit_operational_mode pit_operational_mode_t;
 
 extern void init_pit(const cpu_t *cpu);
 extern void pit_disable(void);
+extern void pit_ch2_oneshot(uint16_t count);
+
+/* Static declarations */
+
+static inline bool pit_ch2_expired(void) {
+    return !!(inb(PIT_CH2_CONTROL_PORT) & PIT_CH2_OUTPUT);
+}
 
 #endif
@@ -29,25 +29,33 @@
 
 typedef void (*extable_entry_callback_t)(cpu_regs_t *regs);
 
+/* Covers faults at addresses in [fault_addr, fault_end) */
 struct extable_entry {
     x86_reg_t fault_addr;
+    x86_reg_t fault_end;
     x86_reg_t fixup;
     extable_entry_callback_t cb;
 } __packed;
 typedef struct extable_entry extable_entry_t;
 
 #if defined(__x86_64__)
-#define ASM_EXTABLE_HANDLER(fault_address, fixup, handler)                               \
+#define ASM_EXTABLE_RANGE_HANDLER(start, end, fixup, handler)                            \
     PUSHSECTION(.extables)                                                               \
-    ".quad " STR(fault_address) ", " STR(fixup) ", " STR(handler) ";\n" POPSECTION
+    ".quad " STR(start) ", " STR(end) ", " STR(fixup) ", " STR(handler) ";\n" POPSECTION
 #else
-#define ASM_EXTABLE_HANDLER(fault_address, fixup, handler)                               \
+#define ASM_EXTABLE_RANGE_HANDLER(start, end, fixup, handler)                            \
     PUSHSECTION(.extables)                                                               \
-    ".long " STR(fault_address) ", " STR(fixup) ", " STR(handler) ";\n" POPSECTION
+    ".long " STR(start) ", " STR(end) ", " STR(fixup) ", " STR(handler) ";\n" POPSECTION
 #endif
 
+#define ASM_EXTABLE_HANDLER(fault_address, fixup, handler)                               \
+    ASM_EXTABLE_RANGE_HANDLER(fault_address, fault_address + 1, fixup, handler)
+
 #define ASM_EXTABLE(fault_address, fixup) ASM_EXTABLE_HANDLER(fault_address, fixup, 0)
+#define ASM_EXTABLE_RANGE(start, end, fixup)                                             \
+    ASM_EXTABLE_RANGE_HANDLER(start, end, fixup, 0)
 
 extern void init_extables(void);
+extern const extable_entry_t *search_extables(unsigned long addr);
 
 #endif
@@ -0,0 +1,96 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KTF_HRTIMER_H
+#define KTF_HRTIMER_H
+
+#include <apic.h>
+#include <ktf.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <time.h>
+
+/* IPI asking a remote CPU to reprogram its timer event */
+#define HRTIMER_IPI_IRQ_OFFSET (APIC_IRQ_BASE + 0x02)
+#define HRTIMER_IPI_IRQ_VECTOR HRTIMER_IPI_IRQ_OFFSET
+
+#define HRTIMER_HEAP_SIZE 64
+
+typedef void (*hrtimer_fn_t)(void *arg);
+
+enum hrtimer_mode {
+    HRTIMER_MODE_ABS, /* Expiry time in ktime_ns() */
+    HRTIMER_MODE_REL, /* Expiry time relative to now */
+};
+typedef enum hrtimer_mode hrtimer_mode_t;
+
+struct hrtimer {
+    ktime_t expires;
+    hrtimer_fn_t fn;
+    void *arg;
+
+    unsigned int cpu;
+    int index; /* Position in the CPU's heap, -1 when not queued */
+
+    ktime_t fired; /* ktime_ns() right before the callback got called */
+};
+typedef struct hrtimer hrtimer_t;
+
+/* Per-CPU min-heap of pending timers ordered by expiry time */
+struct hrtimer_base {
+    spinlock_t lock;
+    unsigned int nr;
+    hrtimer_t *heap[HRTIMER_HEAP_SIZE];
+};
+typedef struct hrtimer_base hrtimer_base_t;
+
+/* Firing accuracy (callback time minus expiry time) */
+struct hrtimer_stats {
+    unsigned int samples;
+    int64_t min_ns;
+    int64_t max_ns;
+    int64_t avg_ns;
+};
+typedef struct hrtimer_stats hrtimer_stats_t;
+
+/* External declarations */
+
+extern void init_hrtimer(unsigned int cpu);
+extern void hrtimer_init(hrtimer_t *timer, hrtimer_fn_t fn, void *arg);
+extern int hrtimer_start(hrtimer_t *timer, unsigned int cpu, ktime_t expires,
+                         hrtimer_mode_t mode);
+extern int hrtimer_cancel(hrtimer_t *timer);
+extern void hrtimer_interrupt(void);
+extern void hrtimer_resume(void);
+extern void hrtimer_ipi_interrupt_handler(void);
+extern int hrtimer_measure_accuracy(unsigned int cpu, ktime_t delay,
+                                    unsigned int samples, hrtimer_stats_t *stats);
+
+/* Static declarations */
+
+static inline bool hrtimer_active(const hrtimer_t *timer) {
+    return ACCESS_ONCE(timer->index) >= 0;
+}
+
+#endif /* KTF_HRTIMER_H */
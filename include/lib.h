@@ -473,6 +473,25 @@ static inline uint64_t rdtscp(void) {
     return ((uint64_t) high << 32) | low;
 }
 
+static inline uint64_t rdpmc(uint32_t counter) {
+    unsigned int low, high;
+
+    asm volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+
+    return ((uint64_t) high << 32) | low;
+}
+
+/* RDTSC that does not get executed before preceding or after following instructions */
+static inline uint64_t rdtsc_ordered(void) {
+    uint64_t tsc;
+
+    lfence();
+    tsc = rdtsc();
+    lfence();
+
+    return tsc;
+}
+
 static inline void rep_nop(void) {
     asm volatile("rep;nop" ::: "memory");
 }
@@ -524,6 +543,9 @@ extern void srand(unsigned s);
 
 extern int rand(void);
 
+extern void sort(void *base, size_t num, size_t size,
+                 int (*cmp)(const void *, const void *));
+
 extern bool wrmsr_safe(uint32_t msr_idx, uint64_t value);
 extern bool rdmsr_safe(uint32_t msr_idx, uint64_t *value);
 
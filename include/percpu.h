@@ -30,6 +30,10 @@
 #include <lib.h>
 #include <list.h>
 #include <page.h>
+#include <pmu.h>
+
+struct hrtimer_base;
+struct profiler_buf;
 
 struct percpu {
     list_head_t list;
@@ -60,6 +64,19 @@ struct percpu {
     unsigned long usermode_private;
     volatile unsigned long apic_ticks;
     bool apic_timer_enabled;
+    uint8_t apic_timer_mode;
+    uint64_t apic_timer_period; /* APIC timer ticks or TSC cycles per ms */
+    uint64_t apic_timer_deadline;
+    bool apic_timer_tickless;
+    uint8_t apic_timer_quiet;          /* Quiet window nesting level */
+    uint64_t apic_timer_next;          /* Pending one-shot event (ns), 0 if none */
+    uint64_t apic_timer_quiet_start;   /* Quiet window start (ns) */
+    uint8_t hpet_timer;                /* Per-CPU HPET comparator, 0 if none */
+    uint64_t hpet_event_next;          /* Pending HPET one-shot event (ns), 0 if none */
+    int64_t tsc_offset;                /* TSC offset relative to the BSP (cycles) */
+    struct hrtimer_base *hrtimer_base;
+    struct profiler_buf *profiler_buf;
+    pmu_cpu_t pmu;
 } __aligned(PAGE_SIZE);
 typedef struct percpu percpu_t;
 
@@ -80,21 +97,21 @@ typedef struct percpu percpu_t;
     ({                                                                                   \
         asm volatile("movb %[val], %%gs:%[percpu_var]"                                   \
                      : [ percpu_var ] "=m"(ACCESS_ONCE(PERCPU_VAR(variable)))            \
-                     : [ val ] "r"((uint8_t) value));                                    \
+                     : [ val ] "r"((uint8_t) (value)));                                  \
     })
 
 #define PERCPU_SET_WORD(variable, value)                                                 \
     ({                                                                                   \
         asm volatile("movw %[val], %%gs:%[percpu_var]"                                   \
                      : [ percpu_var ] "=m"(ACCESS_ONCE(PERCPU_VAR(variable)))            \
-                     : [ val ] "r"((uint16_t) value));                                   \
+                     : [ val ] "r"((uint16_t) (value)));                                 \
     })
 
 #define PERCPU_SET_DWORD(variable, value)                                                \
     ({                                                                                   \
         asm volatile("movl %[val], %%gs:%[percpu_var]"                                   \
                      : [ percpu_var ] "=m"(ACCESS_ONCE(PERCPU_VAR(variable)))            \
-                     : [ val ] "r"((uint32_t) value));                                   \
+                     : [ val ] "r"((uint32_t) (value)));                                 \
     })
 
 #if defined(__x86_64__)
@@ -102,7 +119,7 @@ typedef struct percpu percpu_t;
     ({                                                                                   \
         asm volatile("movq %[val], %%gs:%[percpu_var]"                                   \
                      : [ percpu_var ] "=m"(ACCESS_ONCE(PERCPU_VAR(variable)))            \
-                     : [ val ] "r"((uint64_t) value));                                   \
+                     : [ val ] "r"((uint64_t) (value)));                                 \
     })
 #endif
 
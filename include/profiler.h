@@ -0,0 +1,68 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KTF_PROFILER_H
+#define KTF_PROFILER_H
+
+#include <ktf.h>
+#include <lib.h>
+#include <pmu.h>
+#include <processor.h>
+
+#define PROFILER_DEFAULT_PERIOD 100000
+#define PROFILER_STACK_DEPTH    7  /* Return addresses kept per sample */
+#define PROFILER_STACK_SCAN     64 /* Stack words inspected per sample */
+#define PROFILER_FLAT_TOP       20 /* Symbols listed in the flat profile */
+#define PROFILER_BUF_ORDER      PAGE_ORDER_2M
+
+/* The kernel is built without frame pointers, so the stack is recovered by scanning
+ * for text addresses above the interrupted RSP: callers are best effort and may
+ * include stale return addresses.
+ */
+struct profiler_sample {
+    unsigned long ip;
+    unsigned long stack[PROFILER_STACK_DEPTH]; /* Innermost first, 0 terminated */
+};
+typedef struct profiler_sample profiler_sample_t;
+
+struct profiler_buf {
+    unsigned int session;
+    unsigned int nr;
+    unsigned int max;
+    unsigned int depth; /* profiler_enter() nesting */
+    unsigned long lost;
+    profiler_sample_t samples[];
+};
+typedef struct profiler_buf profiler_buf_t;
+
+/* External declarations */
+
+extern int profiler_begin(pmu_event_t event, uint64_t period);
+extern void profiler_end(void);
+extern void profiler_enter(void);
+extern void profiler_exit(void);
+extern unsigned long profiler_report(const char *name);
+extern bool profiler_nmi_handler(const cpu_regs_t *regs);
+
+#endif /* KTF_PROFILER_H */
@@ -26,6 +26,7 @@
 #define KTF_SCHED_H
 
 #include <cpu.h>
+#include <errno.h>
 #include <ktf.h>
 #include <lib.h>
 #include <list.h>
@@ -93,6 +94,7 @@ extern task_t *new_task(const char *name, task_func_t func, void *arg, task_type
 extern int schedule_task(task_t *task, cpu_t *cpu);
 extern void run_tasks(cpu_t *cpu);
 extern void wait_for_task_group(const cpu_t *cpu, task_group_t group);
+extern bool in_test_task(const char *caller);
 
 /* Static declarations */
 
@@ -112,10 +114,14 @@ static inline task_t *new_user_task(const char *name, task_func_t func, void *ar
     return new_task(name, func, arg, TASK_TYPE_USER);
 }
 
-static inline void execute_tasks(void) {
+static inline int execute_tasks(void) {
+    if (in_test_task(__func__))
+        return -EBUSY;
+
     unblock_all_cpus();
     run_tasks(get_bsp_cpu());
     wait_for_all_cpus();
+    return 0;
 }
 
 static inline void set_task_repeat(task_t *task, task_repeat_t value) {
@@ -25,8 +25,37 @@
 #ifndef KTF_TEST_H
 #define KTF_TEST_H
 
+#include <ktf.h>
+
 #define MAX_OPT_TESTS_LEN 128
+#define MAX_TESTS         64
 
 typedef int(test_fn)(void *arg);
 
+/* Test descriptor, placed in the .tests section by REGISTER_TEST() */
+struct __packed ktf_test {
+    const char *name;
+    test_fn *fn;
+    uint64_t cpus;       /* Mask of CPU ids the test may run on, 0 for any CPU */
+    bool exclusive;      /* Needs the whole machine, e.g. schedules tasks of its own */
+    const char *tags;    /* Comma-separated tags for the tests= selection */
+    unsigned int repeat; /* Runs per selection, 0 means once */
+};
+typedef struct ktf_test ktf_test_t;
+
+#define TEST_CPU(id) (_U64(1) << (id))
+
+#define __ktftest static __tests __used __aligned(1) const struct ktf_test
+
+/* REGISTER_TEST(test_foo, test_foo, .tags = "bench,mem", .repeat = 3); */
+#define REGISTER_TEST(_name, _fn, ...)                                                   \
+    __ktftest __test_##_name = {.name = #_name, .fn = _fn, __VA_ARGS__}
+
+/* External declarations */
+
+extern const struct ktf_test __start_tests[], __end_tests[];
+
+#define for_each_test(ptr)                                                               \
+    for (const ktf_test_t *ptr = __start_tests; ptr < __end_tests; ptr++)
+
 #endif /* KTF_TEST_H */
@@ -25,15 +25,43 @@
 #ifndef KTF_TIME_H
 #define KTF_TIME_H
 
+#include <ktf.h>
+
 typedef uint64_t time_t;
+typedef uint64_t ktime_t; /* nanoseconds */
+
+#define NSEC_PER_USEC _U64(1000)
+#define NSEC_PER_MSEC _U64(1000000)
+#define NSEC_PER_SEC  _U64(1000000000)
+#define USEC_PER_SEC  _U64(1000000)
+#define MSEC_PER_SEC  _U64(1000)
 
 extern int msleep(time_t ms);
 extern int msleep_local(time_t ms);
 extern time_t get_timer_ticks(void);
 extern time_t get_local_ticks(void);
 
+extern ktime_t ktime_ns(void);
+extern void ndelay(uint64_t ns);
+
+extern int timer_quiet_enter(void);
+extern void timer_quiet_exit(void);
+extern bool timer_quiet(void);
+
 /* Static declarations */
 
+static inline void udelay(uint64_t us) {
+    ndelay(us * NSEC_PER_USEC);
+}
+
+static inline void mdelay(uint64_t ms) {
+    ndelay(ms * NSEC_PER_MSEC);
+}
+
+static inline ktime_t ktime_us(void) {
+    return ktime_ns() / NSEC_PER_USEC;
+}
+
 static inline int sleep(time_t s) {
     return msleep(s * 1000);
 }
@@ -0,0 +1,155 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KTF_TOOLKIT_BENCH_H
+#define KTF_TOOLKIT_BENCH_H
+
+#include <ktf.h>
+#include <lib.h>
+
+/* Upper bound of measured repetitions: one 2M page of samples */
+#define BENCH_MAX_REPS (PAGE_SIZE_2M / sizeof(uint64_t))
+
+#define BENCH_DEFAULT_WARMUP 16
+#define BENCH_DEFAULT_REPS   1000
+
+/* Tukey's fences for "far out" values: [Q1 - k * IQR, Q3 + k * IQR] */
+#define BENCH_OUTLIER_IQR_K 3
+
+enum bench_serialize {
+    BENCH_SERIALIZE_LFENCE, /* lfence; rdtsc ... rdtscp; lfence */
+    BENCH_SERIALIZE_CPUID,  /* cpuid; rdtsc ... rdtscp; cpuid */
+    BENCH_SERIALIZE_RDTSCP, /* rdtscp ... rdtscp */
+};
+typedef enum bench_serialize bench_serialize_t;
+
+/* Zero fields take the defaults, the same ones BENCH() uses without opts */
+struct bench_opts {
+    unsigned int warmup; /* Discarded iterations before measuring */
+    unsigned int reps;   /* Measured iterations */
+    unsigned int inner;  /* Body executions per measured iteration */
+    bench_serialize_t serialize;
+    bool irq_on; /* Leave interrupts enabled while measuring */
+    bool keep_outliers;
+    bool quiet; /* Do not print the result line */
+};
+typedef struct bench_opts bench_opts_t;
+
+/* All values in TSC cycles per body execution, overhead subtracted */
+struct bench_result {
+    const char *name;
+    unsigned int samples; /* Samples left after outlier rejection */
+    unsigned int outliers;
+    uint64_t overhead; /* Timing overhead of a measured iteration */
+    uint64_t min;
+    uint64_t median;
+    uint64_t p99;
+    uint64_t max;
+    uint64_t mean;
+    uint64_t stddev;
+};
+typedef struct bench_result bench_result_t;
+
+struct bench {
+    bench_opts_t opts;
+    bench_result_t result;
+    uint64_t *samples;
+    unsigned int order;
+    unsigned int iter;
+    unsigned long flags;
+};
+typedef struct bench bench_t;
+
+/* External declarations */
+
+extern int bench_begin(bench_t *b, const char *name, const bench_opts_t *opts);
+extern bool bench_next(bench_t *b);
+extern void bench_end(bench_t *b, bench_result_t *result);
+extern void bench_print(const bench_result_t *result);
+
+/* Static declarations */
+
+static inline uint64_t bench_tsc_start(bench_serialize_t serialize) {
+    uint32_t eax = 0, ebx, ecx = 0, edx;
+
+    switch (serialize) {
+    case BENCH_SERIALIZE_CPUID:
+        asm volatile("cpuid; rdtsc"
+                     : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx)::"memory");
+        return ((uint64_t) edx << 32) | eax;
+    case BENCH_SERIALIZE_RDTSCP:
+        return rdtscp();
+    case BENCH_SERIALIZE_LFENCE:
+    default:
+        return rdtsc_ordered();
+    }
+}
+
+static inline uint64_t bench_tsc_end(bench_serialize_t serialize) {
+    uint32_t low, high, eax = 0, ebx, ecx = 0, edx;
+
+    asm volatile("rdtscp" : "=a"(low), "=d"(high)::"ecx", "memory");
+
+    switch (serialize) {
+    case BENCH_SERIALIZE_CPUID:
+        asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx)::"memory");
+        break;
+    case BENCH_SERIALIZE_LFENCE:
+        lfence();
+        break;
+    default:
+        break;
+    }
+
+    return ((uint64_t) high << 32) | low;
+}
+
+static inline void bench_record(bench_t *b, uint64_t cycles) {
+    if (b->iter > b->opts.warmup)
+        b->samples[b->iter - b->opts.warmup - 1] = cycles;
+}
+
+/* Measure the statements in the variadic body: warm-up first, then opts->reps timed
+ * iterations of opts->inner body executions each. opts and result may be NULL.
+ * Evaluates to 0 on success or a negative error code.
+ *
+ * BENCH("clflush", NULL, &res, clflush(p));
+ */
+#define BENCH(_name, _opts, _result, ...)                                                \
+    ({                                                                                   \
+        bench_t __b;                                                                     \
+        int __rc = bench_begin(&__b, (_name), (_opts));                                  \
+        while (__rc == 0 && bench_next(&__b)) {                                          \
+            uint64_t __t0 = bench_tsc_start(__b.opts.serialize);                         \
+            for (unsigned int __i = 0; __i < __b.opts.inner; __i++) {                    \
+                __VA_ARGS__;                                                             \
+            }                                                                            \
+            bench_record(&__b, bench_tsc_end(__b.opts.serialize) - __t0);                \
+        }                                                                                \
+        if (__rc == 0)                                                                   \
+            bench_end(&__b, (_result));                                                  \
+        __rc;                                                                            \
+    })
+
+#endif /* KTF_TOOLKIT_BENCH_H */
@@ -26,6 +26,7 @@
 #define KTF_TOOLKIT_CACHE_H
 
 #include <lib.h>
+#include <list.h>
 #include <page.h>
 
 #define CACHE_LINE_SIZE     64
@@ -35,6 +36,22 @@
 
 #define SAMPLES_COUNT 64
 
+/* Access latency histograms: 4 cycles per bucket, last bucket collects the rest */
+#define CACHE_HIST_BUCKETS  128
+#define CACHE_HIST_SHIFT    2
+#define CACHE_CALIB_SAMPLES 2048
+
+/* Batched probing, bounds the order[], lat[] and hits[] arrays of callers */
+#define CACHE_PROBE_MAX_LINES 512
+#define CACHE_PROBE_WORDS(nr) (((nr) + 63) / 64)
+
+/* Eviction sets */
+#define CACHE_EVSET_MAX_WAYS   32
+#define CACHE_EVSET_POOL_MIN_PAGES 8   /* 2M pages of candidate lines, 4096 candidates */
+#define CACHE_EVSET_POOL_MAX_PAGES 256 /* Candidate and scratch pointers fill a 2M page */
+#define CACHE_EVSET_TRIALS     5 /* Majority vote over that many eviction tests */
+#define CACHE_EVSET_ATTEMPTS   8 /* Reduction restarts before giving up */
+
 typedef enum { H_NULL, H_ONE, H_UNDECIDED, H_EMPTY } heisenbit_t;
 
 struct cache_line {
@@ -46,6 +63,50 @@ typedef struct cache_channel {
     cache_line_t lines[CACHE_CHANNEL_LINES] __aligned(PAGE_SIZE);
 } cache_channel_t;
 
+struct cache_hist {
+    uint32_t buckets[CACHE_HIST_BUCKETS];
+    uint32_t samples;
+    uint32_t min;
+    uint32_t median;
+    uint32_t max;
+};
+typedef struct cache_hist cache_hist_t;
+
+/* Result of a hit/miss threshold calibration on one CPU for one memory type */
+struct cache_calibration {
+    list_head_t list;
+
+    unsigned int cpu;
+    pat_memory_type_t type;
+    cache_hist_t hit;
+    cache_hist_t miss;
+    uint32_t threshold;  /* Accesses faster than this are hits */
+    uint32_t errors;     /* Samples on the wrong side of the threshold */
+    uint32_t confidence; /* Correctly classified samples, per mille */
+};
+typedef struct cache_calibration cache_calibration_t;
+
+/* Lines of an eviction set are chained through their first two words (next, prev),
+ * so priming and probing are plain pointer chases without loop-carried arithmetic.
+ */
+struct cache_evset_line {
+    struct cache_evset_line *next;
+    struct cache_evset_line *prev;
+};
+typedef struct cache_evset_line cache_evset_line_t;
+
+struct cache_evset {
+    list_head_t list;
+
+    const void *target; /* Cache line the set was built for */
+    unsigned int ways;
+    uint32_t threshold; /* Target access time above which it counts as evicted */
+    cache_evset_line_t *head;
+    cache_evset_line_t *tail;
+    cache_evset_line_t *lines[CACHE_EVSET_MAX_WAYS];
+};
+typedef struct cache_evset cache_evset_t;
+
 /* Static declarations */
 
 static inline void cache_read_access_barrier(const volatile void *p) {
@@ -115,6 +176,81 @@ static inline uint32_t cache_write_access_time(volatile void *p) {
     return ret;
 }
 
+/* Flush a batch of lines, fencing once for the whole batch */
+static inline void cache_flush_lines(const void *base, size_t stride, unsigned nr) {
+    for (unsigned i = 0; i < nr; i++)
+        clflush(base + i * stride);
+    mfence();
+}
+
+/* Read access time of one line within a batch: the trailing rdtscp waits for the load,
+ * the leading one for the previous probe, so no full fence is needed per line.
+ * The result is early-clobber: rdtscp writes %eax before p is dereferenced.
+ */
+static inline uint32_t cache_probe_time(const volatile void *p) {
+    uint32_t ret;
+
+    asm volatile("rdtscp;"
+                 "lfence;"
+                 "mov %%eax, %%esi;"
+                 "mov (%1), %%rax;"
+                 "rdtscp;"
+                 "sub %%esi, %%eax;"
+                 : "=&a"(ret)
+                 : "r"(p)
+                 : "rcx", "rdx", "rsi", "memory");
+
+    return ret;
+}
+
+/*
+ * Time reads of nr lines located at base + i * stride, visiting them in the given
+ * order (see cache_probe_order()). lat[] is indexed by line, not by visit.
+ */
+static inline void cache_probe_lines(const void *base, size_t stride,
+                                     const uint16_t *order, unsigned nr, uint32_t *lat) {
+    ASSERT(nr <= CACHE_PROBE_MAX_LINES);
+
+    mfence();
+    for (unsigned i = 0; i < nr; i++)
+        lat[order[i]] = cache_probe_time(base + order[i] * stride);
+}
+
+/* Prime: walk the eviction set front to back, filling the target's cache set */
+static inline void cache_evset_prime(const cache_evset_t *evset) {
+    const cache_evset_line_t *p = evset->head;
+
+    asm volatile("1: mov (%0), %0;"
+                 "test %0, %0;"
+                 "jnz 1b;"
+                 : "+r"(p)
+                 :
+                 : "memory");
+}
+
+/* Probe: time a back to front walk of the eviction set. Walking backwards avoids
+ * evicting the lines still to be probed with the ones just reloaded.
+ */
+static inline uint32_t cache_evset_probe(const cache_evset_t *evset) {
+    const cache_evset_line_t *p = evset->tail;
+    uint32_t ret;
+
+    asm volatile("mfence;"
+                 "rdtscp;"
+                 "lfence;"
+                 "mov %%eax, %%esi;"
+                 "1: mov 8(%1), %1;"
+                 "test %1, %1;"
+                 "jnz 1b;"
+                 "rdtscp;"
+                 "sub %%esi, %%eax;"
+                 : "=a"(ret), "+r"(p)
+                 :
+                 : "rcx", "rdx", "rsi", "memory");
+
+    return ret;
+}
+
 /*
  * Return cache channel state of the bit by checking cache lines presence.
  * Cache channel uses 2 cache lines (i.e. 2 bits of information) to leak 1 bit of data.
@@ -141,5 +277,22 @@ static inline heisenbit_t cache_channel_measure_bit(const void *cl1, const void
 /* External declarations */
 
 extern uint64_t cache_channel_baseline(const cache_line_t *cl, unsigned delay);
+extern int cache_calibrate(const cache_line_t *cl, pat_memory_type_t type,
+                           cache_calibration_t *calib);
+extern int cache_get_calibration(unsigned int cpu, pat_memory_type_t type,
+                                 cache_calibration_t *calib);
+extern unsigned cache_threshold(const cache_line_t *cl, pat_memory_type_t type);
+extern void cache_print_calibration(const cache_calibration_t *calib);
+
+extern const cache_evset_t *cache_evset_get(const void *target, unsigned ways);
+extern void cache_evset_release_all(void);
+extern uint64_t cache_evict_time(const cache_evset_t *evset, void (*fn)(void *arg),
+                                 void *arg);
+
+extern void cache_probe_order(uint16_t *order, unsigned nr);
+extern unsigned cache_classify_lines(const uint32_t *lat, unsigned nr, uint32_t threshold,
+                                     uint64_t *hits);
+extern unsigned cache_channel_probe(const cache_channel_t *channel, uint32_t threshold,
+                                    uint32_t *lat, uint64_t *hits);
 
 #endif /* KTF_TOOLKIT_CACHE_H */
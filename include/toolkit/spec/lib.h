@@ -0,0 +1,142 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KTF_TOOLKIT_SPEC_H
+#define KTF_TOOLKIT_SPEC_H
+
+#include <ktf.h>
+#include <lib.h>
+#include <page.h>
+
+#include <toolkit/cache/lib.h>
+
+/* One 2M executable buffer per CPU: gadget slots first, the BTB flush block last */
+#define SPEC_JIT_SIZE        PAGE_SIZE_2M
+#define SPEC_JIT_SLOT_SIZE   PAGE_SIZE
+#define SPEC_JIT_BTB_OFFSET  (SPEC_JIT_SIZE / 2)
+#define SPEC_JIT_MAX_GADGETS (SPEC_JIT_BTB_OFFSET / SPEC_JIT_SLOT_SIZE)
+
+/* 8192 fetch blocks with two taken jumps each overflow the BTB of current cores */
+#define SPEC_BTB_FLUSH_BLOCKS 8192
+#define SPEC_FETCH_BLOCK_SIZE 64
+
+/* Padding between a branch and its target must fit a slot with the rest of the gadget */
+#define SPEC_MAX_DISTANCE (SPEC_JIT_SLOT_SIZE / 2)
+
+enum spec_branch {
+    SPEC_BRANCH_JCC,  /* Always taken jz, predicted not taken on first sight */
+    SPEC_BRANCH_JMP,  /* Direct jmp */
+    SPEC_BRANCH_CALL, /* Direct call, the target drops the return address */
+    SPEC_BRANCH_MAX,
+};
+typedef enum spec_branch spec_branch_t;
+
+enum spec_direction {
+    SPEC_FORWARD,
+    SPEC_BACKWARD,
+};
+typedef enum spec_direction spec_direction_t;
+
+/* A gadget is a branch whose architecturally skipped shadow loads the probe line */
+struct spec_gadget_desc {
+    spec_branch_t branch;
+    spec_direction_t dir;
+    unsigned int distance;   /* Bytes of padding between the branch and its target */
+    unsigned int offset;     /* Offset of the branch within its 64 byte fetch block */
+    unsigned int probe_line; /* Cache channel line loaded in the branch shadow */
+};
+typedef struct spec_gadget_desc spec_gadget_desc_t;
+
+struct spec_jit {
+    uint8_t *base;
+    unsigned int nr_gadgets;
+    void (*btb_flush)(void);
+};
+typedef struct spec_jit spec_jit_t;
+
+struct spec_gadget {
+    spec_gadget_desc_t desc;
+    const spec_jit_t *jit;
+    unsigned int distance;           /* Padding used, backward gadgets round it up */
+    void (*entry)(const void *line); /* Loads line only speculatively */
+};
+typedef struct spec_gadget spec_gadget_t;
+
+struct spec_run_opts {
+    unsigned int iterations; /* Flush, run and probe cycles per round */
+    unsigned int rounds;     /* Result records per gadget */
+    bool flush_btb;          /* Run the BTB flush block before each gadget call */
+};
+typedef struct spec_run_opts spec_run_opts_t;
+
+struct spec_result {
+    unsigned int cpu;
+    unsigned int iterations;
+    unsigned int hits;         /* Probe line found cached after the gadget ran */
+    unsigned int control_hits; /* Line never touched by the gadget found cached */
+    uint32_t threshold;
+};
+typedef struct spec_result spec_result_t;
+
+/* Gadget matrix run in parallel on every enabled CPU, see spec_run_matrix() */
+struct spec_matrix {
+    const char *name;
+    const spec_gadget_desc_t *descs;
+    unsigned int nr;
+    spec_run_opts_t opts;
+};
+typedef struct spec_matrix spec_matrix_t;
+
+/* Static declarations */
+
+static inline const char *spec_branch_name(spec_branch_t branch) {
+    switch (branch) {
+    case SPEC_BRANCH_JCC:
+        return "jcc";
+    case SPEC_BRANCH_JMP:
+        return "jmp";
+    case SPEC_BRANCH_CALL:
+        return "call";
+    default:
+        return "?";
+    }
+}
+
+static inline const char *spec_direction_name(spec_direction_t dir) {
+    return dir == SPEC_FORWARD ? "forward" : "backward";
+}
+
+/* External declarations */
+
+extern int spec_jit_init(spec_jit_t *jit);
+extern void spec_jit_release(spec_jit_t *jit);
+extern int spec_gadget_build(spec_jit_t *jit, const spec_gadget_desc_t *desc,
+                             spec_gadget_t *gadget);
+extern void spec_gadget_run(const spec_gadget_t *gadget, const cache_channel_t *channel,
+                            const spec_run_opts_t *opts, spec_result_t *res);
+extern void spec_print_result(const char *name, const spec_gadget_t *gadget,
+                              const spec_result_t *res);
+extern int spec_run_matrix(const spec_matrix_t *matrix);
+
+#endif /* KTF_TOOLKIT_SPEC_H */
@@ -29,6 +29,7 @@
 #define SYSCALL_PRINTF 1
 #define SYSCALL_MMAP   2
 #define SYSCALL_MUNMAP 3
+#define SYSCALL_NOP    4
 
 #define USERMODE_FLAGS_MASK                                                              \
     (X86_EFLAGS_CF | X86_EFLAGS_PF | X86_EFLAGS_AF | X86_EFLAGS_ZF | X86_EFLAGS_SF |     \
@@ -65,6 +66,7 @@ extern void __user_text exit(unsigned long exit_code);
 extern void __user_text printf(const char *fmt, ...);
 extern void *__user_text mmap(void *va, unsigned long order);
 extern void __user_text munmap(void *va, unsigned long order);
+extern long __user_text nop_syscall(void);
 extern bool __user_text syscall_mode(syscall_mode_t);
 
 #endif /* __ASSEMBLY__ */
@@ -0,0 +1,314 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <apic.h>
+#include <console.h>
+#include <cpu.h>
+#include <errno.h>
+#include <hrtimer.h>
+#include <ktf.h>
+#include <lib.h>
+#include <limits.h>
+#include <percpu.h>
+#include <string.h>
+#include <time.h>
+
+#include <drivers/hpet.h>
+
+#include <mm/slab.h>
+
+#include <smp/smp.h>
+
+static inline hrtimer_base_t *get_hrtimer_base(unsigned int cpu) {
+    return get_percpu_page(cpu)->hrtimer_base;
+}
+
+static inline void hrtimer_heap_swap(hrtimer_base_t *base, unsigned int i,
+                                     unsigned int j) {
+    hrtimer_t *tmp = base->heap[i];
+
+    base->heap[i] = base->heap[j];
+    base->heap[j] = tmp;
+    base->heap[i]->index = i;
+    base->heap[j]->index = j;
+}
+
+static void hrtimer_heap_sift_up(hrtimer_base_t *base, unsigned int i) {
+    while (i > 0) {
+        unsigned int parent = (i - 1) / 2;
+
+        if (base->heap[parent]->expires <= base->heap[i]->expires)
+            break;
+
+        hrtimer_heap_swap(base, i, parent);
+        i = parent;
+    }
+}
+
+static void hrtimer_heap_sift_down(hrtimer_base_t *base, unsigned int i) {
+    while (true) {
+        unsigned int left = 2 * i + 1, right = left + 1, min = i;
+
+        if (left < base->nr && base->heap[left]->expires < base->heap[min]->expires)
+            min = left;
+        if (right < base->nr && base->heap[right]->expires < base->heap[min]->expires)
+            min = right;
+        if (min == i)
+            break;
+
+        hrtimer_heap_swap(base, i, min);
+        i = min;
+    }
+}
+
+static int hrtimer_heap_insert(hrtimer_base_t *base, hrtimer_t *timer) {
+    if (base->nr >= ARRAY_SIZE(base->heap))
+        return -ENOSPC;
+
+    timer->index = base->nr;
+    base->heap[base->nr++] = timer;
+    hrtimer_heap_sift_up(base, timer->index);
+
+    return 0;
+}
+
+static void hrtimer_heap_remove(hrtimer_base_t *base, hrtimer_t *timer) {
+    unsigned int i = timer->index, last = --base->nr;
+
+    if (i != last) {
+        hrtimer_t *moved = base->heap[last];
+
+        base->heap[i] = moved;
+        moved->index = i;
+        hrtimer_heap_sift_down(base, i);
+        hrtimer_heap_sift_up(base, moved->index);
+    }
+
+    base->heap[last] = NULL;
+    timer->index = -1;
+}
+
+/* Arm the local event device for the earliest timer. Called with the base lock held
+ * on the CPU owning the base. Without a one-shot capable event device, the periodic
+ * APIC timer tick polls for expired timers instead. Within a quiet window nothing
+ * gets armed, hrtimer_resume() does that once the window ends.
+ */
+static void hrtimer_reprogram(hrtimer_base_t *base) {
+    ktime_t expires;
+
+    if (!base->nr || timer_quiet())
+        return;
+
+    expires = base->heap[0]->expires;
+
+    if (PERCPU_GET(apic_timer_tickless))
+        apic_timer_set_next_event(expires);
+    else if (hpet_event_available() && hpet_event_program(expires) == -ETIME)
+        apic_send_self_ipi(HRTIMER_IPI_IRQ_VECTOR);
+}
+
+void hrtimer_interrupt(void) {
+    hrtimer_base_t *base = PERCPU_GET(hrtimer_base);
+
+    /* Raised before the quiet window began, expired timers stay queued until it ends */
+    if (!base || timer_quiet())
+        return;
+
+    spin_lock(&base->lock);
+    while (base->nr > 0 && base->heap[0]->expires <= ktime_ns()) {
+        hrtimer_t *timer = base->heap[0];
+
+        hrtimer_heap_remove(base, timer);
+        spin_unlock(&base->lock);
+
+        timer->fired = ktime_ns();
+        timer->fn(timer->arg);
+
+        spin_lock(&base->lock);
+    }
+    hrtimer_reprogram(base);
+    spin_unlock(&base->lock);
+}
+
+/* Rearm the local event device after a quiet window, see timer_quiet_exit() */
+void hrtimer_resume(void) {
+    hrtimer_base_t *base = PERCPU_GET(hrtimer_base);
+    unsigned long flags;
+
+    if (!base)
+        return;
+
+    flags = interrupts_disable_save();
+    spin_lock(&base->lock);
+    hrtimer_reprogram(base);
+    spin_unlock(&base->lock);
+    interrupts_restore(flags);
+}
+
+void hrtimer_ipi_interrupt_handler(void) {
+    hrtimer_interrupt();
+    apic_EOI();
+}
+
+void hrtimer_init(hrtimer_t *timer, hrtimer_fn_t fn, void *arg) {
+    memset(timer, 0, sizeof(*timer));
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->index = -1;
+}
+
+/* Call timer->fn(timer->arg) on CPU cpu at (or after) expires */
+int hrtimer_start(hrtimer_t *timer, unsigned int cpu, ktime_t expires,
+                  hrtimer_mode_t mode) {
+    hrtimer_base_t *base = get_hrtimer_base(cpu);
+    unsigned long flags;
+    bool first;
+    int rc;
+
+    if (!base)
+        return -ENODEV;
+
+    if (mode == HRTIMER_MODE_REL)
+        expires += ktime_ns();
+
+    hrtimer_cancel(timer);
+
+    flags = interrupts_disable_save();
+    spin_lock(&base->lock);
+
+    timer->expires = expires;
+    timer->cpu = cpu;
+    rc = hrtimer_heap_insert(base, timer);
+    first = rc == 0 && timer->index == 0;
+
+    if (first && cpu == smp_processor_id())
+        hrtimer_reprogram(base);
+
+    spin_unlock(&base->lock);
+    interrupts_restore(flags);
+
+    /* The remote CPU has to reprogram its own event device. A quiet one does that
+     * when its window ends, and sees the new timer as it takes the base lock then.
+     */
+    if (first && cpu != smp_processor_id()) {
+        percpu_t *percpu = get_percpu_page(cpu);
+
+        smp_mb();
+        if (!ACCESS_ONCE(percpu->apic_timer_quiet))
+            apic_send_ipi(percpu->apic_id, HRTIMER_IPI_IRQ_VECTOR);
+    }
+
+    return rc;
+}
+
+/* Dequeue the timer. Returns 1 if it was pending, 0 otherwise. A callback already
+ * running on another CPU is not waited for.
+ */
+int hrtimer_cancel(hrtimer_t *timer) {
+    hrtimer_base_t *base;
+    unsigned long flags;
+    int rc = 0;
+
+    if (!hrtimer_active(timer))
+        return 0;
+
+    base = get_hrtimer_base(timer->cpu);
+
+    flags = interrupts_disable_save();
+    spin_lock(&base->lock);
+    if (hrtimer_active(timer)) {
+        hrtimer_heap_remove(base, timer);
+        rc = 1;
+    }
+    spin_unlock(&base->lock);
+    interrupts_restore(flags);
+
+    return rc;
+}
+
+static void hrtimer_accuracy_fn(void *arg) {
+    atomic_inc(arg);
+}
+
+/* Fire samples timers on CPU cpu, delay ns apart, and compare their callback time
+ * with the expiry time. Both are TSC based, so remote CPUs rely on synchronized TSCs.
+ */
+int hrtimer_measure_accuracy(unsigned int cpu, ktime_t delay, unsigned int samples,
+                             hrtimer_stats_t *stats) {
+    atomic_t fired = {0};
+    hrtimer_t timer;
+    int64_t sum = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->min_ns = LONG_MAX;
+    stats->max_ns = LONG_MIN;
+
+    hrtimer_init(&timer, hrtimer_accuracy_fn, &fired);
+
+    for (unsigned int i = 0; i < samples; i++) {
+        ktime_t timeout;
+        int64_t late;
+        int rc;
+
+        rc = hrtimer_start(&timer, cpu, delay, HRTIMER_MODE_REL);
+        if (rc < 0)
+            return rc;
+
+        /* Give up on a timer 10ms (or 10x delay) past its expiry */
+        timeout = timer.expires + max(10 * delay, NSEC_PER_MSEC * 10);
+        while (atomic_read(&fired) == (int32_t) i) {
+            if (ktime_ns() > timeout) {
+                hrtimer_cancel(&timer);
+                return -ETIME;
+            }
+            cpu_relax();
+        }
+
+        late = (int64_t) (ACCESS_ONCE(timer.fired) - timer.expires);
+        stats->min_ns = min(stats->min_ns, late);
+        stats->max_ns = max(stats->max_ns, late);
+        sum += late;
+        stats->samples++;
+    }
+
+    if (stats->samples)
+        stats->avg_ns = sum / (int64_t) stats->samples;
+
+    return 0;
+}
+
+void init_hrtimer(unsigned int cpu) {
+    percpu_t *percpu = get_percpu_page(cpu);
+    hrtimer_base_t *base;
+
+    if (percpu->hrtimer_base)
+        return;
+
+    base = kzalloc(sizeof(*base));
+    BUG_ON(!base);
+    base->lock = SPINLOCK_INIT;
+
+    smp_wmb();
+    percpu->hrtimer_base = base;
+}
@@ -87,3 +87,45 @@ bool wrmsr_safe(uint32_t msr_idx, uint64_t value) {
                  : "memory");
     return success;
 }
+
+static inline void sort_swap(void *a, void *b, size_t size) {
+    uint8_t *pa = a, *pb = b;
+
+    while (size--) {
+        uint8_t tmp = *pa;
+
+        *pa++ = *pb;
+        *pb++ = tmp;
+    }
+}
+
+static void sort_sift_down(uint8_t *base, size_t root, size_t num, size_t size,
+                           int (*cmp)(const void *, const void *)) {
+    while (2 * root + 1 < num) {
+        size_t child = 2 * root + 1;
+
+        if (child + 1 < num && cmp(base + child * size, base + (child + 1) * size) < 0)
+            child++;
+        if (cmp(base + root * size, base + child * size) >= 0)
+            return;
+
+        sort_swap(base + root * size, base + child * size, size);
+        root = child;
+    }
+}
+
+/* In-place heapsort: O(n log n) without recursion or extra memory */
+void sort(void *base, size_t num, size_t size, int (*cmp)(const void *, const void *)) {
+    uint8_t *p = base;
+
+    if (num < 2)
+        return;
+
+    for (size_t i = num / 2; i-- > 0;)
+        sort_sift_down(p, i, num, size, cmp);
+
+    for (size_t end = num - 1; end > 0; end--) {
+        sort_swap(p, p + end * size, size);
+        sort_sift_down(p, 0, end, size, cmp);
+    }
+}
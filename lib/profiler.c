@@ -0,0 +1,316 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <console.h>
+#include <errno.h>
+#include <ktf.h>
+#include <lib.h>
+#include <percpu.h>
+#include <pmu.h>
+#include <profiler.h>
+#include <string.h>
+#include <symbols.h>
+#include <usermode.h>
+
+#include <mm/regions.h>
+#include <mm/vmm.h>
+#include <smp/smp.h>
+
+struct profiler_flat {
+    const char *name;
+    unsigned int count;
+};
+typedef struct profiler_flat profiler_flat_t;
+
+static const char profiler_unknown[] = "[unknown]";
+
+static pmu_event_t profiler_event;
+static uint64_t profiler_period;
+static unsigned int profiler_generation;
+static volatile unsigned int profiler_session; /* 0 when not profiling */
+
+static inline percpu_t *profiler_percpu(void) {
+    /* Do not rely on GS: an NMI may hit entry code before swapgs */
+    return get_percpu_page(smp_processor_id());
+}
+
+/* Start a profiling session. CPUs sample only between profiler_enter() and
+ * profiler_exit(), into per-CPU buffers allocated on their first entry.
+ */
+int profiler_begin(pmu_event_t event, uint64_t period) {
+    if (!pmu_available() || event >= PMU_EVENT_MAX || !pmu_has_event(event))
+        return -ENODEV;
+
+    if (period == 0 || period >= PMU_MAX_SAMPLE_PERIOD)
+        return -EINVAL;
+
+    if (profiler_session != 0)
+        return -EBUSY;
+
+    profiler_event = event;
+    profiler_period = period;
+    if (++profiler_generation == 0)
+        profiler_generation++;
+    smp_wmb();
+    profiler_session = profiler_generation;
+
+    return 0;
+}
+
+void profiler_end(void) {
+    profiler_session = 0;
+    smp_wmb();
+
+    pmu_sample_stop();
+
+    for (unsigned int cpu = 0; cpu < get_nr_cpus(); cpu++) {
+        percpu_t *percpu = get_percpu_page(cpu);
+
+        if (percpu->profiler_buf) {
+            put_pages(percpu->profiler_buf, PROFILER_BUF_ORDER);
+            percpu->profiler_buf = NULL;
+        }
+    }
+}
+
+void profiler_enter(void) {
+    unsigned int session = profiler_session;
+    percpu_t *percpu;
+    profiler_buf_t *buf;
+
+    if (session == 0)
+        return;
+
+    percpu = profiler_percpu();
+    buf = percpu->profiler_buf;
+    if (!buf) {
+        buf = get_free_pages(PROFILER_BUF_ORDER, GFP_KERNEL_MAP);
+        if (!buf) {
+            warning("CPU%u: Unable to allocate profiler buffer", percpu->cpu_id);
+            return;
+        }
+        buf->session = 0;
+        buf->max = (PAGE_SIZE_2M - sizeof(*buf)) / sizeof(buf->samples[0]);
+        percpu->profiler_buf = buf;
+    }
+
+    if (buf->session != session) {
+        buf->nr = 0;
+        buf->lost = 0;
+        buf->depth = 0;
+        smp_wmb();
+        buf->session = session;
+    }
+
+    if (buf->depth++ == 0)
+        pmu_sample_start(profiler_event, profiler_period);
+}
+
+void profiler_exit(void) {
+    profiler_buf_t *buf;
+
+    if (profiler_session == 0)
+        return;
+
+    buf = profiler_percpu()->profiler_buf;
+    if (!buf || buf->session != profiler_session || buf->depth == 0)
+        return;
+
+    if (--buf->depth == 0)
+        pmu_sample_stop();
+}
+
+static void profiler_scan_stack(profiler_sample_t *s, const cpu_regs_t *regs) {
+    unsigned long *sp = (unsigned long *) (regs->exc._ASM_SP & ~0x7UL);
+    unsigned int depth = 0;
+
+    if (!enter_from_usermode(regs->exc.cs)) {
+        for (unsigned int i = 0; i < PROFILER_STACK_SCAN && (_ul(&sp[i]) % PAGE_SIZE);
+             i++) {
+            if (!in_text_section(_ptr(sp[i])))
+                continue;
+
+            s->stack[depth++] = sp[i];
+            if (depth == ARRAY_SIZE(s->stack))
+                return;
+        }
+    }
+
+    s->stack[depth] = 0;
+}
+
+bool profiler_nmi_handler(const cpu_regs_t *regs) {
+    profiler_buf_t *buf;
+    profiler_sample_t *s;
+
+    if (!pmu_sample_overflow())
+        return false;
+
+    buf = profiler_percpu()->profiler_buf;
+    if (!buf || buf->session != profiler_session)
+        return true;
+
+    if (buf->nr >= buf->max) {
+        buf->lost++;
+        return true;
+    }
+
+    s = &buf->samples[buf->nr];
+    s->ip = regs->exc._ASM_IP;
+    profiler_scan_stack(s, regs);
+    buf->nr++;
+
+    return true;
+}
+
+/* Replace addresses by symbol names, dropping unresolved and repeated callers */
+static void profiler_symbolize(profiler_sample_t *s) {
+    const char *prev = symbol_name(_ptr(s->ip));
+    unsigned int depth = 0;
+
+    if (!prev)
+        prev = profiler_unknown;
+    s->ip = _ul(prev);
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(s->stack) && s->stack[i]; i++) {
+        const char *name = symbol_name(_ptr(s->stack[i]));
+
+        if (!name || name == prev)
+            continue;
+
+        s->stack[depth++] = _ul(name);
+        prev = name;
+    }
+
+    for (; depth < ARRAY_SIZE(s->stack); depth++)
+        s->stack[depth] = 0;
+}
+
+static int profiler_sample_cmp(const void *a, const void *b) {
+    const profiler_sample_t *x = a, *y = b;
+
+    if (x->ip != y->ip)
+        return x->ip < y->ip ? -1 : 1;
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(x->stack); i++) {
+        if (x->stack[i] != y->stack[i])
+            return x->stack[i] < y->stack[i] ? -1 : 1;
+    }
+
+    return 0;
+}
+
+static void profiler_flat_add(profiler_flat_t *top, const char *name,
+                              unsigned int count) {
+    unsigned int i = PROFILER_FLAT_TOP;
+
+    if (count <= top[i - 1].count)
+        return;
+
+    while (i > 1 && top[i - 2].count < count) {
+        top[i - 1] = top[i - 2];
+        i--;
+    }
+    top[i - 1].name = name;
+    top[i - 1].count = count;
+}
+
+static void profiler_print_folded(const char *name, unsigned int cpu,
+                                  const profiler_sample_t *s, unsigned int count) {
+    static char line[512];
+    int len, depth = 0;
+
+    while (depth < (int) ARRAY_SIZE(s->stack) && s->stack[depth])
+        depth++;
+
+    len = snprintf(line, sizeof(line), "%s;cpu%u", name, cpu);
+    while (depth-- > 0 && len < (int) sizeof(line))
+        len += snprintf(line + len, sizeof(line) - len, ";%s", (char *) s->stack[depth]);
+    if (len < (int) sizeof(line))
+        snprintf(line + len, sizeof(line) - len, ";%s", (char *) s->ip);
+
+    printk("FOLDED %s %u\n", line, count);
+}
+
+static void profiler_report_cpu(const char *name, unsigned int cpu, profiler_buf_t *buf) {
+    profiler_flat_t top[PROFILER_FLAT_TOP];
+    unsigned int nr = buf->nr;
+
+    memset(top, 0, sizeof(top));
+
+    for (unsigned int i = 0; i < nr; i++)
+        profiler_symbolize(&buf->samples[i]);
+    sort(buf->samples, nr, sizeof(buf->samples[0]), profiler_sample_cmp);
+
+    printk("PROFILE test=%s cpu=%u event=%s period=%lu samples=%u lost=%lu\n", name, cpu,
+           pmu_event_name(profiler_event), profiler_period, nr, buf->lost);
+
+    /* Samples are sorted by IP first, so equal symbols and equal stacks are adjacent */
+    for (unsigned int i = 0, flat = 0; i < nr; i++) {
+        const profiler_sample_t *s = &buf->samples[i];
+        unsigned int j = i;
+
+        while (j + 1 < nr && !profiler_sample_cmp(s, &buf->samples[j + 1]))
+            j++;
+        profiler_print_folded(name, cpu, s, j - i + 1);
+
+        flat += j - i + 1;
+        if (j + 1 == nr || buf->samples[j + 1].ip != s->ip) {
+            profiler_flat_add(top, (const char *) s->ip, flat);
+            flat = 0;
+        }
+        i = j;
+    }
+
+    for (unsigned int i = 0; i < PROFILER_FLAT_TOP && top[i].count; i++) {
+        unsigned int pm = top[i].count * 1000 / nr;
+
+        printk("PROFILE test=%s cpu=%u samples=%u pct=%u.%u symbol=%s\n", name, cpu,
+               top[i].count, pm / 10, pm % 10, top[i].name);
+    }
+}
+
+/* Print a flat profile and folded stacks of every CPU that took samples in the
+ * current session. Returns the total number of samples.
+ *
+ * Flame graph on the host: grep '^FOLDED ' log | cut -d' ' -f2- | flamegraph.pl
+ */
+unsigned long profiler_report(const char *name) {
+    unsigned long total = 0;
+
+    if (profiler_session == 0)
+        return 0;
+
+    for (unsigned int cpu = 0; cpu < get_nr_cpus(); cpu++) {
+        profiler_buf_t *buf = get_percpu_page(cpu)->profiler_buf;
+
+        if (!buf || buf->session != profiler_session || buf->nr == 0)
+            continue;
+
+        profiler_report_cpu(name, cpu, buf);
+        total += buf->nr;
+    }
+
+    return total;
+}
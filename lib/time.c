@@ -23,10 +23,17 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <apic.h>
+#include <cpu.h>
 #include <errno.h>
+#include <hrtimer.h>
 #include <percpu.h>
 #include <setup.h>
 #include <time.h>
+#include <tsc.h>
+
+#include <drivers/hpet.h>
+
+#include <smp/smp.h>
 
 extern boot_flags_t boot_flags;
 
@@ -34,12 +41,20 @@ static __aligned(16) volatile time_t ticks = 0;
 
 void timer_interrupt_handler(void) {
     asm volatile("lock incq %[ticks]" : [ ticks ] "=m"(ACCESS_ONCE(ticks)));
+    hpet_counter_update();
     apic_EOI();
 }
 
 void apic_timer_interrupt_handler(void) {
     asm volatile("lock incq %%gs:%[ticks]"
                  : [ ticks ] "=m"(ACCESS_ONCE(PERCPU_VAR(apic_ticks))));
+
+    if (PERCPU_GET(apic_timer_tickless))
+        PERCPU_SET(apic_timer_next, 0);
+    else if (PERCPU_GET(apic_timer_mode) == APIC_LVT_TIMER_TSC_DEADLINE)
+        apic_timer_deadline_rearm();
+
+    hrtimer_interrupt();
     apic_EOI();
 }
 
@@ -62,8 +77,8 @@ int msleep_local(time_t ms) {
     if (!PERCPU_GET(apic_timer_enabled))
         return -ENODEV;
 
-    end = PERCPU_GET(apic_ticks) + ms;
-    while (PERCPU_GET(apic_ticks) < end)
+    end = get_local_ticks() + ms;
+    while (get_local_ticks() < end)
         cpu_relax();
 
     return 0;
@@ -73,6 +88,107 @@ time_t get_timer_ticks(void) {
     return ACCESS_ONCE(ticks);
 }
 
+/* Local milliseconds ticks. Tickless CPUs do not take periodic interrupts, so
+ * derive the ticks from the TSC instead.
+ */
 time_t get_local_ticks(void) {
+    if (PERCPU_GET(apic_timer_tickless))
+        return ktime_ns() / NSEC_PER_MSEC;
+
     return PERCPU_GET(apic_ticks);
 }
+
+/* Open a quiet window on the current CPU: no local APIC timer interrupts, HPET
+ * comparator events or hrtimer IPIs are delivered until timer_quiet_exit(). Ticks
+ * missed in the meantime are accounted for, and pending tickless events and
+ * hrtimers are reprogrammed on exit. The CPU receiving the global timer interrupts
+ * cannot be made quiet.
+ */
+int timer_quiet_enter(void) {
+    unsigned long flags;
+    uint8_t level;
+
+    if (boot_flags.timer_global && is_cpu_bsp(get_cpu(smp_processor_id())))
+        return -EBUSY;
+
+    flags = interrupts_disable_save();
+    level = PERCPU_GET(apic_timer_quiet);
+    PERCPU_SET(apic_timer_quiet, level + 1);
+    if (level == 0) {
+        if (PERCPU_GET(apic_timer_enabled)) {
+            apic_timer_mask(true);
+            PERCPU_SET(apic_timer_quiet_start, ktime_ns());
+        }
+        hpet_event_cancel();
+    }
+    interrupts_restore(flags);
+
+    return 0;
+}
+
+void timer_quiet_exit(void) {
+    unsigned long flags;
+    uint8_t level;
+    ktime_t next;
+
+    flags = interrupts_disable_save();
+    level = PERCPU_GET(apic_timer_quiet);
+    BUG_ON(level == 0);
+    PERCPU_SET(apic_timer_quiet, --level);
+
+    if (level > 0)
+        goto out;
+
+    if (!PERCPU_GET(apic_timer_enabled))
+        goto resume;
+
+    apic_timer_mask(false);
+
+    if (PERCPU_GET(apic_timer_tickless)) {
+        next = PERCPU_GET(apic_timer_next);
+        if (next)
+            apic_timer_set_next_event(next);
+    }
+    else {
+        ktime_t elapsed = ktime_ns() - PERCPU_GET(apic_timer_quiet_start);
+
+        PERCPU_SET(apic_ticks, PERCPU_GET(apic_ticks) + elapsed / NSEC_PER_MSEC);
+        if (PERCPU_GET(apic_timer_mode) == APIC_LVT_TIMER_TSC_DEADLINE)
+            apic_timer_deadline_rearm();
+    }
+
+resume:
+    hrtimer_resume();
+out:
+    interrupts_restore(flags);
+}
+
+bool timer_quiet(void) {
+    return PERCPU_GET(apic_timer_quiet) > 0;
+}
+
+/* Nanoseconds since TSC reset. Falls back to the global timer ticks
+ * granularity until the TSC has been calibrated.
+ */
+ktime_t ktime_ns(void) {
+    if (unlikely(!tsc_calibrated()))
+        return get_timer_ticks() * NSEC_PER_MSEC;
+
+    return tsc_to_ns(rdtsc());
+}
+
+void ndelay(uint64_t ns) {
+    uint64_t start, cycles;
+
+    /* Crude approximation erring on the long side until calibrated */
+    if (unlikely(!tsc_calibrated())) {
+        for (cycles = ns; cycles > 0; cycles--)
+            cpu_relax();
+        return;
+    }
+
+    cycles = ns_to_tsc(ns);
+    start = rdtsc();
+    while (rdtsc() - start < cycles)
+        cpu_relax();
+}
@@ -26,6 +26,7 @@
 #include <apic.h>
 #include <console.h>
 #include <cpu.h>
+#include <cpuid.h>
 #include <ktf.h>
 #include <lib.h>
 #include <pagetable.h>
@@ -33,6 +34,7 @@
 #include <sched.h>
 #include <setup.h>
 #include <traps.h>
+#include <tsc.h>
 
 #include <mm/vmm.h>
 
@@ -46,6 +48,7 @@ static unsigned nr_cpus;
 static __data_init unsigned ap_cpuid;
 static __data_init bool ap_callin;
 static __data_init void *ap_new_sp;
+static __data_init atomic_t ap_ready;
 cr3_t __data_init ap_cr3;
 
 void __noreturn ap_startup(void) {
@@ -54,7 +57,16 @@ void __noreturn ap_startup(void) {
     cpu_t *cpu = get_cpu(ap_cpuid);
 
     init_traps(cpu);
-    init_apic(ap_cpuid, apic_get_mode());
+    init_apic(cpu->id, apic_get_mode());
+    init_cpu_cache_info(cpu);
+    init_cpu_topology(cpu);
+
+    /* Release BSP to boot the next AP while this one calibrates its timers */
+    ap_callin = true;
+    smp_wmb();
+
+    if (cpu_has_tsc())
+        tsc_sync_ap();
 
     /* Initialize timers and enable interrupts */
     init_timers(cpu);
@@ -63,9 +75,7 @@ void __noreturn ap_startup(void) {
     if (opt_fpu)
         enable_fpu();
 
-    /* Release BSP after full AP initialization */
-    ap_callin = true;
-    smp_wmb();
+    atomic_inc(&ap_ready);
 
     while (true)
         run_tasks(cpu);
@@ -109,6 +119,9 @@ static __text_init void boot_cpu(cpu_t *cpu) {
     while (!ap_callin)
         cpu_relax();
 
+    if (cpu_has_tsc())
+        tsc_sync_bsp(cpu);
+
     dprintk("AP: %u Done \n", cpu->id);
 }
 
@@ -119,4 +132,13 @@ void __text_init init_smp(void) {
     ap_cr3 = cr3;
 
     for_each_cpu(boot_cpu);
+
+    /* Wait for all APs to finish their (parallel) timer initialization */
+    while (atomic_read(&ap_ready) < (int) nr_cpus - 1)
+        cpu_relax();
+
+    print_cpu_topology();
+
+    if (cpu_has_tsc())
+        tsc_sync_print_summary();
 }
@@ -23,7 +23,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <console.h>
+#include <cpu.h>
 #include <ktf.h>
+#include <pmu.h>
+#include <profiler.h>
 #include <sched.h>
 #include <string.h>
 #include <symbols.h>
@@ -32,49 +35,433 @@
 static const char opt_test_delims[] = ",";
 #include <cmdline.h>
 
-enum get_next_test_result {
-    TESTS_DONE,
-    TESTS_FOUND,
-    TESTS_ERROR,
-};
-typedef enum get_next_test_result get_next_test_result_t;
-
+/* Test names, name globs, tag:<glob> or all; a leading '-' drops matching tests */
 static char opt_tests[MAX_OPT_TESTS_LEN];
 string_cmd("tests", opt_tests);
 
-static get_next_test_result_t get_next_test(test_fn **out_test_fn, char **out_name) {
-    static char *opt = opt_tests;
+/* Hardware events counted for each test, "none" to disable */
+static char opt_pmu_events[MAX_OPT_TESTS_LEN] =
+    "instructions,cycles,llc-misses,branch-misses,dtlb-misses";
+string_cmd("pmu_events", opt_pmu_events);
+
+/* Sample every N occurrences of profile_event while tests run, 0 to disable */
+static unsigned long opt_profile;
+ulong_cmd("profile", opt_profile);
+
+static char opt_profile_event[PARAM_MAX_LENGTH] = "cycles";
+string_cmd("profile_event", opt_profile_event);
+
+static pmu_event_t test_pmu_events[PMU_MAX_EVENTS];
+static unsigned int test_pmu_nr;
+
+/* Dispatch tests to all CPUs at once, exclusive tests still run alone on the BSP */
+static bool opt_tests_parallel;
+bool_cmd("tests_parallel", opt_tests_parallel);
+
+struct test {
+    ktf_test_t desc;
+    cpu_t *cpu; /* Where the test runs */
+    int rc;
+};
+typedef struct test test_t;
+
+static test_t tests[MAX_TESTS];
+static unsigned int nr_tests;
 
-    *out_name = strtok(opt, opt_test_delims);
+/* Shell style matching of '*' and '?' */
+static bool glob_match(const char *pattern, const char *s) {
+    const char *star = NULL, *retry = NULL;
 
-    opt = NULL;
-    if (*out_name) {
-        *out_test_fn = symbol_address(*out_name);
-        if (!*out_test_fn) {
-            warning("Symbol for test %s not found", *out_name);
-            return TESTS_ERROR;
+    while (*s) {
+        if (*pattern == '*') {
+            star = pattern++;
+            retry = s;
         }
-        return TESTS_FOUND;
+        else if (*pattern == '?' || *pattern == *s) {
+            pattern++;
+            s++;
+        }
+        else if (star) {
+            pattern = star + 1;
+            s = ++retry;
+        }
+        else
+            return false;
     }
-    return TESTS_DONE;
+
+    while (*pattern == '*')
+        pattern++;
+
+    return *pattern == '\0';
 }
 
-unsigned long test_main(void *unused) {
+static bool test_has_tag(const ktf_test_t *desc, const char *pattern) {
+    char tag[PARAM_MAX_LENGTH];
+
+    for (const char *p = desc->tags; p && *p;) {
+        size_t len = strcspn(p, opt_test_delims);
+
+        if (len < sizeof(tag)) {
+            strncpy(tag, p, len);
+            tag[len] = '\0';
+            if (glob_match(pattern, tag))
+                return true;
+        }
+
+        p += len;
+        if (*p)
+            p++;
+    }
+
+    return false;
+}
+
+static inline bool is_test_pattern(const char *token) {
+    return !strcmp(token, "all") || !strncmp(token, "tag:", 4) || strpbrk(token, "*?");
+}
+
+static bool test_matches(const ktf_test_t *desc, const char *token) {
+    if (!strcmp(token, "all"))
+        return true;
+    if (!strncmp(token, "tag:", 4))
+        return test_has_tag(desc, token + 4);
+
+    return glob_match(token, desc->name);
+}
+
+static bool is_test_selected(const ktf_test_t *desc) {
+    for (unsigned int i = 0; i < nr_tests; i++) {
+        if (tests[i].desc.fn == desc->fn && !strcmp(tests[i].desc.name, desc->name))
+            return true;
+    }
+
+    return false;
+}
+
+static void select_test(const ktf_test_t *desc) {
+    test_t *t = &tests[nr_tests];
+
+    if (nr_tests == ARRAY_SIZE(tests)) {
+        warning("Too many tests, ignoring %s", desc->name);
+        return;
+    }
+
+    memset(t, 0, sizeof(*t));
+    t->desc = *desc;
+    nr_tests++;
+}
+
+static void unselect_tests(const char *token) {
+    unsigned int nr = 0;
+
+    for (unsigned int i = 0; i < nr_tests; i++) {
+        if (!test_matches(&tests[i].desc, token))
+            tests[nr++] = tests[i];
+    }
+    nr_tests = nr;
+}
+
+/* Functions that are not registered can still be run by their symbol name */
+static bool select_test_symbol(const char *name) {
+    ktf_test_t desc = {.name = name};
+
+    desc.fn = symbol_address(name);
+    if (!desc.fn)
+        return false;
+
+    select_test(&desc);
+    return true;
+}
+
+/* Plain names are taken as often as they are listed, patterns add each test once */
+static void get_tests(void) {
+    char *token;
+
+    nr_tests = 0;
+    for (token = strtok(opt_tests, opt_test_delims); token;
+         token = strtok(NULL, opt_test_delims)) {
+        bool exclude = token[0] == '-', pattern, found = false;
+
+        if (exclude) {
+            unselect_tests(++token);
+            continue;
+        }
+
+        pattern = is_test_pattern(token);
+        for_each_test (desc) {
+            if (!test_matches(desc, token))
+                continue;
+
+            found = true;
+            if (!pattern || !is_test_selected(desc))
+                select_test(desc);
+        }
+
+        if (!found && (pattern || !select_test_symbol(token)))
+            warning("No test found for %s", token);
+    }
+}
+
+static void init_test_pmu_events(void) {
     char *name;
-    test_fn *fn = NULL;
-    unsigned n = 0;
 
-    printk("\nRunning tests\n");
+    if (!pmu_available() || !strcmp(opt_pmu_events, "none"))
+        return;
+
+    for (name = strtok(opt_pmu_events, opt_test_delims); name;
+         name = strtok(NULL, opt_test_delims)) {
+        int event = pmu_event_lookup(name);
+
+        if (event < 0 || !pmu_has_event(event)) {
+            warning("PMU event %s not supported", name);
+            continue;
+        }
+
+        if (test_pmu_nr == ARRAY_SIZE(test_pmu_events)) {
+            warning("Too many PMU events, ignoring %s", name);
+            continue;
+        }
+        test_pmu_events[test_pmu_nr++] = event;
+    }
+}
 
-    while (get_next_test(&fn, &name) == TESTS_FOUND) {
+static void print_test_pmu_stat(const char *name, const char *cpu_str,
+                                 const uint64_t *deltas, unsigned int nr) {
+    char buf[256];
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "PMU test=%s cpu=%s", name, cpu_str);
+    for (unsigned int i = 0; i < nr && len < (int) sizeof(buf); i++) {
+        len += snprintf(buf + len, sizeof(buf) - len, " %s=%lu",
+                        pmu_event_name(test_pmu_events[i]), deltas[i]);
+    }
+    printk("%s\n", buf);
+}
+
+/* Print the per-CPU deltas of every CPU the test ran on, followed by their sum */
+static void report_test_pmu_stat(const char *name) {
+    uint64_t deltas[PMU_MAX_EVENTS], total[PMU_MAX_EVENTS] = {0};
+    unsigned int nr_cpus = 0;
+    char cpu_str[16];
+
+    for (unsigned int cpu = 0; cpu < get_nr_cpus(); cpu++) {
+        unsigned int nr = pmu_stat_get(cpu, deltas);
+
+        if (nr == 0)
+            continue;
+
+        snprintf(cpu_str, sizeof(cpu_str), "%u", cpu);
+        print_test_pmu_stat(name, cpu_str, deltas, nr);
+        for (unsigned int i = 0; i < nr; i++)
+            total[i] += deltas[i];
+        nr_cpus++;
+    }
+
+    if (nr_cpus > 1)
+        print_test_pmu_stat(name, "all", total, test_pmu_nr);
+}
+
+static int start_test_profiler(void) {
+    int event = pmu_event_lookup(opt_profile_event);
+    int rc;
+
+    if (event < 0) {
+        warning("Unknown profile event %s", opt_profile_event);
+        return event;
+    }
+
+    rc = profiler_begin(event, opt_profile);
+    if (rc < 0)
+        warning("Unable to start the profiler: %d", rc);
+
+    return rc;
+}
+
+static inline unsigned int test_runs(const test_t *t) {
+    return max(t->desc.repeat, 1U);
+}
+
+static unsigned long test_task(void *arg) {
+    test_t *t = arg;
+
+    t->rc = 0;
+    for (unsigned int i = 0; i < test_runs(t); i++) {
+        int rc = t->desc.fn(NULL);
+
+        if (t->rc == 0)
+            t->rc = rc;
+    }
+
+    return t->rc;
+}
+
+/* First CPU allowed for the test that no other test of the batch runs on */
+static cpu_t *get_test_cpu(const test_t *t, const test_t *batch, unsigned int nr) {
+    for (unsigned int id = 0; id < get_nr_cpus(); id++) {
+        cpu_t *cpu = get_cpu(id);
+        bool busy = false;
+
+        if (!cpu || !is_cpu_enabled(cpu))
+            continue;
+        if (t->desc.cpus && (id >= 64 || !(t->desc.cpus & TEST_CPU(id))))
+            continue;
+
+        for (unsigned int i = 0; i < nr && !busy; i++)
+            busy = batch[i].cpu == cpu;
+        if (!busy)
+            return cpu;
+    }
+
+    return NULL;
+}
+
+static void run_test(test_t *t) {
+    bool pmu_stat = false, profile = false;
+
+    /* Tests that may not run on the BSP get a task on their first allowed CPU */
+    if (t->desc.cpus && !(t->desc.cpus & TEST_CPU(get_bsp_cpu()->id))) {
+        t->cpu = get_test_cpu(t, NULL, 0);
+        if (!t->cpu || t->desc.exclusive) {
+            warning("No allowed CPU for test %s, skipping", t->desc.name);
+            return;
+        }
+    }
+    else
+        t->cpu = get_bsp_cpu();
+
+    printk("Running test: %s\n", t->desc.name);
+    if (test_pmu_nr > 0)
+        pmu_stat = pmu_stat_begin(test_pmu_events, test_pmu_nr) == 0;
+    if (opt_profile > 0)
+        profile = start_test_profiler() == 0;
+
+    if (!is_cpu_bsp(t->cpu)) {
+        task_t *task = new_kernel_task(t->desc.name, test_task, t);
+
+        BUG_ON(!task);
+        set_task_group(task, TASK_GROUP_TEST);
+        schedule_task(task, t->cpu);
+        execute_tasks();
+        goto report;
+    }
+
+    t->rc = 0;
+    for (unsigned int i = 0; i < test_runs(t); i++) {
         int rc;
 
-        printk("Running test: %s\n", name);
-        rc = fn(NULL);
+        profiler_enter();
+        pmu_stat_enter();
+        rc = t->desc.fn(NULL);
+        pmu_stat_exit();
+        profiler_exit();
         execute_tasks();
 
-        printk("Test %s returned: 0x%x\n", name, rc);
-        n++;
+        /* Report the first failure of repeated runs */
+        if (t->rc == 0)
+            t->rc = rc;
+    }
+
+report:
+    if (pmu_stat) {
+        report_test_pmu_stat(t->desc.name);
+        pmu_stat_end();
+    }
+
+    if (profile) {
+        profiler_report(t->desc.name);
+        profiler_end();
+    }
+
+    printk("Test %s returned: 0x%x\n", t->desc.name, t->rc);
+}
+
+/* Run consecutive non-exclusive tests, one per CPU, starting with the given one.
+ * Returns the number of tests run. Their results are reported in list order.
+ */
+static unsigned int run_test_batch(test_t *batch, unsigned int max) {
+    bool pmu_stat = false, profile = false;
+    unsigned int nr = 0;
+
+    for (; nr < max && !batch[nr].desc.exclusive; nr++) {
+        test_t *t = &batch[nr];
+        task_t *task;
+
+        t->cpu = get_test_cpu(t, batch, nr);
+        if (!t->cpu)
+            break;
+
+        task = new_kernel_task(t->desc.name, test_task, t);
+        if (!task)
+            break;
+        set_task_group(task, TASK_GROUP_TEST);
+
+        printk("Running test: %s\n", t->desc.name);
+        schedule_task(task, t->cpu);
+    }
+
+    if (nr == 0)
+        return 0;
+
+    if (test_pmu_nr > 0)
+        pmu_stat = pmu_stat_begin(test_pmu_events, test_pmu_nr) == 0;
+    if (opt_profile > 0)
+        profile = start_test_profiler() == 0;
+
+    execute_tasks();
+
+    for (unsigned int i = 0; i < nr; i++) {
+        test_t *t = &batch[i];
+
+        if (pmu_stat) {
+            uint64_t deltas[PMU_MAX_EVENTS];
+            unsigned int nr_deltas = pmu_stat_get(t->cpu->id, deltas);
+            char cpu_str[16];
+
+            snprintf(cpu_str, sizeof(cpu_str), "%u", t->cpu->id);
+            if (nr_deltas > 0)
+                print_test_pmu_stat(t->desc.name, cpu_str, deltas, nr_deltas);
+        }
+        printk("Test %s returned: 0x%x\n", t->desc.name, t->rc);
+    }
+
+    if (pmu_stat)
+        pmu_stat_end();
+
+    if (profile) {
+        profiler_report("parallel");
+        profiler_end();
+    }
+
+    return nr;
+}
+
+unsigned long test_main(void *unused) {
+    unsigned int n = 0;
+
+    printk("\nRunning tests\n");
+
+    init_test_pmu_events();
+    get_tests();
+
+    for (unsigned int i = 0; i < nr_tests;) {
+        test_t *t = &tests[i];
+        unsigned int nr = 0;
+
+        if (opt_tests_parallel && !t->desc.exclusive) {
+            nr = run_test_batch(t, nr_tests - i);
+            if (nr == 0) {
+                warning("No CPU available for test %s, skipping", t->desc.name);
+                i++;
+                continue;
+            }
+        }
+        else {
+            run_test(t);
+            nr = 1;
+        }
+
+        i += nr;
+        n += nr;
     }
 
     printk("Tests completed: %u\n", n);
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <atomic.h>
+#include <console.h>
+#include <cpu.h>
+#include <cpuid.h>
+#include <errno.h>
+#include <ktf.h>
+#include <lib.h>
+#include <sched.h>
+#include <string.h>
+#include <test.h>
+#include <tsc.h>
+
+#include <smp/smp.h>
+
+#include <toolkit/cache/lib.h>
+
+#define C2C_MAX_CPUS 64
+#define C2C_ROUNDS   1000 /* Transfers per sample */
+#define C2C_SAMPLES  16
+
+enum c2c_pattern {
+    C2C_RAW,        /* Plain store, remote load spinning on it */
+    C2C_CAS,        /* Both sides spin with lock cmpxchg */
+    C2C_STORE_LOAD, /* One-way store to remote load, timed with the synced TSC */
+    C2C_PATTERNS,
+};
+typedef enum c2c_pattern c2c_pattern_t;
+
+static const char *const c2c_pattern_names[C2C_PATTERNS] = {
+    [C2C_RAW] = "raw",
+    [C2C_CAS] = "cas",
+    [C2C_STORE_LOAD] = "store_load",
+};
+
+/* The line bounced between the pair, and a separate one to pace store_load */
+static struct {
+    atomic64_t seq;
+    uint64_t tsc;
+} c2c_line __aligned(CACHE_LINE_SIZE);
+static atomic64_t c2c_ack __aligned(CACHE_LINE_SIZE);
+
+static cpu_t *c2c_cpus[C2C_MAX_CPUS];
+static unsigned int c2c_nr;
+
+/* Median one-way latency in cycles, [pattern][from][to] */
+static uint64_t c2c_lat[C2C_PATTERNS][C2C_MAX_CPUS][C2C_MAX_CPUS];
+
+static atomic_t c2c_barrier_count __aligned(CACHE_LINE_SIZE);
+static bool c2c_barrier_sense;
+
+/* Sense reversing barrier over all workers */
+static void c2c_barrier(bool *sense) {
+    *sense = !*sense;
+
+    /* atomic_inc_return() returns the value before the increment */
+    if (atomic_inc_return(&c2c_barrier_count) == (int) c2c_nr - 1) {
+        atomic_set(&c2c_barrier_count, 0);
+        smp_wmb();
+        ACCESS_ONCE(c2c_barrier_sense) = *sense;
+    }
+    else {
+        while (ACCESS_ONCE(c2c_barrier_sense) != *sense)
+            cpu_relax();
+    }
+}
+
+static inline void c2c_wait(atomic64_t *v, int64_t val) {
+    while (atomic_read(v) != val)
+        cpu_relax();
+}
+
+static inline void c2c_cas(atomic64_t *v, int64_t old, int64_t new) {
+    while (atomic64_cmpxchg(v, old, new) != old)
+        cpu_relax();
+}
+
+static int c2c_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Round trips timed by the initiator: seq goes 2k -> 2k + 1 -> 2k + 2 each round */
+static uint64_t c2c_initiator(c2c_pattern_t pattern, unsigned int sample) {
+    int64_t v = 2 * (int64_t) sample * C2C_ROUNDS;
+    uint64_t start = rdtsc_ordered();
+
+    for (unsigned int k = 0; k < C2C_ROUNDS; k++, v += 2) {
+        if (pattern == C2C_CAS) {
+            c2c_cas(&c2c_line.seq, v, v + 1);
+            c2c_cas(&c2c_line.seq, v + 2, v + 2);
+        }
+        else {
+            atomic_set(&c2c_line.seq, v + 1);
+            c2c_wait(&c2c_line.seq, v + 2);
+        }
+    }
+
+    return (rdtsc_ordered() - start) / (2 * C2C_ROUNDS);
+}
+
+static void c2c_responder(c2c_pattern_t pattern, unsigned int sample) {
+    int64_t v = 2 * (int64_t) sample * C2C_ROUNDS;
+
+    for (unsigned int k = 0; k < C2C_ROUNDS; k++, v += 2) {
+        if (pattern == C2C_CAS) {
+            c2c_cas(&c2c_line.seq, v + 1, v + 2);
+        }
+        else {
+            c2c_wait(&c2c_line.seq, v + 1);
+            atomic_set(&c2c_line.seq, v + 2);
+        }
+    }
+}
+
+/* The initiator stamps the line just before its store, the responder times when the
+ * new value shows up and acknowledges through another line.
+ */
+static void c2c_store_initiator(unsigned int sample) {
+    int64_t v = (int64_t) sample * C2C_ROUNDS;
+
+    for (unsigned int k = 0; k < C2C_ROUNDS; k++, v++) {
+        c2c_wait(&c2c_ack, v);
+        c2c_line.tsc = rdtsc_sync();
+        atomic_set(&c2c_line.seq, v + 1);
+    }
+}
+
+static uint64_t c2c_store_responder(unsigned int sample) {
+    int64_t v = (int64_t) sample * C2C_ROUNDS;
+    uint64_t total = 0;
+
+    for (unsigned int k = 0; k < C2C_ROUNDS; k++, v++) {
+        c2c_wait(&c2c_line.seq, v + 1);
+        total += rdtsc_sync() - ACCESS_ONCE(c2c_line.tsc);
+        atomic_set(&c2c_ack, v + 1);
+    }
+
+    return total / C2C_ROUNDS;
+}
+
+static void c2c_run_pair(c2c_pattern_t pattern, unsigned int self, unsigned int from,
+                         unsigned int to) {
+    uint64_t samples[C2C_SAMPLES];
+    bool measure = false;
+
+    for (unsigned int s = 0; s < C2C_SAMPLES; s++) {
+        if (pattern == C2C_STORE_LOAD) {
+            if (self == from)
+                c2c_store_initiator(s);
+            else {
+                samples[s] = c2c_store_responder(s);
+                measure = true;
+            }
+        }
+        else if (self == from) {
+            samples[s] = c2c_initiator(pattern, s);
+            measure = true;
+        }
+        else
+            c2c_responder(pattern, s);
+    }
+
+    if (measure) {
+        sort(samples, C2C_SAMPLES, sizeof(*samples), c2c_cmp);
+        c2c_lat[pattern][from][to] = samples[C2C_SAMPLES / 2];
+    }
+}
+
+/* Every worker walks all (from, to) pairs in the same order, the two CPUs of the
+ * current pair ping-pong while the others wait at the next barrier.
+ */
+static unsigned long c2c_worker(void *arg) {
+    unsigned int self = _ul(arg);
+    bool sense = false;
+    unsigned long flags;
+
+    flags = interrupts_disable_save();
+    for (c2c_pattern_t pattern = 0; pattern < C2C_PATTERNS; pattern++) {
+        for (unsigned int from = 0; from < c2c_nr; from++) {
+            for (unsigned int to = 0; to < c2c_nr; to++) {
+                if (from == to)
+                    continue;
+
+                c2c_barrier(&sense);
+                if (self == from) {
+                    atomic_set(&c2c_line.seq, 0);
+                    atomic_set(&c2c_ack, 0);
+                }
+                c2c_barrier(&sense);
+
+                if (self == from || self == to)
+                    c2c_run_pair(pattern, self, from, to);
+            }
+        }
+    }
+    interrupts_restore(flags);
+
+    return 0;
+}
+
+static void c2c_print_matrix(c2c_pattern_t pattern) {
+    char buf[512];
+    int len;
+
+    for (unsigned int from = 0; from < c2c_nr; from++) {
+        len = snprintf(buf, sizeof(buf), "C2C pattern=%s cpu=%u lat=",
+                       c2c_pattern_names[pattern], c2c_cpus[from]->id);
+
+        for (unsigned int to = 0; to < c2c_nr && len < (int) sizeof(buf); to++) {
+            const char *sep = to ? "," : "";
+
+            if (from == to)
+                len += snprintf(buf + len, sizeof(buf) - len, "%s-", sep);
+            else {
+                len += snprintf(buf + len, sizeof(buf) - len, "%s%lu", sep,
+                                c2c_lat[pattern][from][to]);
+            }
+        }
+        printk("%s\n", buf);
+    }
+}
+
+/* N x N one-way cache line transfer latency in cycles, rows are the writing CPU */
+int test_c2c_latency(void *unused) {
+    char buf[256];
+    int len;
+
+    if (!cpu_has_tsc())
+        return -ENODEV;
+
+    c2c_nr = 0;
+    for (unsigned int id = 0; id < get_nr_cpus() && c2c_nr < C2C_MAX_CPUS; id++) {
+        cpu_t *cpu = get_cpu(id);
+
+        if (cpu && is_cpu_enabled(cpu))
+            c2c_cpus[c2c_nr++] = cpu;
+    }
+
+    if (c2c_nr < 2) {
+        printk("Core-to-core latency needs at least 2 CPUs\n");
+        return 0;
+    }
+
+    memset(c2c_lat, 0, sizeof(c2c_lat));
+    atomic_set(&c2c_barrier_count, 0);
+    c2c_barrier_sense = false;
+
+    for (unsigned int i = 0; i < c2c_nr; i++) {
+        task_t *task = new_kernel_task("c2c_latency", c2c_worker, _ptr(i));
+
+        if (!task)
+            return -ENOMEM;
+        schedule_task(task, c2c_cpus[i]);
+    }
+    execute_tasks();
+
+    len = snprintf(buf, sizeof(buf), "C2C unit=cycles rounds=%u samples=%u cpus=",
+                   C2C_ROUNDS, C2C_SAMPLES);
+    for (unsigned int i = 0; i < c2c_nr && len < (int) sizeof(buf); i++) {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%u", i ? "," : "",
+                        c2c_cpus[i]->id);
+    }
+    printk("%s\n", buf);
+
+    for (c2c_pattern_t pattern = 0; pattern < C2C_PATTERNS; pattern++)
+        c2c_print_matrix(pattern);
+
+    return 0;
+}
+REGISTER_TEST(test_c2c_latency, test_c2c_latency, .exclusive = true,
+              .tags = "bench,cache,smp");
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <console.h>
+#include <cpu.h>
+#include <ktf.h>
+#include <lib.h>
+#include <test.h>
+#include <mm/pmm.h>
+#include <smp/smp.h>
+#include <toolkit/cache/lib.h>
+
+#define EVSET_WAYS   16
+#define EVSET_ROUNDS 1000
+
+static cache_channel_t victim;
+
+static void touch_victim(void *arg) {
+    cache_read_access(arg);
+}
+
+/* Prime+Probe and Evict+Time on one line, with and without a victim access */
+int test_cache_evset(void *unused) {
+    const void *target = &victim.lines[CACHE_LINE1];
+    uint64_t probe[2] = {0}, evict_time = 0;
+    const cpu_cache_info_t *llc = get_cpu_llc_info(get_cpu(smp_processor_id()));
+    unsigned int ways = EVSET_WAYS;
+    const cache_evset_t *evset;
+    unsigned long flags;
+
+    /* Evict from the LLC: use its associativity when CPUID describes it */
+    if (llc)
+        ways = min(llc->ways, (unsigned int) CACHE_EVSET_MAX_WAYS);
+
+    evset = cache_evset_get(target, ways);
+    if (!evset) {
+        printk("No eviction set found for %p\n", target);
+        cache_evset_release_all();
+        return -1;
+    }
+    printk("Eviction set for %p: %u lines, threshold %u cycles\n", target, evset->ways,
+           evset->threshold);
+
+    flags = interrupts_disable_save();
+    for (unsigned int i = 0; i < EVSET_ROUNDS; i++) {
+        for (unsigned int touch = 0; touch < ARRAY_SIZE(probe); touch++) {
+            cache_evset_prime(evset);
+            if (touch)
+                cache_read_access_barrier(target);
+            probe[touch] += cache_evset_probe(evset);
+        }
+        evict_time += cache_evict_time(evset, touch_victim, (void *) target);
+    }
+    interrupts_restore(flags);
+
+    printk("%s,probe_idle=%lu,probe_victim=%lu,evict_time=%lu\n", __func__,
+           probe[0] / EVSET_ROUNDS, probe[1] / EVSET_ROUNDS, evict_time / EVSET_ROUNDS);
+
+    /* The candidate pool takes up to twice the LLC size */
+    cache_evset_release_all();
+    return 0;
+}
+REGISTER_TEST(test_cache_evset, test_cache_evset, .exclusive = true, .tags = "cache");
@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <console.h>
+#include <cpu.h>
+#include <cpuid.h>
+#include <errno.h>
+#include <extables.h>
+#include <ktf.h>
+#include <lib.h>
+#include <percpu.h>
+#include <processor.h>
+#include <sched.h>
+#include <segment.h>
+#include <string.h>
+#include <test.h>
+#include <usermode.h>
+
+#include <mm/vmm.h>
+
+#include <smp/smp.h>
+
+#include <toolkit/bench/lib.h>
+
+#define EXC_WARMUP 64
+#define EXC_REPS   1000
+
+/* User address of the page shared with the user task */
+#define EXC_USER_VA _ptr(0x40000000)
+
+/* Unmapped in the user address space */
+#define EXC_USER_PF_ADDR _ul(0x1000)
+
+#define EXC_NONCANONICAL_ADDR _U64(0x8000000000000000)
+
+extern void exception_bench_noerr(void);
+extern void exception_bench_err(void);
+extern void exception_bench_noerr_entry(void);
+extern void exception_bench_err_entry(void);
+
+enum exc_path {
+    EXC_PATH_STUB,  /* Hardware delivery and IRET only */
+    EXC_PATH_ENTRY, /* Plus the entry code: register save/restore, user mode switch */
+    EXC_PATH_FULL,  /* Regular handler: do_exception() and an exception table fixup */
+    EXC_PATHS,
+};
+typedef enum exc_path exc_path_t;
+
+static const char *const exc_path_names[EXC_PATHS] = {
+    [EXC_PATH_STUB] = "stub",
+    [EXC_PATH_ENTRY] = "entry",
+    [EXC_PATH_FULL] = "full",
+};
+
+struct exc_type {
+    const char *name;
+    unsigned int vector;
+    bool has_error_code;
+};
+typedef struct exc_type exc_type_t;
+
+static const exc_type_t exc_types[] = {
+    {"de", X86_EX_DE, false},
+    {"ud", X86_EX_UD, false},
+    {"gp", X86_EX_GP, true},
+    {"pf", X86_EX_PF, true},
+};
+
+/* Kernel page mapped into the user address space: the kernel code is too far away
+ * from the user sections to address them directly.
+ */
+struct exc_shared {
+    unsigned int vector;
+    unsigned long addr;
+    unsigned int nr_samples; /* Set by the user task once done */
+    uint64_t samples[EXC_REPS];
+};
+typedef struct exc_shared exc_shared_t;
+
+/* Every faulting sequence leaves its resume address in AX for the stubs and has an
+ * exception table entry for the regular handlers. Plain if/else, as a jump table in
+ * .rodata would not be reachable from user mode.
+ */
+static __always_inline void exc_raise(unsigned int vector, unsigned long addr) {
+    if (vector == X86_EX_DE) {
+        asm volatile("lea 1f(%%rip), %%rax; xor %%edx, %%edx\n"
+                     "2: div %%ecx; 1:" ASM_EXTABLE(2b, 1b)::"c"(0)
+                     : "rax", "rdx", "memory");
+    }
+    else if (vector == X86_EX_UD) {
+        asm volatile("lea 1f(%%rip), %%rax\n"
+                     "2: ud2; 1:" ASM_EXTABLE(2b, 1b)::
+                         : "rax", "memory");
+    }
+    else {
+        asm volatile("lea 1f(%%rip), %%rax\n"
+                     "2: mov (%%rcx), %%rdx; 1:" ASM_EXTABLE(2b, 1b)::"c"(addr)
+                     : "rax", "rdx", "memory");
+    }
+}
+
+/* Same timestamp pair as bench_tsc_{start,end}(), but usable from user mode */
+static __always_inline uint64_t exc_tsc_start(void) {
+    uint32_t low, high;
+
+    asm volatile("lfence; rdtsc" : "=a"(low), "=d"(high)::"memory");
+    return ((uint64_t) high << 32) | low;
+}
+
+static __always_inline uint64_t exc_tsc_end(void) {
+    uint32_t low, high;
+
+    asm volatile("rdtscp; lfence" : "=a"(low), "=d"(high)::"ecx", "memory");
+    return ((uint64_t) high << 32) | low;
+}
+
+static unsigned long __user_text exc_user_task(void *arg) {
+    exc_shared_t *shared = arg;
+
+    for (unsigned int i = 0; i < EXC_WARMUP + EXC_REPS; i++) {
+        uint64_t start = exc_tsc_start();
+
+        exc_raise(shared->vector, shared->addr);
+        if (i >= EXC_WARMUP)
+            shared->samples[i - EXC_WARMUP] = exc_tsc_end() - start;
+    }
+    shared->nr_samples = EXC_REPS;
+
+    return 0;
+}
+
+/* Point the exception's gate of this CPU at a measurement stub */
+static void exc_set_stub(const exc_type_t *type, exc_path_t path) {
+    percpu_t *percpu = get_percpu_page(smp_processor_id());
+    void (*stub)(void);
+
+    if (type->has_error_code)
+        stub = path == EXC_PATH_STUB ? exception_bench_err : exception_bench_err_entry;
+    else {
+        stub = path == EXC_PATH_STUB ? exception_bench_noerr
+                                     : exception_bench_noerr_entry;
+    }
+
+    set_intr_gate(&percpu->idt[type->vector], __KERN_CS, _ul(stub), GATE_DPL0,
+                  GATE_PRESENT, 0);
+}
+
+static int exc_bench_kernel(const exc_type_t *type, exc_path_t path, unsigned long addr) {
+    unsigned int vector = type->vector;
+    char name[32];
+
+    snprintf(name, sizeof(name), "exc_%s_kernel_%s", type->name, exc_path_names[path]);
+    return BENCH(name, NULL, NULL, exc_raise(vector, addr));
+}
+
+static int exc_bench_user(exc_shared_t *shared, const exc_type_t *type,
+                          exc_path_t path) {
+    bench_opts_t opts = {
+        .reps = EXC_REPS,
+        .irq_on = true,
+    };
+    char name[32];
+    task_t *task;
+    bench_t b;
+    int rc;
+
+    shared->vector = type->vector;
+    shared->addr = type->vector == X86_EX_PF ? EXC_USER_PF_ADDR : EXC_NONCANONICAL_ADDR;
+    shared->nr_samples = 0;
+
+    task = new_user_task("exception_latency", exc_user_task, EXC_USER_VA);
+    if (!task)
+        return -ENOMEM;
+    schedule_task(task, get_cpu(smp_processor_id()));
+    execute_tasks();
+
+    if (shared->nr_samples != EXC_REPS) {
+        printk("EXC %s: user task failed\n", type->name);
+        return -EFAULT;
+    }
+
+    /* The samples come from the user task, the warm-up is already done */
+    snprintf(name, sizeof(name), "exc_%s_user_%s", type->name, exc_path_names[path]);
+    rc = bench_begin(&b, name, &opts);
+    if (rc < 0)
+        return rc;
+
+    for (unsigned int i = 0; bench_next(&b); i++)
+        bench_record(&b, shared->samples[i]);
+    bench_end(&b, NULL);
+
+    return 0;
+}
+
+/* Cost in cycles from the faulting instruction back to the resume address for #DE,
+ * #UD, #GP and #PF. The stub path is the hardware delivery and IRET alone, the entry
+ * path adds what the entry code does around do_exception() (SAVE_ALL_REGS and
+ * RESTORE_ALL_REGS, plus the page table and GS switches when coming from user
+ * mode), and the full path goes through do_exception() and the exception table.
+ * User mode faults always terminate the task with the regular handlers, so only the
+ * stub and entry paths are measured from user mode.
+ */
+int test_exception_latency(void *unused) {
+    percpu_t *percpu = get_percpu_page(smp_processor_id());
+    exc_shared_t *shared;
+    void *unmapped;
+    mfn_t mfn;
+    int rc = 0;
+
+    if (!cpu_has_tsc())
+        return -ENODEV;
+
+    BUILD_BUG_ON(sizeof(*shared) > PAGE_SIZE_2M);
+    shared = get_free_pages(PAGE_ORDER_2M, GFP_KERNEL_MAP);
+    if (!shared)
+        return -ENOMEM;
+    vmap_user_2m(EXC_USER_VA, virt_to_mfn(shared), L2_PROT_USER);
+
+    /* Kernel #PF target, unmapped for the duration of the test */
+    unmapped = get_free_page(GFP_KERNEL_MAP);
+    if (!unmapped) {
+        rc = -ENOMEM;
+        goto out;
+    }
+    mfn = virt_to_mfn(unmapped);
+    vunmap_kern(unmapped, PAGE_ORDER_4K);
+
+    for (unsigned int i = 0; rc == 0 && i < ARRAY_SIZE(exc_types); i++) {
+        const exc_type_t *type = &exc_types[i];
+        idt_entry_t gate = percpu->idt[type->vector];
+        unsigned long addr;
+
+        addr = type->vector == X86_EX_PF ? _ul(unmapped) : EXC_NONCANONICAL_ADDR;
+
+        for (exc_path_t path = EXC_PATH_STUB; rc == 0 && path < EXC_PATHS; path++) {
+            if (path != EXC_PATH_FULL)
+                exc_set_stub(type, path);
+
+            rc = exc_bench_kernel(type, path, addr);
+            if (rc == 0 && path != EXC_PATH_FULL)
+                rc = exc_bench_user(shared, type, path);
+
+            percpu->idt[type->vector] = gate;
+        }
+    }
+
+    vmap_4k(unmapped, mfn, L1_PROT);
+    put_pages(unmapped, PAGE_ORDER_4K);
+out:
+    vunmap_user(EXC_USER_VA, PAGE_ORDER_2M);
+    put_pages(shared, PAGE_ORDER_2M);
+
+    return rc;
+}
+REGISTER_TEST(test_exception_latency, test_exception_latency, .exclusive = true,
+              .tags = "bench,latency");
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <console.h>
+#include <errno.h>
+#include <extables.h>
+#include <ktf.h>
+#include <lib.h>
+#include <test.h>
+
+#include <mm/regions.h>
+
+#include <toolkit/bench/lib.h>
+
+/* Keeps the lookups from being optimized away */
+static const extable_entry_t *volatile extables_sink;
+
+/* Reference for the sorted lookup: the plain scan extables_fixup() used to do */
+static const extable_entry_t *linear_search_extables(unsigned long addr) {
+    for (extable_entry_t *cur = __start_extables; cur < __stop_extables; ++cur) {
+        if (addr >= cur->fault_addr && addr < cur->fault_end)
+            return cur;
+    }
+
+    return NULL;
+}
+
+/* Cost of an exception resolved through the exception table, and of the table
+ * lookup on its own, for the last entry of the table (worst case of a linear scan)
+ * and an address not covered at all.
+ */
+int test_extables_fixup(void *unused) {
+    size_t nr = __stop_extables - __start_extables;
+    unsigned long last, miss = _ul(test_extables_fixup);
+    int rc;
+
+    if (nr == 0)
+        return -ENOENT;
+
+    for (extable_entry_t *cur = __start_extables; cur < __stop_extables; ++cur) {
+        if (search_extables(cur->fault_addr) != cur ||
+            search_extables(cur->fault_end - 1) != cur) {
+            printk("EXTABLES lookup failed for addr 0x%lx\n", cur->fault_addr);
+            return -EINVAL;
+        }
+    }
+    if (search_extables(miss))
+        return -EINVAL;
+
+    last = __stop_extables[-1].fault_addr;
+    printk("EXTABLES entries=%lu\n", nr);
+
+    rc = BENCH("extables_search_last", NULL, NULL, extables_sink = search_extables(last));
+    if (rc < 0)
+        return rc;
+
+    rc = BENCH("extables_linear_last", NULL, NULL,
+               extables_sink = linear_search_extables(last));
+    if (rc < 0)
+        return rc;
+
+    rc = BENCH("extables_search_miss", NULL, NULL, extables_sink = search_extables(miss));
+    if (rc < 0)
+        return rc;
+
+    rc = BENCH("extables_linear_miss", NULL, NULL,
+               extables_sink = linear_search_extables(miss));
+    if (rc < 0)
+        return rc;
+
+    /* #UD round trip fixed up by a single address entry */
+    rc = BENCH("fixup_ud2", NULL, NULL,
+               asm volatile("1: ud2; 2:" ASM_EXTABLE(1b, 2b)::: "memory"));
+    if (rc < 0)
+        return rc;
+
+    /* Same with the faulting instruction in the middle of a range entry */
+    return BENCH("fixup_ud2_range", NULL, NULL,
+                 asm volatile("1: nop; ud2; nop; 2:" ASM_EXTABLE_RANGE(1b, 2b, 2b)
+                              ::: "memory"));
+}
+REGISTER_TEST(test_extables_fixup, test_extables_fixup, .tags = "bench,extables");
@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <apic.h>
+#include <atomic.h>
+#include <console.h>
+#include <cpu.h>
+#include <cpuid.h>
+#include <errno.h>
+#include <hrtimer.h>
+#include <ktf.h>
+#include <lib.h>
+#include <percpu.h>
+#include <sched.h>
+#include <string.h>
+#include <test.h>
+#include <time.h>
+#include <traps.h>
+#include <tsc.h>
+
+#include <smp/smp.h>
+
+#include <toolkit/bench/lib.h>
+#include <toolkit/cache/lib.h>
+
+#define IRQ_LAT_REPS         1000
+#define IRQ_LAT_WAKE_REPS    256
+#define IRQ_LAT_WAKE_GAP_US  20 /* Time for the target to settle back into hlt */
+#define IRQ_LAT_TIMER_REPS   256
+#define IRQ_LAT_TIMER_DELAY  (100 * NSEC_PER_USEC)
+#define IRQ_LAT_TIMEOUT      (10 * NSEC_PER_MSEC)
+
+/* Handler side of the benchmark IPI: arrival time in the BSP's TSC time base */
+static uint64_t irq_lat_tsc __aligned(CACHE_LINE_SIZE);
+static atomic_t irq_lat_count __aligned(CACHE_LINE_SIZE);
+
+static bool irq_lat_done __aligned(CACHE_LINE_SIZE);
+static bool irq_lat_halt;
+static cpu_t *irq_lat_target;
+static int irq_lat_rc;
+
+static void irq_lat_noop(void) {}
+
+static void irq_lat_eoi(void) {
+    apic_EOI();
+}
+
+static void irq_lat_stamp(void) {
+    ACCESS_ONCE(irq_lat_tsc) = rdtsc_sync();
+    atomic_inc(&irq_lat_count);
+    apic_EOI();
+}
+
+static bool irq_lat_wait(int count) {
+    ktime_t timeout = ktime_ns() + IRQ_LAT_TIMEOUT;
+
+    while (atomic_read(&irq_lat_count) == count) {
+        if (ktime_ns() > timeout)
+            return false;
+        cpu_relax();
+    }
+
+    return true;
+}
+
+static const char *irq_lat_mode_name(void) {
+    return apic_get_mode() == APIC_MODE_X2APIC ? "x2apic" : "xapic";
+}
+
+/* Cost of the register accesses, with interrupts disabled so the self-IPIs sent by
+ * the ICR benchmark stay pending in the IRR until it is done.
+ */
+static int irq_lat_apic_regs(void) {
+    apic_icr_t icr;
+    int rc;
+
+    memset(&icr, 0, sizeof(icr));
+    icr.deliv_mode = APIC_DELIV_MODE_FIXED;
+    icr.dest_shorthand = APIC_DEST_SHORTHAND_SELF;
+    icr.vector = APIC_BENCH_IPI_IRQ_VECTOR;
+
+    apic_set_bench_handler(irq_lat_eoi);
+
+    /* No interrupt in service, so the EOI write does not retire anything */
+    rc = BENCH("apic_eoi", NULL, NULL, apic_EOI());
+    if (rc < 0)
+        return rc;
+
+    rc = BENCH("apic_icr_write", NULL, NULL, apic_wait_ready(); apic_icr_write(&icr));
+    if (rc < 0)
+        return rc;
+
+    return BENCH("apic_send_self_ipi", NULL, NULL,
+                 apic_send_self_ipi(APIC_BENCH_IPI_IRQ_VECTOR));
+}
+
+/* Software interrupts through the full asm_interrupt_handler_* path (register save
+ * and restore around an empty C handler) compared with a bare IRET stub.
+ */
+static int irq_lat_entry_exit(void) {
+    int rc;
+
+    rc = BENCH("irq_iret", NULL, NULL,
+               asm volatile("int %0" ::"i"(APIC_SPI_VECTOR) : "memory"));
+    if (rc < 0)
+        return rc;
+
+    apic_set_bench_handler(irq_lat_noop);
+    return BENCH("irq_entry_exit", NULL, NULL,
+                 asm volatile("int %0" ::"i"(APIC_BENCH_IPI_IRQ_VECTOR) : "memory"));
+}
+
+static int irq_lat_self_ipi(void) {
+    bench_opts_t opts = {
+        .reps = IRQ_LAT_REPS,
+        .irq_on = true,
+    };
+    bench_t b;
+    int rc;
+
+    apic_set_bench_handler(irq_lat_stamp);
+
+    /* ICR write until the handler runs */
+    rc = bench_begin(&b, "self_ipi_delivery", &opts);
+    if (rc < 0)
+        return rc;
+
+    while (bench_next(&b)) {
+        int count = atomic_read(&irq_lat_count);
+        uint64_t start = rdtsc_sync();
+
+        apic_send_self_ipi(APIC_BENCH_IPI_IRQ_VECTOR);
+        if (!irq_lat_wait(count)) {
+            rc = -ETIME;
+            b.opts.quiet = true;
+            break;
+        }
+        bench_record(&b, ACCESS_ONCE(irq_lat_tsc) - start);
+    }
+    bench_end(&b, NULL);
+    if (rc < 0)
+        return rc;
+
+    /* ICR write until the sender runs again after the IRET */
+    return BENCH("self_ipi_roundtrip", &opts, NULL, {
+        int count = atomic_read(&irq_lat_count);
+
+        apic_send_self_ipi(APIC_BENCH_IPI_IRQ_VECTOR);
+        while (atomic_read(&irq_lat_count) == count)
+            cpu_relax();
+    });
+}
+
+/* Either halted, so the IPI has to wake the CPU up, or spinning with interrupts on */
+static unsigned long irq_lat_wake_target(void *unused) {
+    unsigned long flags = interrupts_disable_save();
+
+    while (!ACCESS_ONCE(irq_lat_done)) {
+        if (irq_lat_halt)
+            asm volatile("sti; hlt; cli" ::: "memory");
+        else {
+            sti();
+            cpu_relax();
+            cli();
+        }
+    }
+    interrupts_restore(flags);
+
+    return 0;
+}
+
+static unsigned long irq_lat_wake_initiator(void *unused) {
+    uint32_t apic_id = irq_lat_target->percpu->apic_id;
+    bench_opts_t opts = {
+        .reps = IRQ_LAT_WAKE_REPS,
+        .irq_on = true,
+    };
+    char name[32];
+    bench_t b;
+    int rc;
+
+    snprintf(name, sizeof(name), "ipi_%s_cpu%u", irq_lat_halt ? "wake" : "poll",
+             irq_lat_target->id);
+
+    rc = bench_begin(&b, name, &opts);
+    if (rc < 0)
+        goto out;
+
+    while (bench_next(&b)) {
+        int count = atomic_read(&irq_lat_count);
+        uint64_t start;
+
+        udelay(IRQ_LAT_WAKE_GAP_US);
+        start = rdtsc_sync();
+        apic_send_ipi(apic_id, APIC_BENCH_IPI_IRQ_VECTOR);
+        if (!irq_lat_wait(count)) {
+            rc = -ETIME;
+            b.opts.quiet = true;
+            break;
+        }
+        bench_record(&b, ACCESS_ONCE(irq_lat_tsc) - start);
+    }
+    bench_end(&b, NULL);
+
+out:
+    ACCESS_ONCE(irq_lat_rc) = rc;
+    ACCESS_ONCE(irq_lat_done) = true;
+    /* Nothing else may wake a halted target up to see it is done */
+    smp_wmb();
+    apic_send_ipi(apic_id, APIC_BENCH_IPI_IRQ_VECTOR);
+    return rc;
+}
+
+/* IPI from the calling CPU to each other CPU, timed with the synchronized TSC */
+static int irq_lat_cross_ipi(void) {
+    cpu_t *self = get_cpu(smp_processor_id());
+
+    apic_set_bench_handler(irq_lat_stamp);
+
+    for (unsigned int id = 0; id < get_nr_cpus(); id++) {
+        cpu_t *cpu = get_cpu(id);
+
+        if (!cpu || cpu == self || !is_cpu_enabled(cpu))
+            continue;
+
+        for (unsigned int halt = 0; halt < 2; halt++) {
+            task_t *initiator, *target;
+
+            irq_lat_target = cpu;
+            irq_lat_halt = halt;
+            irq_lat_rc = 0;
+            ACCESS_ONCE(irq_lat_done) = false;
+
+            initiator = new_kernel_task("irq_lat_initiator", irq_lat_wake_initiator,
+                                        NULL);
+            target = new_kernel_task("irq_lat_target", irq_lat_wake_target, NULL);
+            if (!initiator || !target)
+                return -ENOMEM;
+
+            schedule_task(target, cpu);
+            schedule_task(initiator, self);
+            execute_tasks();
+            if (irq_lat_rc < 0)
+                return irq_lat_rc;
+        }
+    }
+
+    return 0;
+}
+
+static void irq_lat_timer_fn(void *arg) {
+    atomic_inc(arg);
+}
+
+/* Lateness of the local APIC timer interrupt relative to the programmed deadline */
+static int irq_lat_timer(void) {
+    unsigned int cpu = smp_processor_id();
+    bench_opts_t opts = {
+        .reps = IRQ_LAT_TIMER_REPS,
+        .irq_on = true,
+        .keep_outliers = true,
+    };
+    atomic_t fired = {0};
+    hrtimer_t timer;
+    bench_t b;
+    int rc;
+
+    if (!PERCPU_GET(apic_timer_enabled)) {
+        printk("IRQLAT APIC timer disabled, skipping timer jitter\n");
+        return 0;
+    }
+
+    hrtimer_init(&timer, irq_lat_timer_fn, &fired);
+
+    rc = bench_begin(&b, PERCPU_GET(apic_timer_tickless) ? "apic_timer_late_tickless"
+                                                         : "apic_timer_late_periodic",
+                     &opts);
+    if (rc < 0)
+        return rc;
+
+    while (bench_next(&b)) {
+        int count = atomic_read(&fired);
+        ktime_t timeout;
+        int64_t late;
+
+        rc = hrtimer_start(&timer, cpu, IRQ_LAT_TIMER_DELAY, HRTIMER_MODE_REL);
+        if (rc < 0)
+            break;
+
+        timeout = timer.expires + IRQ_LAT_TIMEOUT;
+        while (atomic_read(&fired) == count && ktime_ns() < timeout)
+            cpu_relax();
+        if (atomic_read(&fired) == count) {
+            hrtimer_cancel(&timer);
+            rc = -ETIME;
+            break;
+        }
+
+        late = (int64_t) (ACCESS_ONCE(timer.fired) - timer.expires);
+        bench_record(&b, ns_to_tsc(late > 0 ? late : 0));
+    }
+    if (rc < 0)
+        b.opts.quiet = true;
+    bench_end(&b, NULL);
+
+    return rc;
+}
+
+/* Interrupt and IPI latencies in cycles, in whichever APIC mode the kernel was
+ * booted with ("x2apic" cmdline option), to compare xAPIC MMIO and x2APIC MSR costs.
+ */
+int test_irq_latency(void *unused) {
+    int rc;
+
+    if (!cpu_has_tsc() || apic_get_mode() < APIC_MODE_XAPIC)
+        return -ENODEV;
+
+    printk("IRQLAT apic_mode=%s tsc_deadline=%u\n", irq_lat_mode_name(),
+           PERCPU_GET(apic_timer_mode) == APIC_LVT_TIMER_TSC_DEADLINE);
+
+    atomic_set(&irq_lat_count, 0);
+
+    rc = irq_lat_apic_regs();
+    if (rc == 0)
+        rc = irq_lat_entry_exit();
+    if (rc == 0)
+        rc = irq_lat_self_ipi();
+    if (rc == 0)
+        rc = irq_lat_cross_ipi();
+    if (rc == 0)
+        rc = irq_lat_timer();
+
+    apic_set_bench_handler(NULL);
+    return rc;
+}
+REGISTER_TEST(test_irq_latency, test_irq_latency, .exclusive = true,
+              .tags = "bench,latency,irq");
@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <atomic.h>
+#include <cacheinfo.h>
+#include <cmdline.h>
+#include <console.h>
+#include <cpu.h>
+#include <cpuid.h>
+#include <errno.h>
+#include <ktf.h>
+#include <lib.h>
+#include <sched.h>
+#include <string.h>
+#include <test.h>
+#include <tsc.h>
+
+#include <mm/vmm.h>
+
+#include <smp/smp.h>
+
+#include <toolkit/bench/lib.h>
+
+#define MEM_LINE_SIZE      64
+#define MEM_MIN_WSS        KB(4)
+#define MEM_CHASE_STEPS    1024 /* Dependent loads per timed sample */
+#define MEM_CHASE_REPS     32
+#define MEM_STREAM_RUNS    10 /* STREAM reports the best of several runs */
+#define MEM_STREAM_SCALAR  3
+#define MEM_STREAM_MIN_WSS MB(32)
+
+/* Page order of the benchmark buffers: 0 (4K) or 9 (2M) */
+static unsigned long opt_mem_bench_order = PAGE_ORDER_2M;
+ulong_cmd("mem_bench_order", opt_mem_bench_order);
+
+/* Largest pointer chasing working set, in MB */
+static unsigned long opt_mem_bench_max_mb = 64;
+ulong_cmd("mem_bench_max_mb", opt_mem_bench_max_mb);
+
+/* Repeat the measurements on all CPUs at once after the single-core run */
+static bool opt_mem_bench_all = true;
+bool_cmd("mem_bench_all", opt_mem_bench_all);
+
+/* A buffer made of separately allocated pages of one order */
+struct mem_buf {
+    void **pages;
+    unsigned int nr;
+    unsigned int order;
+    size_t page_size;
+};
+typedef struct mem_buf mem_buf_t;
+
+static atomic_t mem_all_ready;
+static unsigned int mem_all_cpus;
+
+static void mem_buf_free(mem_buf_t *buf) {
+    if (!buf->pages)
+        return;
+
+    for (unsigned int i = 0; i < buf->nr; i++) {
+        if (buf->pages[i])
+            put_pages(buf->pages[i], buf->order);
+    }
+    put_pages(buf->pages, PAGE_ORDER_2M);
+    memset(buf, 0, sizeof(*buf));
+}
+
+static int mem_buf_alloc(mem_buf_t *buf, size_t size, unsigned int order) {
+    memset(buf, 0, sizeof(*buf));
+    buf->order = order;
+    buf->page_size = PAGE_SIZE << order;
+    buf->nr = div_round_up(size, buf->page_size);
+    if (buf->nr > PAGE_SIZE_2M / sizeof(*buf->pages))
+        return -EINVAL;
+
+    buf->pages = get_free_pages(PAGE_ORDER_2M, GFP_KERNEL_MAP);
+    if (!buf->pages)
+        return -ENOMEM;
+    memset(buf->pages, 0, buf->nr * sizeof(*buf->pages));
+
+    for (unsigned int i = 0; i < buf->nr; i++) {
+        buf->pages[i] = get_free_pages(order, GFP_KERNEL_MAP);
+        if (!buf->pages[i]) {
+            mem_buf_free(buf);
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+static inline void *mem_buf_line(const mem_buf_t *buf, unsigned long line) {
+    unsigned long lines_per_page = buf->page_size / MEM_LINE_SIZE;
+
+    return buf->pages[line / lines_per_page] + (line % lines_per_page) * MEM_LINE_SIZE;
+}
+
+/* Per task generator, rand() is shared between CPUs */
+static inline uint64_t mem_rand(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/* Link the first nr lines into one random cycle (Sattolo's algorithm), so neither
+ * the prefetchers nor the TLB reach can follow the chase.
+ */
+static void *mem_build_chain(const mem_buf_t *buf, unsigned long nr, uint64_t seed) {
+    for (unsigned long i = 0; i < nr; i++)
+        *(void **) mem_buf_line(buf, i) = mem_buf_line(buf, i);
+
+    for (unsigned long i = nr - 1; i > 0; i--) {
+        void **a = mem_buf_line(buf, i);
+        void **b = mem_buf_line(buf, mem_rand(&seed) % i);
+        void *tmp = *a;
+
+        *a = *b;
+        *b = tmp;
+    }
+
+    return mem_buf_line(buf, 0);
+}
+
+static inline void *mem_chase(void *p, unsigned long steps) {
+    while (steps--)
+        asm volatile("mov (%0), %0" : "+r"(p)::"memory");
+
+    return p;
+}
+
+static void mem_latency(const char *mode, size_t max_wss) {
+    bench_opts_t opts = {.reps = MEM_CHASE_REPS, .inner = MEM_CHASE_STEPS, .quiet = true};
+    unsigned int cpu = smp_processor_id();
+    uint64_t seed = rdtsc() | 1;
+    bench_result_t res;
+    mem_buf_t buf;
+    int rc;
+
+    rc = mem_buf_alloc(&buf, max_wss, opt_mem_bench_order);
+    if (rc < 0) {
+        warning("CPU%u: Unable to allocate %lu KB latency buffer: %d", cpu,
+                max_wss / KB(1), rc);
+        return;
+    }
+
+    for (size_t wss = MEM_MIN_WSS; wss <= max_wss; wss *= 2) {
+        unsigned long lines = wss / MEM_LINE_SIZE;
+        void *p = mem_build_chain(&buf, lines, seed);
+
+        /* Warm the caches and TLBs with one full lap */
+        p = mem_chase(p, lines);
+        if (BENCH("mem_latency", &opts, &res, p = mem_chase(p, 1)) < 0)
+            break;
+
+        printk("MEMLAT cpu=%u mode=%s order=%u wss_kb=%lu cycles=%lu ps=%lu\n", cpu, mode,
+               buf.order, wss / KB(1), res.median, tsc_to_ns(res.median * 1000));
+    }
+
+    mem_buf_free(&buf);
+}
+
+static void stream_copy(mem_buf_t *a, mem_buf_t *b, mem_buf_t *c) {
+    unsigned long nr = c->page_size / sizeof(uint64_t);
+
+    for (unsigned int p = 0; p < c->nr; p++) {
+        const uint64_t *src = a->pages[p];
+        uint64_t *dst = c->pages[p];
+
+        for (unsigned long i = 0; i < nr; i++)
+            dst[i] = src[i];
+    }
+}
+
+static void stream_scale(mem_buf_t *a, mem_buf_t *b, mem_buf_t *c) {
+    unsigned long nr = b->page_size / sizeof(uint64_t);
+
+    for (unsigned int p = 0; p < b->nr; p++) {
+        const uint64_t *src = c->pages[p];
+        uint64_t *dst = b->pages[p];
+
+        for (unsigned long i = 0; i < nr; i++)
+            dst[i] = MEM_STREAM_SCALAR * src[i];
+    }
+}
+
+static void stream_add(mem_buf_t *a, mem_buf_t *b, mem_buf_t *c) {
+    unsigned long nr = c->page_size / sizeof(uint64_t);
+
+    for (unsigned int p = 0; p < c->nr; p++) {
+        const uint64_t *src1 = a->pages[p], *src2 = b->pages[p];
+        uint64_t *dst = c->pages[p];
+
+        for (unsigned long i = 0; i < nr; i++)
+            dst[i] = src1[i] + src2[i];
+    }
+}
+
+static void stream_triad(mem_buf_t *a, mem_buf_t *b, mem_buf_t *c) {
+    unsigned long nr = a->page_size / sizeof(uint64_t);
+
+    for (unsigned int p = 0; p < a->nr; p++) {
+        const uint64_t *src1 = b->pages[p], *src2 = c->pages[p];
+        uint64_t *dst = a->pages[p];
+
+        for (unsigned long i = 0; i < nr; i++)
+            dst[i] = src1[i] + MEM_STREAM_SCALAR * src2[i];
+    }
+}
+
+struct stream_kernel {
+    const char *name;
+    unsigned int arrays; /* Arrays touched, STREAM's byte counting convention */
+    void (*fn)(mem_buf_t *a, mem_buf_t *b, mem_buf_t *c);
+};
+typedef struct stream_kernel stream_kernel_t;
+
+/* clang-format off */
+static const stream_kernel_t stream_kernels[] = {
+    {"copy",  2, stream_copy},
+    {"scale", 2, stream_scale},
+    {"add",   3, stream_add},
+    {"triad", 3, stream_triad},
+};
+/* clang-format on */
+
+/* STREAM sizes each array to at least 4 times the last level cache */
+static size_t stream_array_size(void) {
+    const cpu_cache_info_t *llc = get_cpu_llc_info(get_cpu(smp_processor_id()));
+    size_t size = MEM_STREAM_MIN_WSS;
+
+    if (llc && 4 * llc->size > size)
+        size = 4 * llc->size;
+
+    return size;
+}
+
+static void mem_bandwidth(const char *mode, size_t size) {
+    unsigned int cpu = smp_processor_id();
+    uint64_t freq = get_tsc_frequency();
+    mem_buf_t bufs[3];
+    int rc = 0;
+
+    memset(bufs, 0, sizeof(bufs));
+    for (unsigned int i = 0; i < ARRAY_SIZE(bufs) && rc == 0; i++)
+        rc = mem_buf_alloc(&bufs[i], size, opt_mem_bench_order);
+    if (rc < 0) {
+        warning("CPU%u: Unable to allocate %lu KB STREAM arrays: %d", cpu, size / KB(1),
+                rc);
+        goto out;
+    }
+
+    for (unsigned int k = 0; k < ARRAY_SIZE(stream_kernels); k++) {
+        const stream_kernel_t *kernel = &stream_kernels[k];
+        uint64_t bytes = (uint64_t) kernel->arrays * bufs[0].nr * bufs[0].page_size;
+        uint64_t best = ~_U64(0);
+
+        for (unsigned int run = 0; run < MEM_STREAM_RUNS; run++) {
+            uint64_t start = rdtsc_ordered();
+
+            kernel->fn(&bufs[0], &bufs[1], &bufs[2]);
+            best = min(best, rdtsc_ordered() - start);
+        }
+
+        printk("MEMBW cpu=%u mode=%s order=%u kernel=%s bytes=%lu cycles=%lu mbps=%lu\n",
+               cpu, mode, bufs[0].order, kernel->name, bytes, best,
+               best ? bytes * freq / best / MB(1) : 0);
+    }
+
+out:
+    for (unsigned int i = 0; i < ARRAY_SIZE(bufs); i++)
+        mem_buf_free(&bufs[i]);
+}
+
+/* Start all CPUs together, so the all-core numbers measure contended memory */
+static void mem_all_barrier(void) {
+    atomic_inc(&mem_all_ready);
+    while (atomic_read(&mem_all_ready) < (int) mem_all_cpus)
+        cpu_relax();
+}
+
+static unsigned long mem_latency_task(void *arg) {
+    mem_all_barrier();
+    mem_latency("all", _ul(arg));
+    return 0;
+}
+
+static unsigned long mem_bandwidth_task(void *arg) {
+    mem_all_barrier();
+    mem_bandwidth("all", _ul(arg));
+    return 0;
+}
+
+static unsigned int count_enabled_cpus(void) {
+    unsigned int nr = 0;
+
+    for (unsigned int id = 0; id < get_nr_cpus(); id++) {
+        cpu_t *cpu = get_cpu(id);
+
+        nr += cpu && is_cpu_enabled(cpu);
+    }
+
+    return nr;
+}
+
+/* One task per enabled CPU, started by test_main() once the test returns */
+static int mem_schedule_all(task_func_t func, size_t size) {
+    atomic_set(&mem_all_ready, 0);
+    mem_all_cpus = count_enabled_cpus();
+
+    for (unsigned int id = 0; id < get_nr_cpus(); id++) {
+        cpu_t *cpu = get_cpu(id);
+        task_t *task;
+        int rc;
+
+        if (!cpu || !is_cpu_enabled(cpu))
+            continue;
+
+        task = new_kernel_task("mem_bench", func, _ptr(size));
+        if (!task)
+            return -ENOMEM;
+
+        rc = schedule_task(task, cpu);
+        if (rc < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static bool mem_bench_order_valid(void) {
+    if (opt_mem_bench_order == PAGE_ORDER_4K || opt_mem_bench_order == PAGE_ORDER_2M)
+        return true;
+
+    printk("Unsupported mem_bench_order %lu\n", opt_mem_bench_order);
+    return false;
+}
+
+/* Pointer chasing latency over growing working sets: L1/L2/LLC/DRAM steps */
+int test_mem_latency(void *unused) {
+    size_t max_wss = opt_mem_bench_max_mb * MB(1);
+    unsigned int nr_cpus = count_enabled_cpus();
+
+    if (!mem_bench_order_valid() || !cpu_has_tsc())
+        return -EINVAL;
+
+    mem_latency("single", max_wss);
+
+    if (!opt_mem_bench_all || nr_cpus < 2)
+        return 0;
+
+    return mem_schedule_all(mem_latency_task, max(max_wss / nr_cpus, MEM_MIN_WSS));
+}
+REGISTER_TEST(test_mem_latency, test_mem_latency, .exclusive = true, .tags = "bench,mem");
+
+/* STREAM copy/scale/add/triad, on 64-bit integers as there is no FPU state here */
+int test_mem_bandwidth(void *unused) {
+    size_t size = stream_array_size(), page_size = PAGE_SIZE << opt_mem_bench_order;
+    unsigned int nr_cpus = count_enabled_cpus();
+
+    if (!mem_bench_order_valid() || !cpu_has_tsc())
+        return -EINVAL;
+
+    mem_bandwidth("single", size);
+
+    if (!opt_mem_bench_all || nr_cpus < 2)
+        return 0;
+
+    /* Split the arrays, so all CPUs together stream the single-core amount */
+    return mem_schedule_all(mem_bandwidth_task, max(size / nr_cpus, page_size));
+}
+REGISTER_TEST(test_mem_bandwidth, test_mem_bandwidth, .exclusive = true,
+              .tags = "bench,mem");
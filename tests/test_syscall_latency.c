@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <console.h>
+#include <cpu.h>
+#include <cpuid.h>
+#include <errno.h>
+#include <ktf.h>
+#include <lib.h>
+#include <pagetable.h>
+#include <processor.h>
+#include <sched.h>
+#include <string.h>
+#include <test.h>
+#include <usermode.h>
+
+#include <mm/vmm.h>
+
+#include <smp/smp.h>
+
+#include <toolkit/bench/lib.h>
+
+#define SC_WARMUP 64
+#define SC_REPS   2000
+
+/* Kernel entries keep PCID 0, user mode runs with its own */
+#define SC_USER_PCID 1
+
+/* User address of the page shared with the user task */
+#define SC_USER_VA _ptr(0x40000000)
+
+static const char *const sc_mode_names[] = {
+    [SYSCALL_MODE_SYSCALL] = "syscall",
+    [SYSCALL_MODE_SYSENTER] = "sysenter",
+    [SYSCALL_MODE_INT80] = "int80",
+};
+
+/* Kernel page mapped into the user address space: the kernel code is too far away
+ * from the user sections to address them directly.
+ */
+struct sc_shared {
+    syscall_mode_t mode;
+    unsigned int nr_samples; /* Set by the user task once done */
+    uint64_t samples[SC_REPS];
+};
+typedef struct sc_shared sc_shared_t;
+
+/* Same timestamp pair as bench_tsc_{start,end}(), but usable from user mode */
+static __always_inline uint64_t sc_tsc_start(void) {
+    uint32_t low, high;
+
+    asm volatile("lfence; rdtsc" : "=a"(low), "=d"(high)::"memory");
+    return ((uint64_t) high << 32) | low;
+}
+
+static __always_inline uint64_t sc_tsc_end(void) {
+    uint32_t low, high;
+
+    asm volatile("rdtscp; lfence" : "=a"(low), "=d"(high)::"ecx", "memory");
+    return ((uint64_t) high << 32) | low;
+}
+
+static unsigned long __user_text sc_user_task(void *arg) {
+    sc_shared_t *shared = arg;
+
+    if (!syscall_mode(shared->mode))
+        return -EINVAL;
+
+    for (unsigned int i = 0; i < SC_WARMUP + SC_REPS; i++) {
+        uint64_t start = sc_tsc_start();
+
+        nop_syscall();
+        if (i >= SC_WARMUP)
+            shared->samples[i - SC_WARMUP] = sc_tsc_end() - start;
+    }
+    shared->nr_samples = SC_REPS;
+
+    syscall_mode(SYSCALL_MODE_SYSCALL);
+    return 0;
+}
+
+/* Tag the user address space with its own PCID and make the CR3 writes on the
+ * kernel entry and exit paths keep the TLB entries of both. The CR3 values are
+ * global, so this must not overlap with user tasks running on other CPUs.
+ */
+static void sc_pcid_enable(void) {
+    write_cr4(read_cr4() | X86_CR4_PCIDE);
+
+    user_cr3.PCID = SC_USER_PCID;
+    user_cr3.reg |= X86_CR3_NOFLUSH;
+    cr3.reg |= X86_CR3_NOFLUSH;
+}
+
+static void sc_pcid_disable(void) {
+    cr3.reg &= ~X86_CR3_NOFLUSH;
+    user_cr3.reg &= ~(X86_CR3_NOFLUSH | X86_CR3_PCID_MASK);
+
+    /* Clearing PCIDE flushes the TLB entries of all PCIDs */
+    write_cr4(read_cr4() & ~X86_CR4_PCIDE);
+}
+
+/* A single CR3 write, the entry and exit paths do two per syscall */
+static int sc_bench_cr3(bool pcid) {
+    unsigned long val = read_cr3() | (pcid ? X86_CR3_NOFLUSH : 0);
+
+    return BENCH(pcid ? "cr3_write_noflush" : "cr3_write", NULL, NULL, write_cr3(val));
+}
+
+static int sc_bench_mode(sc_shared_t *shared, syscall_mode_t mode, bool pcid) {
+    cpu_t *cpu = get_cpu(smp_processor_id());
+    bench_opts_t opts = {
+        .reps = SC_REPS,
+        .irq_on = true,
+    };
+    char name[32];
+    task_t *task;
+    bench_t b;
+    int rc;
+
+    shared->mode = mode;
+    shared->nr_samples = 0;
+    task = new_user_task("syscall_latency", sc_user_task, SC_USER_VA);
+    if (!task)
+        return -ENOMEM;
+    schedule_task(task, cpu);
+    execute_tasks();
+
+    if (shared->nr_samples != SC_REPS) {
+        printk("SYSCALL %s: user task failed\n", sc_mode_names[mode]);
+        return -EFAULT;
+    }
+
+    /* The samples come from the user task, the warm-up is already done */
+    snprintf(name, sizeof(name), "nop_%s%s", sc_mode_names[mode], pcid ? "_pcid" : "");
+    rc = bench_begin(&b, name, &opts);
+    if (rc < 0)
+        return rc;
+
+    for (unsigned int i = 0; bench_next(&b); i++)
+        bench_record(&b, shared->samples[i]);
+    bench_end(&b, NULL);
+
+    return 0;
+}
+
+/* Null syscall round trip latency in cycles for each entry method, timed from user
+ * mode. Every kernel entry and exit switches between the user and kernel page tables,
+ * so the cost of a single CR3 write is measured alongside for reference. With PCID
+ * support, everything is repeated with the TLB entries kept across the switches.
+ */
+int test_syscall_latency(void *unused) {
+    sc_shared_t *shared;
+    bool pcid = false;
+    int rc = 0;
+
+    if (!cpu_has_tsc())
+        return -ENODEV;
+
+    BUILD_BUG_ON(sizeof(*shared) > PAGE_SIZE_2M);
+    shared = get_free_pages(PAGE_ORDER_2M, GFP_KERNEL_MAP);
+    if (!shared)
+        return -ENOMEM;
+    vmap_user_2m(SC_USER_VA, virt_to_mfn(shared), L2_PROT_USER);
+
+    printk("SYSCALL pcid=%u vendor=%s\n", cpu_has_pcid(),
+           cpu_is_amd() ? "amd" : (cpu_is_intel() ? "intel" : "other"));
+
+    do {
+        if (pcid)
+            sc_pcid_enable();
+
+        rc = sc_bench_cr3(pcid);
+        for (syscall_mode_t mode = SYSCALL_MODE_SYSCALL;
+             rc == 0 && mode <= SYSCALL_MODE_INT80; mode++) {
+            /* SYSENTER is not available in long mode on AMD CPUs */
+            if (mode == SYSCALL_MODE_SYSENTER && cpu_is_amd())
+                continue;
+
+            rc = sc_bench_mode(shared, mode, pcid);
+        }
+
+        if (pcid)
+            sc_pcid_disable();
+
+        pcid = !pcid;
+    } while (rc == 0 && pcid && cpu_has_pcid());
+
+    vunmap_user(SC_USER_VA, PAGE_ORDER_2M);
+    put_pages(shared, PAGE_ORDER_2M);
+
+    return rc;
+}
+REGISTER_TEST(test_syscall_latency, test_syscall_latency, .exclusive = true,
+              .tags = "bench,latency");
@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <cmdline.h>
+#include <console.h>
+#include <cpu.h>
+#include <cpuid.h>
+#include <errno.h>
+#include <ktf.h>
+#include <lib.h>
+#include <page.h>
+#include <pmu.h>
+#include <sched.h>
+#include <string.h>
+#include <test.h>
+
+#include <mm/pmm.h>
+
+#include <smp/smp.h>
+
+#include <toolkit/bench/lib.h>
+
+/* Unused kernel address space, one L4 slot (512G) per page order */
+#define TLB_BENCH_VA     _U64(0xffffc00000000000)
+#define TLB_WINDOW_SHIFT 39
+
+#define TLB_MIN_PAGES   4
+#define TLB_MAX_POINTS  64
+#define TLB_CHASE_STEPS 1024 /* Dependent loads per timed sample */
+#define TLB_CHASE_REPS  64
+
+/* Full period LCG modulo any power of two: odd increment, multiplier 1 mod 4 */
+#define TLB_LCG_MUL _U64(6364136223846793005)
+#define TLB_LCG_INC _U64(1442695040888963407)
+
+/* A step of at least 25% and 1 cycle between two points marks an exhausted level */
+#define TLB_STEP_PCT 125
+#define TLB_STEP_MIN 100 /* In 1/100 cycles */
+
+#define TLB_MAX_SIGNATURES 8
+
+/* Largest number of 4K, 2M and 1G pages swept */
+static unsigned long opt_tlb_bench_max_4k = 32768;
+ulong_cmd("tlb_bench_max_4k", opt_tlb_bench_max_4k);
+
+static unsigned long opt_tlb_bench_max_2m = 4096;
+ulong_cmd("tlb_bench_max_2m", opt_tlb_bench_max_2m);
+
+static unsigned long opt_tlb_bench_max_1g = 64;
+ulong_cmd("tlb_bench_max_1g", opt_tlb_bench_max_1g);
+
+/* Count DTLB misses and page walk cycles per access, when the PMU has them */
+static bool opt_tlb_bench_pmu = true;
+bool_cmd("tlb_bench_pmu", opt_tlb_bench_pmu);
+
+/* Repeat the sweep on every CPU of a model (or hybrid core type) not measured yet */
+static bool opt_tlb_bench_all = true;
+bool_cmd("tlb_bench_all", opt_tlb_bench_all);
+
+struct tlb_order {
+    const char *name;
+    unsigned int order;
+    unsigned long *max_pages;
+};
+typedef struct tlb_order tlb_order_t;
+
+/* clang-format off */
+static const tlb_order_t tlb_orders[] = {
+    {"4k", PAGE_ORDER_4K, &opt_tlb_bench_max_4k},
+    {"2m", PAGE_ORDER_2M, &opt_tlb_bench_max_2m},
+    {"1g", PAGE_ORDER_1G, &opt_tlb_bench_max_1g},
+};
+/* clang-format on */
+
+/* One sweep point, all values in 1/100 per access */
+struct tlb_point {
+    unsigned long pages;
+    uint64_t cycles;
+    uint64_t misses;
+    uint64_t walk_cycles;
+};
+typedef struct tlb_point tlb_point_t;
+
+static tlb_point_t tlb_points[TLB_MAX_POINTS];
+
+static uint32_t tlb_signatures[TLB_MAX_SIGNATURES];
+static unsigned int tlb_nr_signatures;
+
+static inline void *tlb_window(unsigned int idx) {
+    return _ptr(TLB_BENCH_VA + ((uint64_t) idx << TLB_WINDOW_SHIFT));
+}
+
+static inline unsigned int tlb_page_shift(unsigned int order) {
+    return PAGE_SHIFT + order;
+}
+
+static void tlb_unmap(void *va, unsigned int order, unsigned long nr) {
+    for (unsigned long i = 0; i < nr; i++)
+        vunmap_kern(va + (i << tlb_page_shift(order)), order);
+}
+
+/* Alias one frame at nr consecutive pages: every page needs its own TLB entry, while
+ * the data touched is a single cache line. The page tables stay allocated and are
+ * reused by the next run.
+ */
+static int tlb_map(void *va, mfn_t mfn, unsigned int order, unsigned long nr) {
+    for (unsigned long i = 0; i < nr; i++) {
+        void *page = va + (i << tlb_page_shift(order)), *ret;
+
+        if (order == PAGE_ORDER_1G)
+            ret = vmap_1g(page, mfn, L3_PROT);
+        else if (order == PAGE_ORDER_2M)
+            ret = vmap_2m(page, mfn, L2_PROT);
+        else
+            ret = vmap_4k(page, mfn, L1_PROT);
+
+        if (!ret) {
+            tlb_unmap(va, order, i);
+            return -EFAULT;
+        }
+    }
+
+    return 0;
+}
+
+/* Visit the pages in LCG order over the next power of two, scaled down to nr pages.
+ * The loaded value (always 0) feeds the next index, so the walks cannot overlap.
+ */
+static inline uint64_t tlb_chase(const void *va, unsigned int shift, unsigned long nr,
+                                 unsigned int bits, uint64_t idx, unsigned long steps) {
+    uint64_t mask = (_U64(1) << bits) - 1;
+
+    while (steps--) {
+        unsigned long page = (idx * nr) >> bits;
+        uint64_t val;
+
+        asm volatile("mov (%1), %0" : "=r"(val) : "r"(va + (page << shift)) : "memory");
+        idx = (idx * TLB_LCG_MUL + TLB_LCG_INC + val) & mask;
+    }
+
+    return idx;
+}
+
+static unsigned int tlb_pmu_setup(pmu_event_t *events) {
+    unsigned int nr = 0;
+
+    if (!opt_tlb_bench_pmu || !pmu_available())
+        return 0;
+
+    if (pmu_has_event(PMU_EVENT_DTLB_MISSES))
+        events[nr++] = PMU_EVENT_DTLB_MISSES;
+    if (pmu_has_event(PMU_EVENT_DTLB_WALK_CYCLES))
+        events[nr++] = PMU_EVENT_DTLB_WALK_CYCLES;
+
+    if (nr == 0)
+        return 0;
+
+    /* Borrow the counters of a running pmu_stat session, tlb_sweep() hands them back */
+    pmu_stat_suspend();
+    if (pmu_setup(events, nr) < 0) {
+        pmu_stat_resume();
+        return 0;
+    }
+
+    return nr;
+}
+
+static void tlb_pmu_count(tlb_point_t *point, const pmu_event_t *events, unsigned int nr,
+                          const void *va, unsigned int shift, unsigned int bits) {
+    unsigned long accesses = TLB_CHASE_STEPS * TLB_CHASE_REPS;
+    uint64_t values[2];
+    unsigned long flags;
+
+    flags = interrupts_disable_save();
+    tlb_chase(va, shift, point->pages, bits, 0, point->pages);
+    pmu_reset();
+    pmu_start();
+    tlb_chase(va, shift, point->pages, bits, 0, accesses);
+    pmu_stop();
+    interrupts_restore(flags);
+
+    pmu_read(values);
+    for (unsigned int i = 0; i < nr; i++) {
+        uint64_t value = values[i] * 100 / accesses;
+
+        if (events[i] == PMU_EVENT_DTLB_MISSES)
+            point->misses = value;
+        else
+            point->walk_cycles = value;
+    }
+}
+
+static int tlb_measure(tlb_point_t *point, const void *va, unsigned int shift,
+                       const pmu_event_t *events, unsigned int nr_events) {
+    bench_opts_t opts = {.reps = TLB_CHASE_REPS, .inner = 1, .quiet = true};
+    unsigned int bits = 0;
+    bench_result_t res;
+    uint64_t idx;
+    int rc;
+
+    while ((_U64(1) << bits) < point->pages)
+        bits++;
+
+    /* Warm the TLBs and paging structure caches with one full lap */
+    idx = tlb_chase(va, shift, point->pages, bits, 0, _U64(1) << bits);
+    rc = BENCH("tlb_chase", &opts, &res,
+               idx = tlb_chase(va, shift, point->pages, bits, idx, TLB_CHASE_STEPS));
+    if (rc < 0)
+        return rc;
+
+    point->cycles = res.median * 100 / TLB_CHASE_STEPS;
+    point->misses = point->walk_cycles = 0;
+    if (nr_events > 0)
+        tlb_pmu_count(point, events, nr_events, va, shift, bits);
+
+    return 0;
+}
+
+/* Report the first point of every run of steep cost increases: the previous point is
+ * the last one still served by the exhausted TLB level.
+ */
+static void tlb_report_steps(const tlb_order_t *o, unsigned int nr) {
+    unsigned int cpu = smp_processor_id();
+    bool rising = false;
+
+    for (unsigned int i = 1; i < nr; i++) {
+        const tlb_point_t *prev = &tlb_points[i - 1], *cur = &tlb_points[i];
+        bool step = cur->cycles * 100 > prev->cycles * TLB_STEP_PCT &&
+                    cur->cycles >= prev->cycles + TLB_STEP_MIN;
+
+        if (step && !rising) {
+            printk("TLBSTEP cpu=%u order=%s family=0x%x model=0x%x core_type=0x%x "
+                   "entries=%lu-%lu reach_kb=%lu cycles=%lu.%02lu->%lu.%02lu\n",
+                   cpu, o->name, cpu_family(), cpu_model(), cpu_core_type(),
+                   prev->pages, cur->pages,
+                   (prev->pages << tlb_page_shift(o->order)) / KB(1),
+                   prev->cycles / 100, prev->cycles % 100, cur->cycles / 100,
+                   cur->cycles % 100);
+        }
+        rising = step;
+    }
+}
+
+static void tlb_sweep(const tlb_order_t *o, unsigned int window) {
+    unsigned long max_pages = *o->max_pages;
+    unsigned int cpu = smp_processor_id(), shift = tlb_page_shift(o->order);
+    pmu_event_t events[2];
+    unsigned int nr = 0, nr_events;
+    void *va = tlb_window(window);
+    frame_t *frame;
+    int rc;
+
+    if (max_pages < TLB_MIN_PAGES)
+        return;
+
+    if (o->order == PAGE_ORDER_1G && !cpu_has_page1gb()) {
+        printk("TLB cpu=%u order=%s: 1G pages not supported\n", cpu, o->name);
+        return;
+    }
+
+    /* Keep the window inside its L4 slot */
+    max_pages = min(max_pages, _ul(_U64(1) << (TLB_WINDOW_SHIFT - shift)));
+
+    frame = get_free_frames(o->order);
+    if (!frame) {
+        printk("TLB cpu=%u order=%s: no free frame\n", cpu, o->name);
+        return;
+    }
+
+    rc = tlb_map(va, frame->mfn, o->order, max_pages);
+    if (rc < 0) {
+        warning("CPU%u: Unable to map %lu %s pages: %d", cpu, max_pages, o->name, rc);
+        put_free_frames(frame->mfn, o->order);
+        return;
+    }
+    *(volatile uint64_t *) va = 0;
+
+    nr_events = tlb_pmu_setup(events);
+
+    /* Powers of two and their midpoints, for a finer view of the capacity steps */
+    for (unsigned long p = TLB_MIN_PAGES; p <= max_pages && nr < TLB_MAX_POINTS; p *= 2) {
+        unsigned long steps[] = {p, p + p / 2};
+
+        for (unsigned int i = 0; i < ARRAY_SIZE(steps); i++) {
+            tlb_point_t *point = &tlb_points[nr];
+
+            if (steps[i] > max_pages || nr == TLB_MAX_POINTS)
+                break;
+
+            point->pages = steps[i];
+            if (tlb_measure(point, va, shift, events, nr_events) < 0)
+                goto out;
+            nr++;
+
+            printk("TLB cpu=%u order=%s pages=%lu reach_kb=%lu cycles=%lu.%02lu "
+                   "dtlb_misses=%lu.%02lu walk_cycles=%lu.%02lu\n",
+                   cpu, o->name, point->pages,
+                   (point->pages << shift) / KB(1), point->cycles / 100,
+                   point->cycles % 100, point->misses / 100, point->misses % 100,
+                   point->walk_cycles / 100, point->walk_cycles % 100);
+        }
+    }
+
+    tlb_report_steps(o, nr);
+
+out:
+    if (nr_events > 0) {
+        pmu_release();
+        pmu_stat_resume();
+    }
+    tlb_unmap(va, o->order, max_pages);
+    put_free_frames(frame->mfn, o->order);
+}
+
+/* Family, model, stepping and hybrid core type identify the TLB geometry */
+static bool tlb_new_signature(void) {
+    uint32_t sig = cpuid_eax(CPUID_FEATURES_LEAF) ^ (cpu_core_type() << 28);
+
+    for (unsigned int i = 0; i < tlb_nr_signatures; i++) {
+        if (tlb_signatures[i] == sig)
+            return false;
+    }
+
+    if (tlb_nr_signatures < TLB_MAX_SIGNATURES)
+        tlb_signatures[tlb_nr_signatures++] = sig;
+    return true;
+}
+
+static unsigned long tlb_bench(void *unused) {
+    if (!tlb_new_signature())
+        return 0;
+
+    printk("TLB cpu=%u family=0x%x model=0x%x core_type=0x%x unit=cycles/access\n",
+           smp_processor_id(), cpu_family(), cpu_model(), cpu_core_type());
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(tlb_orders); i++)
+        tlb_sweep(&tlb_orders[i], i);
+
+    return 0;
+}
+
+/* Cycles per access while the number of touched pages outgrows each TLB level */
+int test_tlb_bench(void *unused) {
+    unsigned int this_cpu = smp_processor_id();
+
+    if (!cpu_has_tsc())
+        return -ENODEV;
+
+    tlb_nr_signatures = 0;
+    tlb_bench(NULL);
+
+    if (!opt_tlb_bench_all)
+        return 0;
+
+    /* One CPU at a time: the windows are shared and SMT siblings share their TLBs */
+    for (unsigned int id = 0; id < get_nr_cpus(); id++) {
+        cpu_t *cpu = get_cpu(id);
+        task_t *task;
+        int rc;
+
+        if (!cpu || !is_cpu_enabled(cpu) || id == this_cpu)
+            continue;
+
+        task = new_kernel_task("tlb_bench", tlb_bench, NULL);
+        if (!task)
+            return -ENOMEM;
+
+        rc = schedule_task(task, cpu);
+        if (rc < 0)
+            return rc;
+        execute_tasks();
+    }
+
+    return 0;
+}
+REGISTER_TEST(test_tlb_bench, test_tlb_bench, .exclusive = true, .tags = "bench,mem,tlb");
@@ -25,16 +25,13 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <ktf.h>
-#include <mm/pmm.h>
-#include <string.h>
-#include <toolkit/cache/lib.h>
+#include <lib.h>
+#include <test.h>
+#include <toolkit/spec/lib.h>
 
 /* Set it to 1 to enable BTB flushing */
 #define WITH_BTB_FLUSH 0
 
-/* Set it to 1 to use call as the direct unconditional branch */
-#define TEST_CALL 0
-
 #define ITERATIONS 10
 
 #if WITH_BTB_FLUSH
@@ -43,201 +40,53 @@
 #define LOOP_ITERATIONS (100 * 1000)
 #endif
 
-static unsigned baseline, counts[2];
-static cache_channel_t *channel;
-
-static cache_line_t *cl0;
-static cache_line_t *cl1;
-
-#define CHANNEL_ADDR      0x200000
-#define CACHE_LINE_0_ADDR 0x2007c0
-#define CACHE_LINE_1_ADDR 0x200f80
-
-#if WITH_BTB_FLUSH
-#define FLUSH_BTB()                                                                      \
-    do {                                                                                 \
-        asm volatile(".align 64\n    "                                                   \
-                     ".rept 8192\n   "                                                   \
-                     "    jmp 1f\n   "                                                   \
-                     "    .rept 30\n "                                                   \
-                     "        nop\n  "                                                   \
-                     "    .endr\n    "                                                   \
-                     "1:  jmp 2f\n   "                                                   \
-                     "    .rept 29\n "                                                   \
-                     "        nop\n  "                                                   \
-                     "    .endr\n    "                                                   \
-                     "2:  nop\n      "                                                   \
-                     ".endr\n        ");                                                 \
-    } while (0)
-#else
-#define FLUSH_BTB()
-#endif
-
-#if TEST_CALL
-#define BRANCH call
-#define CLEAN_STACK()                                                                    \
-    do {                                                                                 \
-        asm volatile("add $8, %rsp");                                                    \
-    } while (0)
-#else
-#define BRANCH jmp
-#define CLEAN_STACK()
-#endif
-
-void __aligned(PAGE_SIZE) test_uncond_backward_branch_cl0(unsigned iterations) {
-    for (int i = 0; i < ITERATIONS; i++) {
-        counts[0] = counts[1] = 0;
-
-        for (unsigned j = 0; j < iterations; j++) {
-            FLUSH_BTB();
-            clflush(cl0);
-            clflush(cl1);
-            mfence();
-
-            /* clang-format off */
-            asm goto(
-                "mov $%c[cl0], %%rsi\n"
-
-                "jmp 1f\n"
-                "2: jmp %l[end]\n"
-                ".align 64\n"
-                "lfence\n"
-                "ud2\n"
-                ".align 64\n"
-
-                "1: " STR(BRANCH) " 2b\n"
-                "mov (%%rsi), %%rax\n"
-                :: [cl0] "i" (CACHE_LINE_0_ADDR)
-                : "rsi", "rax", "memory"
-                : end);
-            /* clang-format on */
-        end:
-            CLEAN_STACK();
-            counts[cache_channel_measure_bit(cl0, cl1, baseline)]++;
+static const spec_branch_t branches[] = {SPEC_BRANCH_JMP, SPEC_BRANCH_CALL};
+static const spec_direction_t directions[] = {SPEC_FORWARD, SPEC_BACKWARD};
+static const unsigned int distances[] = {0, 64};
+static const unsigned int offsets[] = {0, 32};
+static const unsigned int probe_lines[] = {CACHE_LINE1, CACHE_LINE2};
+
+static spec_gadget_desc_t gadgets[ARRAY_SIZE(branches) * ARRAY_SIZE(directions) *
+                                  ARRAY_SIZE(distances) * ARRAY_SIZE(offsets) *
+                                  ARRAY_SIZE(probe_lines)];
+
+static spec_matrix_t matrix = {
+    .name = "test_uncond_branch_mispredictions",
+    .descs = gadgets,
+    .nr = ARRAY_SIZE(gadgets),
+    .opts =
+        {
+            .iterations = LOOP_ITERATIONS,
+            .rounds = ITERATIONS,
+            .flush_btb = WITH_BTB_FLUSH,
+        },
+};
+
+/* Direct jmp and call gadgets, run on every CPU in parallel */
+int test_uncond_branch_mispredictions(void *unused) {
+    spec_gadget_desc_t *desc = gadgets;
+
+    for (unsigned int b = 0; b < ARRAY_SIZE(branches); b++) {
+        for (unsigned int d = 0; d < ARRAY_SIZE(directions); d++) {
+            for (unsigned int dist = 0; dist < ARRAY_SIZE(distances); dist++) {
+                for (unsigned int off = 0; off < ARRAY_SIZE(offsets); off++) {
+                    for (unsigned int l = 0; l < ARRAY_SIZE(probe_lines); l++) {
+                        desc->branch = branches[b];
+                        desc->dir = directions[d];
+                        desc->distance = distances[dist];
+                        desc->offset = offsets[off];
+                        desc->probe_line = probe_lines[l];
+                        desc++;
+                    }
+                }
+            }
         }
-
-        printk("%s," STR(CACHE_LINE_0_ADDR) ",%u,%u,%u,%u\n", __func__, counts[0],
-               counts[1], iterations, baseline);
     }
-}
-
-void __aligned(PAGE_SIZE) test_uncond_backward_branch_cl1(unsigned iterations) {
-    for (int i = 0; i < ITERATIONS; i++) {
-        counts[0] = counts[1] = 0;
 
-        for (unsigned j = 0; j < iterations; j++) {
-            FLUSH_BTB();
-            clflush(cl0);
-            clflush(cl1);
-            mfence();
-
-            /* clang-format off */
-            asm goto(
-                "mov $%c[cl1], %%rsi\n"
-
-                "jmp 1f\n"
-                "2: jmp %l[end]\n"
-                ".align 64\n"
-                "lfence\n"
-                "ud2\n"
-                ".align 64\n"
-
-                "1: " STR(BRANCH) " 2b\n"
-                "mov (%%rsi), %%rax\n"
-                :: [cl1] "i" (CACHE_LINE_1_ADDR)
-                : "rsi", "rax", "memory"
-                : end);
-            /* clang-format on */
-        end:
-            CLEAN_STACK();
-            counts[cache_channel_measure_bit(cl0, cl1, baseline)]++;
-        }
-
-        printk("%s," STR(CACHE_LINE_1_ADDR) ",%u,%u,%u,%u\n", __func__, counts[0],
-               counts[1], iterations, baseline);
-    }
-}
-
-void __aligned(PAGE_SIZE) test_uncond_forward_branch_cl0(unsigned iterations) {
-    for (int i = 0; i < ITERATIONS; i++) {
-        counts[0] = counts[1] = 0;
-
-        for (unsigned j = 0; j < iterations; j++) {
-            FLUSH_BTB();
-            clflush(cl0);
-            clflush(cl1);
-            mfence();
-
-            /* clang-format off */
-            asm goto(
-                "mov $%c[cl0], %%rsi\n"
-
-                STR(BRANCH) " %l[end]\n"
-                "mov (%%rsi), %%rax\n"
-                :: [cl0] "i" (CACHE_LINE_0_ADDR)
-                : "rsi", "rax", "memory"
-                : end);
-            /* clang-format on */
-        end:
-            CLEAN_STACK();
-            counts[cache_channel_measure_bit(cl0, cl1, baseline)]++;
-        }
-
-        printk("%s," STR(CACHE_LINE_0_ADDR) ",%u,%u,%u,%u\n", __func__, counts[0],
-               counts[1], iterations, baseline);
-    }
-}
-
-void __aligned(PAGE_SIZE) test_uncond_forward_branch_cl1(unsigned iterations) {
-    for (int i = 0; i < ITERATIONS; i++) {
-        counts[0] = counts[1] = 0;
-
-        for (unsigned j = 0; j < iterations; j++) {
-            FLUSH_BTB();
-            clflush(cl0);
-            clflush(cl1);
-            mfence();
-
-            /* clang-format off */
-            asm goto(
-                "mov $%c[cl1], %%rsi\n"
-
-                STR(BRANCH) " %l[end]\n"
-                "mov (%%rsi), %%rax\n"
-                :: [cl1] "i" (CACHE_LINE_1_ADDR)
-                : "rsi", "rax", "memory"
-                : end);
-            /* clang-format on */
-        end:
-            CLEAN_STACK();
-            counts[cache_channel_measure_bit(cl0, cl1, baseline)]++;
-        }
-
-        printk("%s," STR(CACHE_LINE_1_ADDR) ",%u,%u,%u,%u\n", __func__, counts[0],
-               counts[1], iterations, baseline);
-    }
-}
-
-int __aligned(PAGE_SIZE) test_uncond_branch_mispredictions(void *unused) {
-    frame_t *frame = get_free_frame();
-    channel = vmap_4k(_ptr(CHANNEL_ADDR), frame->mfn, L1_PROT);
-
-    cl0 = &channel->lines[CACHE_LINE1]; /* CACHE_LINE_0_ADDR */
-    cl1 = &channel->lines[CACHE_LINE2]; /* CACHE_LINE_1_ADDR */
-
-    baseline = (cache_channel_baseline(cl0, 100) + cache_channel_baseline(cl1, 100)) / 2;
-    baseline = min(200, baseline);
-
-    printk("Testing direct unconditional " STR(BRANCH) " %s BTB flushing\n",
+    printk("Testing direct unconditional branches %s BTB flushing\n",
            WITH_BTB_FLUSH ? "with" : "without");
 
-    unsigned long flags = interrupts_disable_save();
-    test_uncond_forward_branch_cl0(LOOP_ITERATIONS);
-    test_uncond_forward_branch_cl1(LOOP_ITERATIONS);
-
-    test_uncond_backward_branch_cl0(LOOP_ITERATIONS);
-    test_uncond_backward_branch_cl1(LOOP_ITERATIONS);
-    interrupts_restore(flags);
-
-    return 0;
+    return spec_run_matrix(&matrix);
 }
+REGISTER_TEST(test_uncond_branch_mispredictions, test_uncond_branch_mispredictions,
+              .exclusive = true, .tags = "bench,branch");
@@ -24,18 +24,31 @@
  */
 #include <cmdline.h>
 #include <console.h>
+#include <cpu.h>
 #include <cpuid.h>
+#include <errno.h>
+#include <hrtimer.h>
 #include <ktf.h>
+#include <percpu.h>
+#include <pmu.h>
+#include <profiler.h>
 #include <real_mode.h>
 #include <sched.h>
 #include <string.h>
 #include <symbols.h>
 #include <test.h>
+#include <time.h>
+#include <tsc.h>
 #include <usermode.h>
 
+#include <drivers/hpet.h>
+
 #include <mm/pmm.h>
 #include <smp/smp.h>
 
+#include <toolkit/bench/lib.h>
+#include <toolkit/cache/lib.h>
+
 static char opt_string[4];
 string_cmd("string", opt_string);
 
@@ -51,6 +64,9 @@ bool_cmd("boolean", opt_bool);
 static bool opt_booltwo = 0;
 bool_cmd("booleantwo", opt_booltwo);
 
+static cache_line_t calib_line;
+static cache_channel_t probe_channel;
+
 static char memmove_string[4];
 static char range_string[] = "123456";
 static char *src, *dst;
@@ -116,6 +132,63 @@ static unsigned long __user_text test_user_task_func4(void *arg) {
     return *(unsigned long *) HIGH_USER_PTR;
 }
 
+static void test_timer_quiet_fn(void *arg) {
+    ACCESS_ONCE(*(bool *) arg) = true;
+}
+
+static int quiet_rc;
+
+/* Neither the APIC timer tick nor a local hrtimer may fire within a quiet window */
+static unsigned long test_timer_quiet_func(void *arg) {
+    unsigned long apic_ticks;
+    bool fired = false;
+    hrtimer_t timer;
+    ktime_t timeout;
+
+    if (!PERCPU_GET(apic_timer_enabled)) {
+        quiet_rc = -ENODEV;
+        return quiet_rc;
+    }
+
+    quiet_rc = timer_quiet_enter();
+    if (quiet_rc < 0)
+        return quiet_rc;
+
+    apic_ticks = PERCPU_GET(apic_ticks);
+    hrtimer_init(&timer, test_timer_quiet_fn, &fired);
+    BUG_ON(hrtimer_start(&timer, smp_processor_id(), NSEC_PER_MSEC,
+                         HRTIMER_MODE_REL) < 0);
+
+    mdelay(5);
+    if (PERCPU_GET(apic_ticks) != apic_ticks || ACCESS_ONCE(fired)) {
+        printk("Timer interrupt within a quiet window\n");
+        BUG();
+    }
+    timer_quiet_exit();
+
+    /* The deferred hrtimer has expired by now and must fire right away */
+    timeout = ktime_ns() + 10 * NSEC_PER_MSEC;
+    while (!ACCESS_ONCE(fired)) {
+        if (ktime_ns() > timeout) {
+            printk("hrtimer deferred by a quiet window did not fire\n");
+            BUG();
+        }
+        cpu_relax();
+    }
+
+    return 0;
+}
+
+static void count_core(cpu_t *cpu, void *arg) {
+    unsigned int *nr_cores = arg;
+
+    (*nr_cores)++;
+}
+
+static void print_sibling(cpu_t *sibling, void *arg) {
+    printk(" CPU%u", sibling->id);
+}
+
 int unit_tests(void *_unused) {
     printk("\nLet the UNITTESTs begin\n");
     printk("Commandline parsing: %s\n", kernel_cmdline);
@@ -184,6 +257,200 @@ int unit_tests(void *_unused) {
     cpu_freq_expect("Prototyp Amazing Foo One @ 1GHz", 1000000000);
     cpu_freq_expect("Prototyp Amazing Foo Two @ 1.00GHz", 1000000000);
 
+    if (tsc_calibrated()) {
+        ktime_t start, elapsed;
+
+        printk("\nTSC clocksource testing:\n");
+        if (ns_to_tsc(NSEC_PER_SEC) != get_tsc_frequency()) {
+            printk("ns_to_tsc(1s) != TSC frequency: %lu\n", ns_to_tsc(NSEC_PER_SEC));
+            BUG();
+        }
+
+        if (tsc_to_ns(get_tsc_frequency()) + 2 < NSEC_PER_SEC ||
+            tsc_to_ns(get_tsc_frequency()) > NSEC_PER_SEC + 2) {
+            printk("tsc_to_ns(TSC frequency) != 1s: %lu\n",
+                   tsc_to_ns(get_tsc_frequency()));
+            BUG();
+        }
+
+        start = ktime_ns();
+        udelay(1000);
+        elapsed = ktime_ns() - start;
+        if (elapsed < NSEC_PER_MSEC) {
+            printk("udelay(1000) returned too early: %lu ns\n", elapsed);
+            BUG();
+        }
+        printk("udelay(1000) took %lu ns\n", elapsed);
+
+        if (hpet_available()) {
+            start = hpet_ktime_ns();
+            udelay(1000);
+            elapsed = hpet_ktime_ns() - start;
+            if (elapsed < NSEC_PER_MSEC - NSEC_PER_USEC * 10) {
+                printk("HPET clocksource behind TSC: %lu ns\n", elapsed);
+                BUG();
+            }
+            printk("HPET: udelay(1000) took %lu ns\n", elapsed);
+        }
+
+        /* The BSP takes the global timer ticks, so check the quiet window on an AP */
+        if (timer_quiet_enter() == 0)
+            timer_quiet_exit();
+        else if (get_nr_cpus() > 1) {
+            task_t *task = new_kernel_task("quiet window", test_timer_quiet_func, NULL);
+
+            quiet_rc = -EINPROGRESS;
+            schedule_task(task, get_cpu(1));
+            execute_tasks();
+            printk("Quiet window on CPU1: %d\n", quiet_rc);
+            BUG_ON(quiet_rc == -EINPROGRESS);
+        }
+    }
+
+    if (cpu_has_tsc() && get_nr_cpus() > 1) {
+        printk("\nTSC synchronization check:\n");
+        tsc_sync_check_all();
+    }
+
+    if (tsc_calibrated() && get_nr_cpus() > 1) {
+        hrtimer_stats_t stats;
+        int rc;
+
+        printk("\nHigh resolution timer testing:\n");
+        rc = hrtimer_measure_accuracy(1, 250 * NSEC_PER_USEC, 16, &stats);
+        if (rc < 0)
+            printk("hrtimer on CPU1 did not fire: %d\n", rc);
+        else {
+            printk("hrtimer on CPU1 in 250us (%u samples): late by %ld/%ld/%ld ns "
+                   "(min/avg/max)\n",
+                   stats.samples, stats.min_ns, stats.avg_ns, stats.max_ns);
+        }
+    }
+
+    if (cpu_has_tsc()) {
+        bench_opts_t opts = {.reps = 256, .inner = 16};
+        bench_result_t res;
+
+        printk("\nBenchmark harness testing:\n");
+        if (BENCH("nop", &opts, &res, asm volatile("nop")) < 0) {
+            printk("Unable to run the nop benchmark\n");
+            BUG();
+        }
+        if (res.min > res.median || res.median > res.p99 || res.p99 > res.max ||
+            res.samples + res.outliers != opts.reps) {
+            printk("Inconsistent nop benchmark statistics\n");
+            BUG();
+        }
+    }
+
+    if (cpu_has_tsc()) {
+        uint64_t hits[CACHE_PROBE_WORDS(CACHE_CHANNEL_LINES)];
+        uint32_t lat[CACHE_CHANNEL_LINES];
+        cache_calibration_t calib, cached;
+        unsigned nr_hits;
+
+        printk("\nCache hit/miss calibration:\n");
+        BUG_ON(cache_calibrate(&calib_line, WB, &calib) < 0);
+        cache_print_calibration(&calib);
+        if (calib.hit.median >= calib.miss.median) {
+            printk("Cache hits not faster than misses\n");
+            BUG();
+        }
+        BUG_ON(cache_get_calibration(calib.cpu, WB, &cached) < 0);
+        BUG_ON(cached.threshold != calib.threshold);
+
+        cache_flush_lines(probe_channel.lines, sizeof(cache_line_t), CACHE_CHANNEL_LINES);
+        cache_read_access(&probe_channel.lines[CACHE_LINE1]);
+        cache_read_access(&probe_channel.lines[CACHE_LINE2]);
+        printk("Batched probe: %u hits\n",
+               cache_channel_probe(&probe_channel, calib.threshold, lat, hits));
+        if (!(hits[0] & (_U64(1) << CACHE_LINE1)) ||
+            !(hits[0] & (_U64(1) << CACHE_LINE2))) {
+            printk("Batched probe missed cached lines: %lu/%lu cycles\n",
+                   _ul(lat[CACHE_LINE1]), _ul(lat[CACHE_LINE2]));
+            BUG();
+        }
+
+        /* Only the hot line must be a hit; a prefetched neighbour or two is fine */
+        cache_flush_lines(probe_channel.lines, sizeof(cache_line_t), CACHE_CHANNEL_LINES);
+        cache_read_access(&probe_channel.lines[CACHE_LINE1]);
+        nr_hits = cache_channel_probe(&probe_channel, calib.threshold, lat, hits);
+        printk("Batched probe of one hot line: %u hits, hot=%u flushed=%u cycles\n",
+               nr_hits, lat[CACHE_LINE1], lat[CACHE_LINE2]);
+        if (!(hits[0] & (_U64(1) << CACHE_LINE1)) || lat[CACHE_LINE1] >= lat[CACHE_LINE2]) {
+            printk("Batched probe missed the hot line: %u cycles\n", lat[CACHE_LINE1]);
+            BUG();
+        }
+        if ((hits[0] & (_U64(1) << CACHE_LINE2)) || nr_hits > CACHE_CHANNEL_LINES / 8) {
+            printk("Batched probe hit flushed lines: %u hits, %u cycles\n", nr_hits,
+                   lat[CACHE_LINE2]);
+            BUG();
+        }
+    }
+
+    if (get_bsp_cpu()->caches.nr > 0) {
+        cpu_t *bsp = get_bsp_cpu();
+        const cpu_cache_info_t *l1d = get_cpu_cache_info(bsp, 1, CPU_CACHE_DATA);
+        const cpu_cache_info_t *llc = get_cpu_llc_info(bsp);
+
+        printk("\nCache topology:\n");
+        print_cpu_cache_info(bsp);
+        if (!l1d || !llc || llc->level < l1d->level) {
+            printk("Missing L1 data cache or LLC\n");
+            BUG();
+        }
+        if (l1d->line_size != CACHE_LINE_SIZE) {
+            printk("L1 data cache line size %u != %u\n", l1d->line_size, CACHE_LINE_SIZE);
+            BUG();
+        }
+    }
+
+    if (cpu_has_topology(get_bsp_cpu())) {
+        unsigned int nr_cores = 0;
+
+        printk("\nCPU topology:\n");
+        for_each_core(count_core, &nr_cores);
+        printk("BSP siblings:");
+        for_each_sibling(get_bsp_cpu(), print_sibling, NULL);
+        printk("\n");
+        if (nr_cores == 0 || nr_cores != get_nr_cores() || nr_cores > get_nr_cpus()) {
+            printk("Inconsistent core count: %u\n", nr_cores);
+            BUG();
+        }
+    }
+
+    if (pmu_has_event(PMU_EVENT_INSTRUCTIONS) && pmu_has_event(PMU_EVENT_CYCLES)) {
+        pmu_event_t events[] = {PMU_EVENT_INSTRUCTIONS, PMU_EVENT_CYCLES};
+        uint64_t values[ARRAY_SIZE(events)];
+
+        printk("\nPMU testing:\n");
+        BUG_ON(pmu_setup(events, ARRAY_SIZE(events)) < 0);
+        pmu_start();
+        for (unsigned int i = 0; i < 1000; i++)
+            asm volatile("nop");
+        pmu_stop();
+        pmu_read(values);
+        pmu_release();
+
+        printk("1000 nops: %lu instructions, %lu cycles\n", values[0], values[1]);
+        if (values[0] < 1000) {
+            printk("PMU counted too few instructions\n");
+            BUG();
+        }
+
+        if (profiler_begin(PMU_EVENT_CYCLES, PROFILER_DEFAULT_PERIOD) == 0) {
+            unsigned long samples;
+
+            profiler_enter();
+            mdelay(10);
+            profiler_exit();
+            samples = profiler_report(__func__);
+            profiler_end();
+
+            printk("Profiler took %lu samples in 10ms\n", samples);
+        }
+    }
+
     task_t *task1, *task2, *task_user1, *task_user1_se, *task_user1_int80, *task_user2,
         *task_user3, *task_user4;
 
@@ -220,3 +487,4 @@ int unit_tests(void *_unused) {
 
     return 0;
 }
+REGISTER_TEST(unit_tests, unit_tests, .exclusive = true, .tags = "unit");
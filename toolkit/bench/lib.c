@@ -0,0 +1,187 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <console.h>
+#include <errno.h>
+#include <ktf.h>
+#include <lib.h>
+#include <string.h>
+
+#include <mm/vmm.h>
+
+#include <smp/smp.h>
+
+#include <toolkit/bench/lib.h>
+
+#define BENCH_OVERHEAD_REPS 64
+
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static uint64_t isqrt(uint64_t n) {
+    uint64_t x = n, y = (n + 1) / 2;
+
+    while (y < x) {
+        x = y;
+        y = (x + n / x) / 2;
+    }
+
+    return x;
+}
+
+/* Value at the given percentile of a sorted array (nearest-rank) */
+static inline uint64_t bench_percentile(const uint64_t *sorted, unsigned int n,
+                                        unsigned int pct) {
+    unsigned int rank = div_round_up(n * pct, 100);
+
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/* Cost of the timestamp pair itself, with an empty body */
+static uint64_t bench_overhead(bench_serialize_t serialize) {
+    uint64_t overhead = _U64(-1);
+
+    for (unsigned int i = 0; i < BENCH_OVERHEAD_REPS; i++) {
+        uint64_t t0 = bench_tsc_start(serialize);
+
+        overhead = min(overhead, bench_tsc_end(serialize) - t0);
+    }
+
+    return overhead;
+}
+
+int bench_begin(bench_t *b, const char *name, const bench_opts_t *opts) {
+    size_t size;
+
+    memset(b, 0, sizeof(*b));
+    if (opts)
+        b->opts = *opts;
+    b->result.name = name;
+
+    if (b->opts.warmup == 0)
+        b->opts.warmup = BENCH_DEFAULT_WARMUP;
+    if (b->opts.reps == 0)
+        b->opts.reps = BENCH_DEFAULT_REPS;
+    if (b->opts.reps > BENCH_MAX_REPS)
+        return -EINVAL;
+    if (b->opts.inner == 0)
+        b->opts.inner = 1;
+
+    size = b->opts.reps * sizeof(*b->samples);
+    b->order = size > PAGE_SIZE ? PAGE_ORDER_2M : PAGE_ORDER_4K;
+    b->samples = get_free_pages(b->order, GFP_KERNEL_MAP);
+    if (!b->samples)
+        return -ENOMEM;
+
+    if (!b->opts.irq_on)
+        b->flags = interrupts_disable_save();
+
+    b->result.overhead = bench_overhead(b->opts.serialize);
+    return 0;
+}
+
+bool bench_next(bench_t *b) {
+    return ++b->iter <= b->opts.warmup + b->opts.reps;
+}
+
+static void bench_stats(bench_t *b) {
+    bench_result_t *r = &b->result;
+    unsigned int n = b->opts.reps, lo = 0, hi = n;
+    uint64_t *s = b->samples;
+    unsigned __int128 var = 0;
+    unsigned int shift = 0;
+    uint64_t sum = 0;
+
+    for (unsigned int i = 0; i < n; i++) {
+        s[i] = s[i] > r->overhead ? s[i] - r->overhead : 0;
+        s[i] /= b->opts.inner;
+    }
+
+    sort(s, n, sizeof(*s), bench_cmp);
+
+    if (!b->opts.keep_outliers && n >= 4) {
+        uint64_t q1 = bench_percentile(s, n, 25), q3 = bench_percentile(s, n, 75);
+        uint64_t fence = (q3 - q1) * BENCH_OUTLIER_IQR_K;
+        uint64_t low = q1 > fence ? q1 - fence : 0, high = q3 + fence;
+
+        while (lo < hi && s[lo] < low)
+            lo++;
+        while (hi > lo && s[hi - 1] > high)
+            hi--;
+    }
+
+    s += lo;
+    n = hi - lo;
+    r->outliers = b->opts.reps - n;
+    r->samples = n;
+
+    r->min = s[0];
+    r->max = s[n - 1];
+    r->median = n % 2 ? s[n / 2] : (s[n / 2 - 1] + s[n / 2]) / 2;
+    r->p99 = bench_percentile(s, n, 99);
+
+    for (unsigned int i = 0; i < n; i++)
+        sum += s[i];
+    r->mean = sum / n;
+
+    for (unsigned int i = 0; i < n; i++) {
+        uint64_t d = s[i] > r->mean ? s[i] - r->mean : r->mean - s[i];
+
+        var += (unsigned __int128) d * d;
+    }
+
+    /* Squared cycle deltas overflow 64 bits on long samples. There is no 128 bit
+     * division, so scale the sum down by 4^shift and the root back up by 2^shift.
+     */
+    while (var >> 64) {
+        var >>= 2;
+        shift++;
+    }
+    r->stddev = isqrt((uint64_t) var / n) << shift;
+}
+
+void bench_end(bench_t *b, bench_result_t *result) {
+    if (!b->opts.irq_on)
+        interrupts_restore(b->flags);
+
+    bench_stats(b);
+    put_pages(b->samples, b->order);
+    b->samples = NULL;
+
+    if (!b->opts.quiet)
+        bench_print(&b->result);
+    if (result)
+        *result = b->result;
+}
+
+/* One line per benchmark, key=value pairs for easy parsing */
+void bench_print(const bench_result_t *r) {
+    printk("BENCH name=%s cpu=%u samples=%u outliers=%u overhead=%lu min=%lu "
+           "median=%lu p99=%lu max=%lu mean=%lu stddev=%lu unit=cycles\n",
+           r->name, smp_processor_id(), r->samples, r->outliers, r->overhead, r->min,
+           r->median, r->p99, r->max, r->mean, r->stddev);
+}
@@ -0,0 +1,284 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <console.h>
+#include <cpu.h>
+#include <errno.h>
+#include <ktf.h>
+#include <lib.h>
+#include <list.h>
+#include <spinlock.h>
+#include <string.h>
+
+#include <mm/slab.h>
+#include <mm/vmm.h>
+
+#include <smp/smp.h>
+
+#include <toolkit/cache/lib.h>
+
+static void *evset_pool[CACHE_EVSET_POOL_MAX_PAGES];
+static unsigned int evset_pool_pages;
+static spinlock_t evset_pool_lock = SPINLOCK_INIT;
+
+static list_head_t evsets = LIST_INIT(evsets);
+static spinlock_t evsets_lock = SPINLOCK_INIT;
+
+static void evset_pool_release(void) {
+    while (evset_pool_pages > 0)
+        put_pages(evset_pool[--evset_pool_pages], PAGE_ORDER_2M);
+}
+
+/* Candidate lines come from 2M pages, so their physical set index bits up to bit 20
+ * are known and cover every LLC set sharing the target's page offset. The lines at
+ * one page offset are spread over all page colors of the LLC, so the pool needs to
+ * be twice the LLC size to leave enough congruent candidates for every way.
+ */
+static int evset_pool_init(void) {
+    const cpu_cache_info_t *llc = get_cpu_llc_info(get_cpu(smp_processor_id()));
+    unsigned int pages = CACHE_EVSET_POOL_MIN_PAGES;
+
+    if (llc) {
+        pages = max(pages, (unsigned int) div_round_up(2 * llc->size, PAGE_SIZE_2M));
+        if (pages > CACHE_EVSET_POOL_MAX_PAGES) {
+            warning("Eviction set pool capped at %u 2M pages for a %lu KB LLC",
+                    CACHE_EVSET_POOL_MAX_PAGES, llc->size / KB(1));
+            pages = CACHE_EVSET_POOL_MAX_PAGES;
+        }
+    }
+
+    while (evset_pool_pages < pages) {
+        void *page = get_free_pages(PAGE_ORDER_2M, GFP_KERNEL_MAP);
+
+        if (!page)
+            break;
+        evset_pool[evset_pool_pages++] = page;
+    }
+
+    if (evset_pool_pages < pages) {
+        warning("Eviction set pool too small: only %u of %u 2M pages available",
+                evset_pool_pages, pages);
+        evset_pool_release();
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/* Chain the lines into a doubly linked list in the given order */
+static void evset_link(cache_evset_line_t **lines, unsigned int nr) {
+    for (unsigned int i = 0; i < nr; i++) {
+        lines[i]->next = i + 1 < nr ? lines[i + 1] : NULL;
+        lines[i]->prev = i > 0 ? lines[i - 1] : NULL;
+    }
+}
+
+static inline void evset_walk(const cache_evset_line_t *p) {
+    asm volatile("1: mov (%0), %0;"
+                 "test %0, %0;"
+                 "jnz 1b;"
+                 : "+r"(p)
+                 :
+                 : "memory");
+}
+
+/* Does walking the lines evict the target? Majority vote over several trials. */
+static bool evset_evicts(cache_evset_line_t **lines, unsigned int nr, const void *target,
+                         uint32_t threshold) {
+    unsigned int evicted = 0;
+
+    if (nr == 0)
+        return false;
+
+    evset_link(lines, nr);
+    for (unsigned int i = 0; i < CACHE_EVSET_TRIALS; i++) {
+        cache_read_access_barrier(target);
+        evset_walk(lines[0]);
+        evset_walk(lines[0]);
+        if (cache_read_access_time(target) > threshold)
+            evicted++;
+    }
+
+    return evicted > CACHE_EVSET_TRIALS / 2;
+}
+
+/* Group testing reduction: split the candidates into ways + 1 groups, at least one
+ * of which holds no congruent line and can be dropped while the rest still evicts.
+ */
+static int evset_reduce(cache_evset_line_t **lines, unsigned int *nr, unsigned int ways,
+                        const void *target, uint32_t threshold,
+                        cache_evset_line_t **tmp) {
+    while (*nr > ways) {
+        unsigned int groups = min(ways + 1, *nr);
+        bool reduced = false;
+
+        for (unsigned int g = 0; g < groups; g++) {
+            unsigned int start = g * *nr / groups, end = (g + 1) * *nr / groups;
+            unsigned int n = 0;
+
+            for (unsigned int i = 0; i < *nr; i++) {
+                if (i < start || i >= end)
+                    tmp[n++] = lines[i];
+            }
+
+            if (evset_evicts(tmp, n, target, threshold)) {
+                memcpy(lines, tmp, n * sizeof(*lines));
+                *nr = n;
+                reduced = true;
+                break;
+            }
+        }
+
+        if (!reduced)
+            return -EAGAIN;
+    }
+
+    return 0;
+}
+
+static void evset_shuffle(cache_evset_line_t **lines, unsigned int nr) {
+    for (unsigned int i = nr - 1; i > 0; i--) {
+        unsigned int j = rand() % (i + 1);
+        cache_evset_line_t *line = lines[i];
+
+        lines[i] = lines[j];
+        lines[j] = line;
+    }
+}
+
+static int evset_build(cache_evset_t *evset) {
+    unsigned long offset = _ul(evset->target) & ~PAGE_MASK & ~(CACHE_LINE_SIZE - 1UL);
+    cache_evset_line_t **lines, **tmp;
+    unsigned int nr = 0;
+    int rc = -EAGAIN;
+
+    lines = get_free_pages(PAGE_ORDER_2M, GFP_KERNEL_MAP);
+    if (!lines)
+        return -ENOMEM;
+    tmp = lines + evset_pool_pages * (PAGE_SIZE_2M / PAGE_SIZE);
+
+    for (unsigned int attempt = 0; attempt < CACHE_EVSET_ATTEMPTS && rc < 0; attempt++) {
+        nr = 0;
+        for (unsigned int p = 0; p < evset_pool_pages; p++) {
+            for (unsigned long off = offset; off < PAGE_SIZE_2M; off += PAGE_SIZE)
+                lines[nr++] = evset_pool[p] + off;
+        }
+
+        /* Random order defeats the prefetchers during the walks */
+        evset_shuffle(lines, nr);
+
+        if (!evset_evicts(lines, nr, evset->target, evset->threshold)) {
+            rc = -ENOENT;
+            break;
+        }
+
+        rc = evset_reduce(lines, &nr, evset->ways, evset->target, evset->threshold, tmp);
+    }
+
+    if (rc == 0) {
+        memcpy(evset->lines, lines, nr * sizeof(*lines));
+        evset_link(evset->lines, nr);
+        evset->head = evset->lines[0];
+        evset->tail = evset->lines[nr - 1];
+    }
+
+    put_pages(lines, PAGE_ORDER_2M);
+    return rc;
+}
+
+/* Eviction set for the cache line holding target, discovered on first use and cached
+ * for later tests. ways is the associativity of the cache level to evict from.
+ */
+const cache_evset_t *cache_evset_get(const void *target, unsigned ways) {
+    const void *line = _ptr(_ul(target) & ~(CACHE_LINE_SIZE - 1UL));
+    cache_evset_t *evset;
+    int rc;
+
+    if (ways == 0 || ways > CACHE_EVSET_MAX_WAYS)
+        return NULL;
+
+    spin_lock(&evsets_lock);
+    list_for_each_entry (evset, &evsets, list) {
+        if (evset->target == line && evset->ways == ways) {
+            spin_unlock(&evsets_lock);
+            return evset;
+        }
+    }
+    spin_unlock(&evsets_lock);
+
+    spin_lock(&evset_pool_lock);
+    rc = evset_pool_pages == 0 ? evset_pool_init() : 0;
+    spin_unlock(&evset_pool_lock);
+    if (rc < 0)
+        return NULL;
+
+    evset = kzalloc(sizeof(*evset));
+    if (!evset)
+        return NULL;
+
+    evset->target = line;
+    evset->ways = ways;
+    evset->threshold = cache_threshold(line, WB);
+
+    rc = evset_build(evset);
+    if (rc < 0) {
+        warning("Unable to find eviction set for %p: %d", line, rc);
+        kfree(evset);
+        return NULL;
+    }
+
+    spin_lock(&evsets_lock);
+    list_add_tail(&evset->list, &evsets);
+    spin_unlock(&evsets_lock);
+
+    return evset;
+}
+
+/* Free all eviction sets and the candidate pool, none of the sets may be in use */
+void cache_evset_release_all(void) {
+    cache_evset_t *evset, *safe;
+
+    spin_lock(&evsets_lock);
+    list_for_each_entry_safe (evset, safe, &evsets, list) {
+        list_unlink(&evset->list);
+        kfree(evset);
+    }
+    spin_unlock(&evsets_lock);
+
+    spin_lock(&evset_pool_lock);
+    evset_pool_release();
+    spin_unlock(&evset_pool_lock);
+}
+
+/* Evict+Time: cycles taken by fn right after its data was evicted via the set */
+uint64_t cache_evict_time(const cache_evset_t *evset, void (*fn)(void *arg), void *arg) {
+    uint64_t start;
+
+    cache_evset_prime(evset);
+    cache_evset_prime(evset);
+
+    start = rdtsc_ordered();
+    fn(arg);
+    return rdtsc_ordered() - start;
+}
@@ -22,11 +22,22 @@
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#include <console.h>
+#include <errno.h>
 #include <ktf.h>
 #include <lib.h>
+#include <list.h>
+#include <spinlock.h>
+#include <string.h>
+
+#include <mm/slab.h>
+#include <smp/smp.h>
 
 #include <toolkit/cache/lib.h>
 
+static list_head_t calibrations = LIST_INIT(calibrations);
+static spinlock_t calibrations_lock = SPINLOCK_INIT;
+
 /* Calculate average baseline for the specified cache line timing access.
  * Calculate first intermediate average without flushing and then second
  * intermediate average based on samples collected right after flushing
@@ -72,3 +83,232 @@ uint64_t cache_channel_baseline(const cache_line_t *cl, unsigned delay) {
 
     return baseline;
 }
+
+static inline void cache_hist_add(cache_hist_t *hist, uint32_t cycles) {
+    uint32_t bucket = min(cycles >> CACHE_HIST_SHIFT, (uint32_t) CACHE_HIST_BUCKETS - 1);
+
+    hist->buckets[bucket]++;
+    hist->samples++;
+    hist->min = min(hist->min, cycles);
+    hist->max = max(hist->max, cycles);
+}
+
+/* Lower bound of the bucket holding the median sample */
+static uint32_t cache_hist_median(const cache_hist_t *hist) {
+    uint32_t sum = 0;
+
+    for (unsigned int i = 0; i < CACHE_HIST_BUCKETS; i++) {
+        sum += hist->buckets[i];
+        if (sum * 2 >= hist->samples)
+            return i << CACHE_HIST_SHIFT;
+    }
+
+    return hist->max;
+}
+
+/* Pick the bucket boundary minimizing hits classified as misses plus misses
+ * classified as hits. Among equally good boundaries the middle one is taken,
+ * which keeps the threshold away from both distributions.
+ */
+static void cache_find_threshold(cache_calibration_t *calib) {
+    uint32_t hits_above = calib->hit.samples, misses_below = 0;
+    uint32_t best = ~_U32(0);
+    unsigned int first = 0, last = 0;
+
+    for (unsigned int i = 0; i <= CACHE_HIST_BUCKETS; i++) {
+        uint32_t errors = hits_above + misses_below;
+
+        if (errors < best) {
+            best = errors;
+            first = last = i;
+        }
+        else if (errors == best && last + 1 == i)
+            last = i;
+
+        if (i < CACHE_HIST_BUCKETS) {
+            hits_above -= calib->hit.buckets[i];
+            misses_below += calib->miss.buckets[i];
+        }
+    }
+
+    calib->threshold = ((first + last) / 2) << CACHE_HIST_SHIFT;
+    calib->errors = best;
+    calib->confidence =
+        (calib->hit.samples + calib->miss.samples - best) * 1000 /
+        (calib->hit.samples + calib->miss.samples);
+}
+
+/* Collect full hit and miss latency histograms of the cache line on the current CPU
+ * and derive the hit/miss threshold from them. The caller tells the memory type the
+ * line is mapped with; the result is also remembered for cache_threshold().
+ */
+int cache_calibrate(const cache_line_t *cl, pat_memory_type_t type,
+                    cache_calibration_t *calib) {
+    cache_calibration_t *cached;
+    unsigned long flags;
+    bool found = false;
+
+    memset(calib, 0, sizeof(*calib));
+    calib->cpu = smp_processor_id();
+    calib->type = type;
+    calib->hit.min = calib->miss.min = ~_U32(0);
+
+    flags = interrupts_disable_save();
+    /* Interleave both kinds of samples so that frequency drift affects them alike */
+    for (unsigned int i = 0; i < CACHE_CALIB_SAMPLES; i++) {
+        cache_read_access(cl);
+        cache_hist_add(&calib->hit, cache_read_access_time(cl));
+
+        clflush(cl);
+        cache_hist_add(&calib->miss, cache_read_access_time(cl));
+    }
+    interrupts_restore(flags);
+
+    calib->hit.median = cache_hist_median(&calib->hit);
+    calib->miss.median = cache_hist_median(&calib->miss);
+    cache_find_threshold(calib);
+
+    spin_lock(&calibrations_lock);
+    list_for_each_entry (cached, &calibrations, list) {
+        if (cached->cpu == calib->cpu && cached->type == type) {
+            found = true;
+            break;
+        }
+    }
+    if (!found) {
+        cached = kmalloc(sizeof(*cached));
+        if (cached)
+            list_add_tail(&cached->list, &calibrations);
+    }
+    if (cached) {
+        list_head_t list = cached->list;
+
+        *cached = *calib;
+        cached->list = list;
+    }
+    spin_unlock(&calibrations_lock);
+
+    return cached ? 0 : -ENOMEM;
+}
+
+/* Copy out the last calibration for cpu and type. Recalibration updates the cached
+ * entry in place, so it is only ever read under the lock.
+ */
+int cache_get_calibration(unsigned int cpu, pat_memory_type_t type,
+                          cache_calibration_t *calib) {
+    cache_calibration_t *cached;
+    int rc = -ENOENT;
+
+    spin_lock(&calibrations_lock);
+    list_for_each_entry (cached, &calibrations, list) {
+        if (cached->cpu == cpu && cached->type == type) {
+            *calib = *cached;
+            list_init(&calib->list);
+            rc = 0;
+            break;
+        }
+    }
+    spin_unlock(&calibrations_lock);
+
+    return rc;
+}
+
+/* Hit/miss threshold for the current CPU and memory type, calibrated on first use */
+unsigned cache_threshold(const cache_line_t *cl, pat_memory_type_t type) {
+    cache_calibration_t calib;
+
+    if (cache_get_calibration(smp_processor_id(), type, &calib) == 0)
+        return calib.threshold;
+
+    cache_calibrate(cl, type, &calib);
+    cache_print_calibration(&calib);
+    return calib.threshold;
+}
+
+void cache_print_calibration(const cache_calibration_t *calib) {
+    printk("CACHE cpu=%u type=%u threshold=%u confidence=%u.%u%% errors=%u "
+           "hit_min=%u hit_median=%u hit_max=%u miss_min=%u miss_median=%u "
+           "miss_max=%u\n",
+           calib->cpu, calib->type, calib->threshold, calib->confidence / 10,
+           calib->confidence % 10, calib->errors, calib->hit.min, calib->hit.median,
+           calib->hit.max, calib->miss.min, calib->miss.median, calib->miss.max);
+}
+
+/* Lines sharing a 128 byte pair are fetched together by the spatial prefetcher */
+static inline bool cache_lines_adjacent(uint16_t a, uint16_t b) {
+    return (a >> 1) == (b >> 1) || a + 1 == b || b + 1 == a;
+}
+
+/* Random probe order in which consecutive visits never touch neighbouring lines,
+ * so neither the adjacent line nor the stride prefetchers can run ahead of it.
+ */
+void cache_probe_order(uint16_t *order, unsigned nr) {
+    ASSERT(nr <= CACHE_PROBE_MAX_LINES);
+
+    for (unsigned i = 0; i < nr; i++)
+        order[i] = i;
+
+    if (nr < 2)
+        return;
+
+    for (unsigned i = nr - 1; i > 0; i--) {
+        unsigned j = rand() % (i + 1);
+        uint16_t tmp = order[i];
+
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    /* Break up neighbouring visits; a few leftovers are fine for small batches */
+    for (unsigned i = 1; i < nr; i++) {
+        for (unsigned tries = 0;
+             tries < nr && cache_lines_adjacent(order[i - 1], order[i]); tries++) {
+            unsigned j = i + rand() % (nr - i);
+            uint16_t tmp = order[i];
+
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+    }
+}
+
+/* Set bit i of hits[] for every lat[i] below threshold, returns the number of hits.
+ * Branchless and word at a time: SIMD is not available in the kernel.
+ */
+unsigned cache_classify_lines(const uint32_t *lat, unsigned nr, uint32_t threshold,
+                              uint64_t *hits) {
+    unsigned count = 0;
+
+    ASSERT(nr <= CACHE_PROBE_MAX_LINES);
+
+    for (unsigned w = 0; w < CACHE_PROBE_WORDS(nr); w++) {
+        unsigned n = min(nr - w * 64, 64U);
+        const uint32_t *l = &lat[w * 64];
+        uint64_t word = 0;
+
+        for (unsigned i = 0; i < n; i++) {
+            uint64_t hit = l[i] < threshold;
+
+            word |= hit << i;
+            count += hit;
+        }
+
+        hits[w] = word;
+    }
+
+    return count;
+}
+
+/* Probe all lines of a cache channel in a fresh random order */
+unsigned cache_channel_probe(const cache_channel_t *channel, uint32_t threshold,
+                             uint32_t *lat, uint64_t *hits) {
+    uint16_t order[CACHE_CHANNEL_LINES];
+
+    BUILD_BUG_ON(CACHE_CHANNEL_LINES > CACHE_PROBE_MAX_LINES);
+
+    cache_probe_order(order, ARRAY_SIZE(order));
+    cache_probe_lines(channel->lines, sizeof(channel->lines[0]), order, ARRAY_SIZE(order),
+                      lat);
+
+    return cache_classify_lines(lat, CACHE_CHANNEL_LINES, threshold, hits);
+}
@@ -0,0 +1,375 @@
+/*
+ * Copyright © 2023 Open Source Security, Inc.
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <console.h>
+#include <cpu.h>
+#include <errno.h>
+#include <ktf.h>
+#include <lib.h>
+#include <sched.h>
+#include <string.h>
+
+#include <mm/slab.h>
+#include <mm/vmm.h>
+
+#include <smp/smp.h>
+
+#include <toolkit/spec/lib.h>
+
+/* Instruction encodings used by the generator */
+#define OP_XOR_EAX_EAX 0x31, 0xc0
+#define OP_JZ_REL32    0x0f, 0x84
+#define OP_JMP_REL32   0xe9
+#define OP_JMP_REL8    0xeb
+#define OP_CALL_REL32  0xe8
+#define OP_LOAD_RDI    0x48, 0x8b, 0x07 /* mov (%rdi), %rax */
+#define OP_ADD_RSP_8   0x48, 0x83, 0xc4, 0x08
+#define OP_UD2         0x0f, 0x0b
+#define OP_RET         0xc3
+#define OP_NOP         0x90
+#define OP_INT3        0xcc
+
+#define JMP_REL32_LEN 5
+
+static const uint8_t op_load[] = {OP_LOAD_RDI};
+static const uint8_t op_ud2[] = {OP_UD2};
+static const uint8_t op_ret[] = {OP_RET};
+static const uint8_t op_call_ret[] = {OP_ADD_RSP_8, OP_RET};
+
+static uint8_t *emit(uint8_t *p, const uint8_t *bytes, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        *p++ = bytes[i];
+
+    return p;
+}
+
+static uint8_t *emit_fill(uint8_t *p, uint8_t byte, size_t len) {
+    memset(p, byte, len);
+    return p + len;
+}
+
+/* rel32 is relative to the end of the instruction, which the displacement ends */
+static uint8_t *emit_rel32(uint8_t *p, const uint8_t *target) {
+    int32_t rel = (int32_t) (target - (p + sizeof(rel)));
+
+    for (unsigned int i = 0; i < sizeof(rel); i++)
+        *p++ = (uint8_t) (rel >> (i * 8));
+
+    return p;
+}
+
+/* xor sets ZF ahead of the jz, so it is always taken */
+static size_t branch_prefix_len(spec_branch_t branch) {
+    return branch == SPEC_BRANCH_JCC ? 2 : 0;
+}
+
+static size_t branch_len(spec_branch_t branch) {
+    return branch == SPEC_BRANCH_JCC ? 6 : JMP_REL32_LEN;
+}
+
+/* Emit the branch instruction at p, preceded by its prefix */
+static uint8_t *emit_branch(uint8_t *p, spec_branch_t branch, const uint8_t *target) {
+    static const uint8_t op_xor[] = {OP_XOR_EAX_EAX};
+    static const uint8_t op_jcc[] = {OP_JZ_REL32};
+    static const uint8_t op_jmp[] = {OP_JMP_REL32};
+    static const uint8_t op_call[] = {OP_CALL_REL32};
+
+    switch (branch) {
+    case SPEC_BRANCH_JCC:
+        emit(p - branch_prefix_len(branch), op_xor, sizeof(op_xor));
+        p = emit(p, op_jcc, sizeof(op_jcc));
+        break;
+    case SPEC_BRANCH_JMP:
+        p = emit(p, op_jmp, sizeof(op_jmp));
+        break;
+    case SPEC_BRANCH_CALL:
+        p = emit(p, op_call, sizeof(op_call));
+        break;
+    default:
+        BUG();
+    }
+
+    return emit_rel32(p, target);
+}
+
+/* The branch target returns to the gadget caller, dropping a call's return address */
+static uint8_t *emit_target(uint8_t *p, spec_branch_t branch) {
+    if (branch == SPEC_BRANCH_CALL)
+        return emit(p, op_call_ret, sizeof(op_call_ret));
+
+    return emit(p, op_ret, sizeof(op_ret));
+}
+
+static size_t target_len(spec_branch_t branch) {
+    return branch == SPEC_BRANCH_CALL ? sizeof(op_call_ret) : sizeof(op_ret);
+}
+
+/* 64 byte blocks of two taken jumps each, followed by a ret */
+static void *emit_btb_flush(uint8_t *p) {
+    static const uint8_t jmp_30[] = {OP_JMP_REL8, 30};
+    static const uint8_t jmp_29[] = {OP_JMP_REL8, 29};
+    void *start = p;
+
+    for (unsigned int i = 0; i < SPEC_BTB_FLUSH_BLOCKS; i++) {
+        p = emit(p, jmp_30, sizeof(jmp_30));
+        p = emit_fill(p, OP_NOP, 30);
+        p = emit(p, jmp_29, sizeof(jmp_29));
+        p = emit_fill(p, OP_NOP, 29 + 1);
+    }
+    emit(p, op_ret, sizeof(op_ret));
+
+    return start;
+}
+
+int spec_jit_init(spec_jit_t *jit) {
+    BUILD_BUG_ON(SPEC_BTB_FLUSH_BLOCKS * SPEC_FETCH_BLOCK_SIZE >=
+                 SPEC_JIT_SIZE - SPEC_JIT_BTB_OFFSET);
+
+    memset(jit, 0, sizeof(*jit));
+
+    /* Kernel mappings are executable */
+    jit->base = get_free_pages(PAGE_ORDER_2M, GFP_KERNEL_MAP);
+    if (!jit->base)
+        return -ENOMEM;
+
+    memset(jit->base, OP_INT3, SPEC_JIT_SIZE);
+    jit->btb_flush = emit_btb_flush(jit->base + SPEC_JIT_BTB_OFFSET);
+
+    return 0;
+}
+
+void spec_jit_release(spec_jit_t *jit) {
+    if (jit->base)
+        put_pages(jit->base, PAGE_ORDER_2M);
+    memset(jit, 0, sizeof(*jit));
+}
+
+/*
+ * Forward gadgets:  [xor] site: branch target; load; int3 padding; target: ret
+ * Backward gadgets: jmp [xor]; target: ret; int3 padding; [xor] site: branch target;
+ *                   load; ud2
+ * The load only ever executes speculatively, when the branch is mispredicted as not
+ * taken. Each gadget gets its own page sized slot, prefilled with int3. The branch
+ * instruction itself sits at the requested fetch block offset. Forward gadgets honor
+ * the requested distance, backward ones pad it up to the next site at that offset.
+ */
+int spec_gadget_build(spec_jit_t *jit, const spec_gadget_desc_t *desc,
+                      spec_gadget_t *gadget) {
+    uint8_t *slot, *site, *target, *p;
+
+    if (desc->branch >= SPEC_BRANCH_MAX || desc->distance > SPEC_MAX_DISTANCE ||
+        desc->offset >= SPEC_FETCH_BLOCK_SIZE || desc->probe_line >= CACHE_CHANNEL_LINES)
+        return -EINVAL;
+
+    if (jit->nr_gadgets == SPEC_JIT_MAX_GADGETS)
+        return -ENOMEM;
+
+    slot = jit->base + jit->nr_gadgets * SPEC_JIT_SLOT_SIZE;
+
+    if (desc->dir == SPEC_FORWARD) {
+        /* The first fetch block leaves room for the branch prefix */
+        site = slot + SPEC_FETCH_BLOCK_SIZE + desc->offset;
+        target = site + branch_len(desc->branch) + sizeof(op_load) + desc->distance;
+
+        p = emit_branch(site, desc->branch, target);
+        emit(p, op_load, sizeof(op_load));
+        emit_target(target, desc->branch);
+        gadget->entry = (void *) (site - branch_prefix_len(desc->branch));
+        gadget->distance = desc->distance;
+    }
+    else {
+        unsigned int prefix = branch_prefix_len(desc->branch);
+        uint8_t *pad_start;
+
+        target = slot + JMP_REL32_LEN;
+        pad_start = target + target_len(desc->branch);
+        site = pad_start + max(desc->distance, prefix);
+        site += (desc->offset - _ul(site)) & (SPEC_FETCH_BLOCK_SIZE - 1);
+
+        p = emit_branch(slot, SPEC_BRANCH_JMP, site - prefix);
+        emit_target(p, desc->branch);
+        p = emit_branch(site, desc->branch, target);
+        p = emit(p, op_load, sizeof(op_load));
+        emit(p, op_ud2, sizeof(op_ud2));
+        gadget->entry = (void *) slot;
+        gadget->distance = site - pad_start;
+    }
+
+    gadget->desc = *desc;
+    gadget->jit = jit;
+    jit->nr_gadgets++;
+
+    return 0;
+}
+
+/* Count how often the probe line, loaded only in the gadget's branch shadow, turns up
+ * cached. A line half a channel away, never touched, gives the false positive rate.
+ */
+void spec_gadget_run(const spec_gadget_t *gadget, const cache_channel_t *channel,
+                     const spec_run_opts_t *opts, spec_result_t *res) {
+    unsigned int control_line = (gadget->desc.probe_line + CACHE_CHANNEL_LINES / 2) %
+                                CACHE_CHANNEL_LINES;
+    const cache_line_t *probe = &channel->lines[gadget->desc.probe_line];
+    const cache_line_t *control = &channel->lines[control_line];
+    unsigned long flags;
+
+    memset(res, 0, sizeof(*res));
+    res->cpu = smp_processor_id();
+    res->iterations = opts->iterations;
+    res->threshold = cache_threshold(probe, WB);
+
+    flags = interrupts_disable_save();
+    for (unsigned int i = 0; i < opts->iterations; i++) {
+        if (opts->flush_btb)
+            gadget->jit->btb_flush();
+
+        clflush(probe);
+        clflush(control);
+        mfence();
+
+        gadget->entry(probe);
+
+        res->hits += cache_probe_time(probe) < res->threshold;
+        res->control_hits += cache_probe_time(control) < res->threshold;
+    }
+    interrupts_restore(flags);
+}
+
+void spec_print_result(const char *name, const spec_gadget_t *gadget,
+                       const spec_result_t *res) {
+    const spec_gadget_desc_t *desc = &gadget->desc;
+
+    printk("SPEC test=%s cpu=%u branch=%s dir=%s distance=%u offset=%u line=%u "
+           "iterations=%u hits=%u control=%u threshold=%u\n",
+           name, res->cpu, spec_branch_name(desc->branch), spec_direction_name(desc->dir),
+           gadget->distance, desc->offset, desc->probe_line, res->iterations, res->hits,
+           res->control_hits, res->threshold);
+}
+
+/* One matrix run per CPU, the task records its return code here */
+struct spec_matrix_run {
+    const spec_matrix_t *matrix;
+    int rc;
+};
+typedef struct spec_matrix_run spec_matrix_run_t;
+
+static unsigned long spec_matrix_task(void *arg) {
+    spec_matrix_run_t *run = arg;
+    const spec_matrix_t *matrix = run->matrix;
+    cache_channel_t *channel;
+    spec_gadget_t gadget;
+    spec_result_t res;
+    spec_jit_t jit;
+    int rc;
+
+    rc = spec_jit_init(&jit);
+    if (rc < 0)
+        goto done;
+
+    channel = get_free_pages(PAGE_ORDER_4K, GFP_KERNEL_MAP);
+    if (!channel) {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    for (unsigned int i = 0; i < matrix->nr; i++) {
+        rc = spec_gadget_build(&jit, &matrix->descs[i], &gadget);
+        if (rc < 0) {
+            warning("%s: unable to build gadget %u: %d", matrix->name, i, rc);
+            break;
+        }
+
+        for (unsigned int round = 0; round < matrix->opts.rounds; round++) {
+            spec_gadget_run(&gadget, channel, &matrix->opts, &res);
+            spec_print_result(matrix->name, &gadget, &res);
+        }
+    }
+
+    put_pages(channel, PAGE_ORDER_4K);
+out:
+    spec_jit_release(&jit);
+done:
+    ACCESS_ONCE(run->rc) = rc;
+    return rc;
+}
+
+static const spec_matrix_t *spec_current_matrix;
+static spec_matrix_run_t *spec_current_runs;
+static int spec_schedule_rc;
+
+static void spec_schedule_cpu(cpu_t *cpu) {
+    spec_matrix_run_t *run = &spec_current_runs[cpu->id];
+    task_t *task;
+
+    if (!is_cpu_enabled(cpu) || spec_schedule_rc < 0)
+        return;
+
+    run->matrix = spec_current_matrix;
+    run->rc = -EINPROGRESS;
+
+    task = new_kernel_task(spec_current_matrix->name, spec_matrix_task, run);
+    if (!task) {
+        spec_schedule_rc = -ENOMEM;
+        run->rc = 0;
+        return;
+    }
+
+    spec_schedule_rc = schedule_task(task, cpu);
+    if (spec_schedule_rc < 0)
+        run->rc = 0;
+}
+
+/* Run the gadget matrix on every enabled CPU in parallel and wait for it. The tasks
+ * build their own JIT buffer and cache channel. Returns the first failure of any CPU.
+ * Callers schedule tasks of their own, so their tests must be registered .exclusive.
+ */
+int spec_run_matrix(const spec_matrix_t *matrix) {
+    int rc;
+
+    spec_current_runs = kzalloc(get_nr_cpus() * sizeof(*spec_current_runs));
+    if (!spec_current_runs)
+        return -ENOMEM;
+
+    spec_current_matrix = matrix;
+    spec_schedule_rc = 0;
+
+    for_each_cpu(spec_schedule_cpu);
+    execute_tasks();
+
+    rc = spec_schedule_rc;
+    for (unsigned int id = 0; id < get_nr_cpus(); id++) {
+        int cpu_rc = ACCESS_ONCE(spec_current_runs[id].rc);
+
+        if (cpu_rc < 0) {
+            warning("%s: CPU%u failed: %d", matrix->name, id, cpu_rc);
+            if (rc == 0)
+                rc = cpu_rc;
+        }
+    }
+
+    kfree(spec_current_runs);
+    spec_current_runs = NULL;
+
+    return rc;
+}